@@ -0,0 +1,44 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "atoms.h"
+
+Atom atoms[ATOM_COUNT];
+
+/* Must be in the same order as the indices in atoms.h */
+static char * atomNames[ATOM_COUNT] = {
+	"Abs X",
+	"Abs Y",
+	"Abs MT Position X",
+	"Abs MT Position Y",
+	"FLOAT",
+	"Coordinate Transformation Matrix",
+	"Evdev Axis Calibration",
+	"Evdev Axis Inversion",
+	"Evdev Axes Swap",
+	"libinput Calibration Matrix"
+};
+
+/* Interns all atoms we need with a single round trip. Atoms differ between
+   X servers, so every display connection needs its own table. */
+int internAtoms(Display * display, Atom * table) {
+	return XInternAtoms(display, atomNames, ATOM_COUNT, False, table);
+}
+
+int initAtoms(Display * display) {
+	return internAtoms(display, atoms);
+}
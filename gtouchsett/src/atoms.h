@@ -0,0 +1,43 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef ATOMS_H_
+#define ATOMS_H_
+
+#include <X11/Xlib.h>
+
+/* Indices into the atoms table */
+enum {
+	ATOM_ABS_X,
+	ATOM_ABS_Y,
+	ATOM_ABS_MT_POSITION_X,
+	ATOM_ABS_MT_POSITION_Y,
+	ATOM_FLOAT,
+	ATOM_TRANSFORMATION_MATRIX,
+	ATOM_EVDEV_AXIS_CALIBRATION,
+	ATOM_EVDEV_AXIS_INVERSION,
+	ATOM_EVDEV_AXES_SWAP,
+	ATOM_LIBINPUT_CALIBRATION_MATRIX,
+	ATOM_COUNT
+};
+
+extern Atom atoms[ATOM_COUNT];
+
+int internAtoms(Display *, Atom *);
+int initAtoms(Display *);
+
+#endif /* ATOMS_H_ */
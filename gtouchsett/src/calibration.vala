@@ -1,11 +1,19 @@
 using Gtk, Gdk;
 
-extern int getLastRawCoordinates(void * display, int deviceID, out int out_x, out int out_y);
-extern void resetCalibration(void * display, int deviceID, int coordinateFactor);
+extern void * startRawSampling(void * display, int deviceID);
+extern void stopRawSampling(void * sampler);
+extern int getRawSamplerFd(void * sampler);
+extern int nextRawTap(void * sampler, out int out_x, out int out_y);
+extern void resetCalibration(void * display, int deviceID);
 
 extern void getMinMaxXY(void * display, int deviceID, out int minX, out int maxX, out int minY, out int maxY);
 
 extern int getOutputRotation(void * display, char * outputName, out int rotation, out int mirrorX, out int mirrorY);
+extern int solveCalibration(int n, [CCode (array_length = false)] float[] devX, [CCode (array_length = false)] float[] devY,
+		[CCode (array_length = false)] float[] targetX, [CCode (array_length = false)] float[] targetY, int width, int height,
+		int rotation, int mirrorX, int mirrorY, [CCode (array_length = false)] float[] matrix, [CCode (array_length = false)] float[] residuals);
+extern int getMatrixLimits([CCode (array_length = false)] float[] matrix, int minX, int maxX, int minY, int maxY,
+		out int outMinX, out int outMaxX, out int outMinY, out int outMaxY, out int swapAxes);
 
 public class Calibrator {
 	
@@ -13,36 +21,60 @@ public class Calibrator {
 	ProgressBar prgTimer;
 	Label lblDesc;
 
-	int coordMaxX;
-	int coordMaxY;
-
 	string DEFAULT_DESC = "Please tap with your stylus/finger on the cross and repeat this at every new position. To cancel the calibration, simply wait for a few seconds.";
-	string REPEAT_DESC_1 = "<b>Please try this point again.</b>";
-	string REPEAT_DESC_2 = "<b>Please try this point another time</b>";
-	string REPEAT_DESC_3 = "<b>Please try this point yet <i>another</i> time</b> (you might have to repeat this a few times until the correct scale has been determined)";
 
+	/* Crosses are shown in a square grid of up to MAX_GRID_SIZE x MAX_GRID_SIZE; the least squares
+	   fit works with any number of points from three */
+	public const int DEFAULT_POINTS = 4;
+	public const int MAX_GRID_SIZE = 5;
+	/* Cells of the table between two neighbouring crosses; the labels fit into the first gap */
+	const int GRID_SPACING = 4;
+
+	int points;
 	int tapCount = 0;
 	int timerStep = 0;
 	bool quit = false; 
-	Label cross[4];
+	Label[] cross;
 
-	int coordinateFactor = 1;
+	/* Taps relative to the axis ranges of the device, targets in pixels of the window */
+	float[] tapX;
+	float[] tapY;
+	float[] targetX;
+	float[] targetY;
 
-	int tapX[4];
-	int tapY[4];
+	int axisMinX = 0;
+	int axisMaxX = 0;
+	int axisMinY = 0;
+	int axisMaxY = 0;
 
 	void * display;
 	int deviceID;
+	void * sampler;
+	uint samplerWatch;
 	string monitorName;
 	SettingsWindow settWind;
 
 	const int steps = 120;
 
-	public Calibrator(SettingsWindow settWind, int monitor, string monitorName, void * display, int deviceID) {
+	/* Returns the number of crosses per row for a calibration with the given number of points,
+	   0 if they don't make a square grid */
+	public static int gridSize(int points) {
+		for(int size = 2; size <= MAX_GRID_SIZE; size++) {
+			if(size * size == points) return size;
+		}
+		return 0;
+	}
+
+	public Calibrator(SettingsWindow settWind, int monitor, string monitorName, void * display, int deviceID, int points) {
 		this.deviceID = deviceID;
 		this.display = display;
 		this.settWind = settWind;
 		this.monitorName = monitorName;
+		this.points = points;
+		tapX = new float[points];
+		tapY = new float[points];
+		targetX = new float[points];
+		targetY = new float[points];
 		Builder builder = new Builder();
 		try {
 			builder.add_from_file(SHARE_DIR + "/calibration.glade");
@@ -56,9 +88,7 @@ public class Calibrator {
 		lblDesc = (Label) builder.get_object("lblDesc");
 
 		prgTimer = (ProgressBar) builder.get_object("prgTimer");
-		for(int i = 0; i < 4; i++) {
-			cross[i] = (Label) builder.get_object("cross" + (i+1).to_string());
-		}
+		createCrosses(builder);
 
 		connect_signals();
 		
@@ -75,18 +105,72 @@ public class Calibrator {
 		window.fullscreen();
 		
 		/* Reset calibration so we get "raw" values */
-		resetCalibration(display, deviceID, coordinateFactor);
+		resetCalibration(display, deviceID);
+		getMinMaxXY(display, deviceID, out axisMinX, out axisMaxX, out axisMinY, out axisMaxY);
 
 		lblDesc.set_markup(DEFAULT_DESC);
 
-		int ignore;
-		getMinMaxXY(display, deviceID, out ignore, out coordMaxX, out ignore, out coordMaxY);
+		/* Taps are taken from the raw events of the device, so clicks of other devices don't count */
+		sampler = startRawSampling(display, deviceID);
+		if(sampler == null) {
+			MessageDialog md = new MessageDialog(settWind.window, Gtk.DialogFlags.MODAL, Gtk.MessageType.ERROR, Gtk.ButtonsType.CLOSE, "Unable to start calibration");
+			md.secondary_text = "The X server doesn't report the raw coordinates of the device (XInput 2.1 is required).";
+			md.run();
+			md.destroy();
+			settWind.reapplyHelper(deviceID);
+			window.destroy();
+			return;
+		}
+		IOChannel channel = new IOChannel.unix_new(getRawSamplerFd(sampler));
+		samplerWatch = channel.add_watch(IOCondition.IN, (source, condition) => {
+			handleRawEvents();
+			return true;
+		});
 
 		window.show();
 		startTimer();
 
 	}
 
+	/* Fills the table with a grid of crosses, row by row from the top left one in calibration.glade.
+	   Only the first cross is visible, each tap shows the next. */
+	void createCrosses(Builder builder) {
+		Table table = (Table) builder.get_object("table1");
+		int size = gridSize(points);
+		int cells = (size - 1) * GRID_SPACING + 1;
+		table.resize(cells, cells);
+		/* The title, the description and the timer keep their places between the corner crosses */
+		Widget title = (Widget) builder.get_object("label2");
+		table.child_set(title, "left-attach", 1, "right-attach", cells - 1, "top-attach", 0, "bottom-attach", 1);
+		table.child_set(lblDesc, "right-attach", cells, "top-attach", 1, "bottom-attach", cells - 1);
+		table.child_set(prgTimer, "left-attach", 1, "right-attach", cells - 1, "top-attach", cells - 1, "bottom-attach", cells);
+
+		cross = new Label[points];
+		cross[0] = (Label) builder.get_object("cross1");
+		for(int i = 1; i < points; i++) {
+			int left = (i % size) * GRID_SPACING;
+			int top = (i / size) * GRID_SPACING;
+			cross[i] = new Label("+");
+			cross[i].set_attributes(cross[0].get_attributes());
+			table.attach_defaults(cross[i], left, left + 1, top, top + 1);
+		}
+	}
+
+	void handleRawEvents() {
+		int absX; int absY;
+		while(sampler != null && nextRawTap(sampler, out absX, out absY) == 1) {
+			tap(absX, absY);
+		}
+	}
+
+	void stopSampling() {
+		if(sampler != null) {
+			Source.remove(samplerWatch);
+			stopRawSampling(sampler);
+			sampler = null;
+		}
+	}
+
 	void connect_signals() {
 		window.map_event.connect(() => {
 /*			Color col_black = Gdk.Color();
@@ -105,10 +189,6 @@ public class Calibrator {
 			//stdout.printf("%i, %i %i %i %i\n", s, Gdk.GrabStatus.ALREADY_GRABBED, Gdk.GrabStatus.FROZEN, Gdk.GrabStatus.INVALID_TIME, Gdk.GrabStatus.NOT_VIEWABLE);
 			return false;
 		});
-		window.button_release_event.connect(() => {
-			tap();
-			return true;
-		});
 	}
 
 	bool updateClock() {
@@ -117,6 +197,9 @@ public class Calibrator {
 			return false;
 		}
 
+		/* Events may have been read from the connection while waiting for a reply */
+		handleRawEvents();
+
 		timerStep++;
 		if(timerStep <= steps) {
 			prgTimer.set_fraction(1.0 - timerStep/((double) steps));
@@ -137,43 +220,24 @@ public class Calibrator {
 
 	}
 	
-	public void tap() {
-		int absX; int absY;
-		if(getLastRawCoordinates(display, deviceID, out absX, out absY) == 1) { 
-
-			/* Catch cases in which two taps are too near, either due to the device sending wrong
-			   coordinates or the user clicking with a different input device */
-			if(tapCount > 0 && ((absX - tapX[tapCount - 1]).abs() < 30 && (absY - tapY[tapCount - 1]).abs() < 30)) return;
-			absX *= coordinateFactor;
-			absY *= coordinateFactor;
-			tapX[tapCount] = absX;
-			tapY[tapCount] = absY;
-
-			stdout.printf("X: %i, Y: %i\n", tapX[tapCount], tapY[tapCount]);
-
-			if(absX >= coordMaxX - coordMaxX/100 || absY >= coordMaxY - coordMaxY/100) {
-				coordinateFactor *= 2;
-				resetCalibration(display, deviceID, coordinateFactor);
-				coordMaxX *= 2; coordMaxY *= 2;
-				timerStep = 0;
-				prgTimer.set_fraction(0.99);
-				if(coordinateFactor == 2) {
-					lblDesc.set_markup(REPEAT_DESC_1);
-				} else if(coordinateFactor == 4) {
-					lblDesc.set_markup(REPEAT_DESC_2);
-				} else {
-					lblDesc.set_markup(REPEAT_DESC_3);
-				}
-				return;
-			}
-			lblDesc.set_markup(DEFAULT_DESC);
+	/* Called with the median of the raw positions sampled while the device was pressed */
+	public void tap(int absX, int absY) {
+		if(tapCount < points) {
+			tapX[tapCount] = (absX - axisMinX) / (float) (axisMaxX - axisMinX);
+			tapY[tapCount] = (absY - axisMinY) / (float) (axisMaxY - axisMinY);
+			/* The center of the cross as it is shown */
+			Allocation target = cross[tapCount].allocation;
+			targetX[tapCount] = target.x + target.width / 2.0f;
+			targetY[tapCount] = target.y + target.height / 2.0f;
+
+			stdout.printf("X: %i, Y: %i\n", absX, absY);
 
 			cross[tapCount].set_visible(false);
 
 			tapCount += 1;
 			timerStep = 0;
 			prgTimer.set_fraction(0.99);
-			if(tapCount == 4) {
+			if(tapCount == points) {
 				finish();
 			} else {
 				cross[tapCount].set_visible(true);
@@ -182,16 +246,24 @@ public class Calibrator {
 	}
 
 	void cancel() {
+		stopSampling();
 		Gdk.pointer_ungrab(0);
-		/* Let helper restore original calibration */
-		settWind.reloadHelper();
+		/* Let helper restore the calibration it uses */
+		settWind.reapplyHelper(deviceID);
 		window.dispose();
 	}
 
 	void finish() {
+		stopSampling();
 		Gdk.pointer_ungrab(0);
 
-		applyCalibration();
+		if(!applyCalibration()) {
+			MessageDialog md = new MessageDialog(window, Gtk.DialogFlags.MODAL, Gtk.MessageType.ERROR, Gtk.ButtonsType.CLOSE, "Calibration failed");
+			md.secondary_text = "The taps don't match the positions of the crosses. Please try again.";
+			md.run();
+			md.destroy();
+			settWind.reapplyHelper(deviceID);
+		}
 
 //		self.window.hide();
 //		MessageDialog(self.parent, gtk.DIALOG_DESTROY_WITH_PARENT, gtk.MESSAGE_INFO, gtk.BUTTONS_CLOSE, "The calibration has been performed, please test if the touchscreen is accurate now.");
@@ -202,71 +274,50 @@ public class Calibrator {
 		window.hide();
 	}
 
-	void swap(ref int a, ref int b) {
-		int temp = a;
-		a = b;
-		b = temp;
-	}
-
-
-	void applyCalibration() {
-		settWind.autoCalibration = false;
-
-		int minX, minY, maxX, maxY;
+	/* Returns false if the taps don't determine a calibration */
+	bool applyCalibration() {
+		if(axisMaxX <= axisMinX || axisMaxY <= axisMinY) return false;
 
+		int rot = 0; int mirrX = 0; int mirrY = 0;
 		if(monitorName != null) {
-			int rot; int mirrX; int mirrY;
-			if(getOutputRotation(display, (char *) monitorName, out rot, out mirrX, out mirrY) == 1) {
-				switch(rot) {
-				case 270: 
-					int tmpX = tapX[0]; int tmpY = tapY[0];						
-					tapX[0] = tapX[2]; tapY[0] = tapY[2];
-					tapX[2] = tapX[3]; tapY[2] = tapY[3];
-					tapX[3] = tapX[1]; tapY[3] = tapY[1];
-					tapX[1] = tmpX; tapY[1] = tmpY;
-					break;
-				case 180:
-					swap(ref tapX[0], ref tapX[3]); swap(ref tapY[0], ref tapY[3]);
-					swap(ref tapX[1], ref tapX[2]); swap(ref tapY[1], ref tapY[2]);
-					break;
-				case 90:
-					int tmpX = tapX[0]; int tmpY = tapY[0];
-					tapX[0] = tapX[1]; tapY[0] = tapY[1];
-					tapX[1] = tapX[3]; tapY[1] = tapY[3];
-					tapX[3] = tapX[2]; tapY[3] = tapY[2];
-					tapX[2] = tmpX; tapY[2] = tmpY;					
-					break;
-				}
-				if(mirrX == 1) {
-					swap(ref tapX[0], ref tapX[1]);
-					swap(ref tapX[2], ref tapX[3]);
-				}
-				if(mirrY == 1) {
-					swap(ref tapY[0], ref tapY[2]);
-					swap(ref tapY[1], ref tapY[3]);
-				}
-			}
+			getOutputRotation(display, (char *) monitorName, out rot, out mirrX, out mirrY);
 		}
 
+		float[] matrix = new float[6];
+		float[] residuals = new float[points];
+		if(solveCalibration(points, tapX, tapY, targetX, targetY, window.allocation.width, window.allocation.height,
+				rot, mirrX, mirrY, matrix, residuals) == 0) {
+			return false;
+		}
 
+		/* Used where the matrix can't be */
+		int minX, maxX, minY, maxY, swap;
+		if(getMatrixLimits(matrix, axisMinX, axisMaxX, axisMinY, axisMaxY,
+				out minX, out maxX, out minY, out maxY, out swap) == 0) {
+			return false;
+		}
 
-		//TODO check if axes are inverted and correct that
-
-
-		minX = (tapX[0] + tapX[2]) / 2;
-		maxX = (tapX[1] + tapX[3]) / 2;
-		minY = (tapY[0] + tapY[1]) / 2;
-		maxY = (tapY[2] + tapY[3]) / 2;
-
-		/* Calculate real min/max values from the old values that only represent the
-		   positions of the crosses */
-		settWind.outputMinX = minX - (maxX - minX) / 8;
-		settWind.outputMaxX = maxX + (maxX - minX) / 8;
-		settWind.outputMinY = minY - (maxY - minY) / 8;
-		settWind.outputMaxY = maxY + (maxY - minY) / 8;
+		float sum = 0, max = 0;
+		for(int i = 0; i < points; i++) {
+			sum += residuals[i];
+			if(residuals[i] > max) max = residuals[i];
+		}
 
-		settWind.saveDeviceSettings();
-		settWind.reloadHelper();
+		settWind.autoCalibration = false;
+		settWind.hasMatrix = true;
+		for(int i = 0; i < 6; i++) {
+			settWind.matrix[i] = matrix[i];
+		}
+		settWind.outputMinX = minX;
+		settWind.outputMaxX = maxX;
+		settWind.outputMinY = minY;
+		settWind.outputMaxY = maxY;
+		settWind.swapAxes = (swap != 0);
+		settWind.showCalibrationError(points, sum / points, max);
+
+		/* Saved only if the user confirms after testing */
+		settWind.previewDeviceSettings();
+		return true;
 	}
 
 }
@@ -0,0 +1,283 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+
+/* Returns the (newly allocated) path of the control socket for the display,
+   or NULL if it doesn't fit into a socket address. */
+char* getControlSocketName(const char * displayName) {
+	if(displayName == NULL) displayName = getenv("DISPLAY");
+	if(displayName == NULL) displayName = ":0";
+
+	/* "host:number.screen" -> "host_number"; the screen doesn't matter, the helper serves the whole display */
+	char id[64];
+	size_t n = 0;
+	const char * colon = strrchr(displayName, ':');
+	const char * p;
+	for(p = displayName; *p != '\0' && n < sizeof id - 1; p++) {
+		if(colon != NULL && p > colon && *p == '.') break;
+		if(p == colon) {
+			if(n > 0) id[n++] = '_';
+		} else {
+			id[n++] = (isalnum((unsigned char) *p) || *p == '-' ? *p : '_');
+		}
+	}
+	id[n] = '\0';
+
+	struct sockaddr_un addr;
+	char fileName[sizeof addr.sun_path];
+	char * runtimeDir = getenv("XDG_RUNTIME_DIR");
+	int length;
+	if(runtimeDir != NULL && runtimeDir[0] != '\0') {
+		length = snprintf(fileName, sizeof fileName, "%s/" CONTROL_SOCKET_PREFIX "%s", runtimeDir, id);
+	} else {
+		length = snprintf(fileName, sizeof fileName, "/tmp/" CONTROL_SOCKET_PREFIX "%u/%s", (unsigned int) getuid(), id);
+	}
+	if(length < 0 || length >= sizeof fileName) {
+		return NULL;
+	}
+	return strdup(fileName);
+}
+
+static void fillAddress(struct sockaddr_un * addr, const char * fileName) {
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, fileName);
+}
+
+/* Without XDG_RUNTIME_DIR the socket lives in a directory in /tmp that must be ours only */
+static int prepareSocketDirectory(const char * fileName) {
+	if(strncmp(fileName, "/tmp/" CONTROL_SOCKET_PREFIX, strlen("/tmp/" CONTROL_SOCKET_PREFIX))) {
+		return 1;
+	}
+	char * dir = strdup(fileName);
+	*strrchr(dir, '/') = '\0';
+	mkdir(dir, 0700);
+
+	struct stat st;
+	int ok = (lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 077) == 0);
+	if(!ok) {
+		fprintf(stderr, "%s is not a private directory.\n", dir);
+	}
+	free(dir);
+	return ok;
+}
+
+/* Creates the listening, non-blocking control socket for the display.
+   Returns the descriptor or -1 if another helper already serves the display. */
+int listenControlSocket(const char * displayName) {
+	char * fileName = getControlSocketName(displayName);
+	if(fileName == NULL || !prepareSocketDirectory(fileName)) {
+		free(fileName);
+		return -1;
+	}
+
+	struct sockaddr_un addr;
+	fillAddress(&addr, fileName);
+
+	int desc = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(desc < 0) {
+		free(fileName);
+		return -1;
+	}
+
+	int bound = (bind(desc, (struct sockaddr *) &addr, sizeof addr) == 0);
+	if(!bound && errno == EADDRINUSE) {
+		/* Left over by a helper that didn't exit cleanly, unless it still answers */
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int alive = (probe >= 0 && connect(probe, (struct sockaddr *) &addr, sizeof addr) == 0);
+		if(probe >= 0) close(probe);
+		if(!alive) {
+			unlink(fileName);
+			bound = (bind(desc, (struct sockaddr *) &addr, sizeof addr) == 0);
+		}
+	}
+
+	/* The helper runs with umask 0 */
+	if(!bound || chmod(fileName, 0600) < 0 || listen(desc, 8) < 0) {
+		close(desc);
+		free(fileName);
+		return -1;
+	}
+
+	free(fileName);
+	return desc;
+}
+
+static int readAll(int desc, void * data, size_t size) {
+	char * p = data;
+	while(size > 0) {
+		ssize_t n = read(desc, p, size);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+static int writeAll(int desc, const void * data, size_t size) {
+	const char * p = data;
+	while(size > 0) {
+		ssize_t n = send(desc, p, size, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+/* Sends the request to the helper of the display and waits for the reply. If data is not NULL,
+   the data following the reply (e.g. device states) is returned in a newly allocated buffer.
+   Returns 1 if the helper has handled the request successfully; if it couldn't be reached,
+   the status of the reply is CONTROL_ERROR_CONNECT. */
+int sendControlRequest(const char * displayName, ControlRequest * request, ControlReply * reply, void ** data) {
+	memset(reply, 0, sizeof *reply);
+	reply->status = CONTROL_ERROR_CONNECT;
+	if(data != NULL) *data = NULL;
+
+	char * fileName = getControlSocketName(displayName);
+	if(fileName == NULL) return 0;
+	struct sockaddr_un addr;
+	fillAddress(&addr, fileName);
+	free(fileName);
+
+	int desc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(desc < 0) return 0;
+
+	struct timeval timeout = { CONTROL_TIMEOUT / 1000, (CONTROL_TIMEOUT % 1000) * 1000 };
+	setsockopt(desc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	setsockopt(desc, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+	request->magic = CONTROL_MAGIC;
+	request->version = CONTROL_VERSION;
+
+	ControlReply received;
+	if(connect(desc, (struct sockaddr *) &addr, sizeof addr) < 0
+			|| !writeAll(desc, request, sizeof *request)
+			|| !readAll(desc, &received, sizeof received)
+			|| received.magic != CONTROL_MAGIC || received.version != CONTROL_VERSION
+			|| received.count < 0 || received.size < 0) {
+		close(desc);
+		return 0;
+	}
+
+	if(data != NULL && received.size > 0) {
+		*data = malloc(received.size);
+		if(*data == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		if(!readAll(desc, *data, received.size)) {
+			free(*data);
+			*data = NULL;
+			close(desc);
+			return 0;
+		}
+	}
+	close(desc);
+
+	*reply = received;
+	return (reply->status == CONTROL_OK);
+}
+
+int controlReloadAll(const char * displayName, ControlReply * reply) {
+	ControlRequest request;
+	memset(&request, 0, sizeof request);
+	request.request = CONTROL_RELOAD_ALL;
+	return sendControlRequest(displayName, &request, reply, NULL);
+}
+
+int controlReloadProfile(const char * displayName, const char * deviceName, ControlReply * reply) {
+	ControlRequest request;
+	memset(&request, 0, sizeof request);
+	request.request = CONTROL_RELOAD_PROFILE;
+	strncpy(request.name, deviceName, CONTROL_NAME_LENGTH - 1);
+	return sendControlRequest(displayName, &request, reply, NULL);
+}
+
+int controlApplyDevice(const char * displayName, int deviceId, ControlReply * reply) {
+	ControlRequest request;
+	memset(&request, 0, sizeof request);
+	request.request = CONTROL_APPLY_DEVICE;
+	request.deviceId = deviceId;
+	return sendControlRequest(displayName, &request, reply, NULL);
+}
+
+int controlQueryState(const char * displayName, ControlReply * reply, ControlDeviceState ** states) {
+	ControlRequest request;
+	memset(&request, 0, sizeof request);
+	request.request = CONTROL_QUERY_STATE;
+	int ok = sendControlRequest(displayName, &request, reply, (void **) states);
+	if(ok && reply->size != reply->count * (int) sizeof(ControlDeviceState)) {
+		free(*states);
+		*states = NULL;
+		reply->count = 0;
+		reply->status = CONTROL_ERROR_REQUEST;
+		ok = 0;
+	}
+	return ok;
+}
+
+/* The helper applies the settings immediately, but only until the profile is reloaded */
+int controlPreviewProfile(const char * displayName, DeviceSettings * settings, ControlReply * reply) {
+	ControlRequest request;
+	memset(&request, 0, sizeof request);
+	request.request = CONTROL_PREVIEW_PROFILE;
+	strncpy(request.name, settings->inputDeviceName, CONTROL_NAME_LENGTH - 1);
+	if(settings->attachedOutput != NULL) {
+		strncpy(request.output, settings->attachedOutput, CONTROL_NAME_LENGTH - 1);
+	}
+	request.autoOutput = settings->autoOutput;
+	request.autoCalibration = settings->autoCalibration;
+	request.outputMinX = settings->outputMinX;
+	request.outputMaxX = settings->outputMaxX;
+	request.outputMinY = settings->outputMinY;
+	request.outputMaxY = settings->outputMaxY;
+	request.swapAxes = settings->swapAxes;
+	request.hasMatrix = settings->hasMatrix;
+	memcpy(request.matrix, settings->matrix, sizeof request.matrix);
+	return sendControlRequest(displayName, &request, reply, NULL);
+}
+
+int controlQueryMetrics(const char * displayName, ControlReply * reply, HelperMetrics * metrics) {
+	ControlRequest request;
+	void *data;
+	memset(&request, 0, sizeof request);
+	request.request = CONTROL_QUERY_METRICS;
+	int ok = sendControlRequest(displayName, &request, reply, &data);
+	if(ok && reply->size == sizeof(HelperMetrics)) {
+		memcpy(metrics, data, sizeof(HelperMetrics));
+	} else if(ok) {
+		reply->status = CONTROL_ERROR_REQUEST;
+		ok = 0;
+	}
+	free(data);
+	return ok;
+}
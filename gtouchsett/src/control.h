@@ -0,0 +1,137 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <stdint.h>
+#include "profiles.h"
+
+/* Control socket of the helper, one per user and display:
+   $XDG_RUNTIME_DIR/touchscreen-helper-<display> or /tmp/touchscreen-helper-<uid>/<display> */
+#define CONTROL_SOCKET_PREFIX "touchscreen-helper-"
+#define CONTROL_MAGIC 0x43545354	/* "TSTC" */
+#define CONTROL_VERSION 4
+#define CONTROL_NAME_LENGTH 128
+/* Milliseconds a client waits for the reply */
+#define CONTROL_TIMEOUT 2000
+
+/* Requests; each connection carries one request and its reply */
+enum {
+	CONTROL_RELOAD_ALL = 1,		/* Reload all profiles, drop all previews */
+	CONTROL_RELOAD_PROFILE,		/* Reload the profile named in the request, drop its preview */
+	CONTROL_APPLY_DEVICE,		/* Rewrite the calibration of the device in the request */
+	CONTROL_QUERY_STATE,		/* Reply is followed by count ControlDeviceState entries */
+	CONTROL_PREVIEW_PROFILE,	/* Apply the settings in the request until the profile is reloaded, without saving them */
+	CONTROL_QUERY_METRICS		/* Reply is followed by HelperMetrics */
+};
+
+/* Status of a reply */
+enum {
+	CONTROL_ERROR_CONNECT = -1,	/* No helper is running for the display or it didn't answer */
+	CONTROL_OK = 0,
+	CONTROL_ERROR_REQUEST,		/* Unknown request or version */
+	CONTROL_ERROR_NOT_FOUND		/* No such profile or device */
+};
+
+typedef struct _ControlRequest {
+	uint32_t magic;
+	uint32_t version;
+	int32_t request;
+	int32_t deviceId;
+	char name[CONTROL_NAME_LENGTH];
+	/* Settings for CONTROL_PREVIEW_PROFILE */
+	char output[CONTROL_NAME_LENGTH];	/* Empty for the whole screen */
+	int32_t autoOutput;
+	int32_t autoCalibration;
+	int32_t outputMinX;
+	int32_t outputMaxX;
+	int32_t outputMinY;
+	int32_t outputMaxY;
+	int32_t swapAxes;
+	int32_t hasMatrix;
+	float matrix[6];
+} ControlRequest;
+
+typedef struct _ControlReply {
+	uint32_t magic;
+	uint32_t version;
+	int32_t status;
+	int32_t latency;	/* Microseconds spent handling the request, including the X round trip */
+	int32_t count;		/* Number of entries following the reply */
+	int32_t size;		/* Size of the data following the reply in bytes */
+} ControlReply;
+
+typedef struct _ControlDeviceState {
+	int32_t deviceId;
+	char profile[CONTROL_NAME_LENGTH];
+	char output[CONTROL_NAME_LENGTH];	/* Empty if the whole screen is used */
+	int32_t autoOutput;
+	int32_t autoCalibration;
+	int32_t outputMinX;
+	int32_t outputMaxX;
+	int32_t outputMinY;
+	int32_t outputMaxY;
+	int32_t swapAxes;
+	int32_t hasMatrix;
+	float matrix[6];
+	int32_t applied;	/* Calibration has been written and not changed by somebody else */
+	int32_t preview;	/* Settings are an unsaved preview */
+} ControlDeviceState;
+
+/* Histogram with power of two buckets: bucket 0 counts the value 0,
+   bucket b values from 2^(b-1) to 2^b - 1, the last one everything above */
+#define HISTOGRAM_BUCKETS 24
+
+typedef struct _Histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+/* Counters and histograms the helper keeps since its start; times in microseconds */
+typedef struct _HelperMetrics {
+	int64_t uptime;
+	uint64_t randrEvents;
+	uint64_t hierarchyEvents;
+	uint64_t propertyEvents;
+	uint64_t controlRequests;
+	uint64_t applyPasses;
+	uint64_t reloads;
+	uint64_t profileReloads;
+	uint64_t devicesMatched;
+	uint64_t propertyWrites;	/* Devices whose calibration has been written */
+	uint64_t writesSkipped;		/* Devices whose calibration was already up to date */
+	uint64_t applyFailures;		/* Devices that couldn't be opened, and X errors caused by property writes */
+	Histogram displayLatency;	/* First RandR event of a burst until the last property write of its pass */
+	Histogram hotplugLatency;	/* Hierarchy event until the last property write of its pass */
+	Histogram passTime;		/* Duration of an apply pass */
+	Histogram passRoundTrips;	/* X round trips per apply pass */
+	Histogram reloadTime;
+} HelperMetrics;
+
+char* getControlSocketName(const char *);
+int listenControlSocket(const char *);
+int sendControlRequest(const char *, ControlRequest *, ControlReply *, void **);
+int controlReloadAll(const char *, ControlReply *);
+int controlReloadProfile(const char *, const char *, ControlReply *);
+int controlApplyDevice(const char *, int, ControlReply *);
+int controlQueryState(const char *, ControlReply *, ControlDeviceState **);
+int controlPreviewProfile(const char *, DeviceSettings *, ControlReply *);
+int controlQueryMetrics(const char *, ControlReply *, HelperMetrics *);
+
+#endif /* CONTROL_H_ */
@@ -21,13 +21,15 @@ int main(string[] args) {
 		d.outputMinY = int.parse(args[7]);
 		d.outputMaxY = int.parse(args[8]);
 		d.swapAxes = (int.parse(args[9]) == 0 ? 0 : 1);
+		if(args.length >= 16) {
+			/* Calibration matrix */
+			d.hasMatrix = 1;
+			for(int i = 0; i < 6; i++) {
+				d.matrix[i] = (float) double.parse(args[10 + i]);
+			}
+		}
 
-		DeviceSettingsList list = DeviceSettingsList();
-		loadSettings(&list, null, getGlobalFileName());
-
-		changeProfile(&list, &d);
-		int result = saveDeviceSettingsToFile(getGlobalFileName(), &list);
-		freeSettings(&list);
+		int result = storeProfileChange(getGlobalFileName(), &d);
 		if(result == 1) {
 			stdout.printf("Settings successfully applied.\n");
 			return 0;
@@ -39,6 +41,14 @@ int main(string[] args) {
 
 
 	} else {
+		int calibrationPoints = Calibrator.DEFAULT_POINTS;
+		if(args.length >= 3 && args[1] == "--calibration-points") {
+			calibrationPoints = int.parse(args[2]);
+			if(Calibrator.gridSize(calibrationPoints) == 0) {
+				stderr.printf("The number of calibration points must be 4, 9, 16 or 25.\n");
+				return 1;
+			}
+		}
 
 		/* As there seems to be no way to get the Xlib Display object from GTK, we need our
 		   own connection to the X Server to be able to access XInput2 directly for the calibration. */
@@ -46,6 +56,7 @@ int main(string[] args) {
 			/* GTK initialisation and main loop */
 		Gtk.init(ref args);
 		SettingsWindow sw = new SettingsWindow(display);
+		sw.calibrationPoints = calibrationPoints;
 		sw.show();
 		Gtk.main();
 
@@ -18,11 +18,23 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <locale.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include "profiles.h"
+#include "profilecache.h"
 
 #define HOME_SETTINGS_FILE "/.touchscreen-helper"
 #define ETC_SETTINGS_FILE "/etc/touchscreen-helper"
 
+#define SECTION_PROFILE 0
+#define SECTION_DELETE 1
+
 #define BIT_0 1
 #define BIT_1 2
 #define BIT_2 4
@@ -46,9 +58,101 @@ char* getPrivateFileName() {
 }
 
 
-int loadSettings(DeviceSettingsList * list, char * onlyForDevice, char * onlyFile) {
+static unsigned long hashName(const char * name) {
+	unsigned long hash = 2166136261UL;
+	while(*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static void invalidateNameIndex(DeviceSettingsList * list) {
+	free(list->nameIndex);
+	list->nameIndex = NULL;
+	list->nameIndexSize = 0;
+}
+
+/* The entry after the table counts the profiles that aren't in it because an earlier profile
+   has the same name */
+#define SHADOWED_PROFILES(list) ((list)->nameIndex[(list)->nameIndexSize])
+
+/* Adds profile i to the index unless an earlier profile has the same name, which takes precedence */
+static void indexProfile(DeviceSettingsList * list, int i) {
+	char * name = list->deviceSettings[i].inputDeviceName;
+	if(name == NULL) return;
+	unsigned long slot = hashName(name) & (list->nameIndexSize - 1);
+	while(list->nameIndex[slot] != -1) {
+		if(!strcmp(list->deviceSettings[list->nameIndex[slot]].inputDeviceName, name)) {
+			SHADOWED_PROFILES(list)++;
+			return;
+		}
+		slot = (slot + 1) & (list->nameIndexSize - 1);
+	}
+	list->nameIndex[slot] = i;
+}
+
+/* Removes profile i, which must be in the index, by moving the following entries of its
+   probe sequence back, so lookups never have to skip deleted slots */
+static void unindexProfile(DeviceSettingsList * list, int i) {
+	unsigned long mask = list->nameIndexSize - 1;
+	unsigned long hole = hashName(list->deviceSettings[i].inputDeviceName) & mask;
+	while(list->nameIndex[hole] != i) {
+		hole = (hole + 1) & mask;
+	}
+	unsigned long slot = hole;
+	while(1) {
+		slot = (slot + 1) & mask;
+		if(list->nameIndex[slot] == -1) break;
+		unsigned long home = hashName(list->deviceSettings[list->nameIndex[slot]].inputDeviceName) & mask;
+		/* The entry can fill the hole unless its home lies cyclically between the hole and it */
+		if(((slot - home) & mask) >= ((slot - hole) & mask)) {
+			list->nameIndex[hole] = list->nameIndex[slot];
+			hole = slot;
+		}
+	}
+	list->nameIndex[hole] = -1;
+}
+
+static void buildNameIndex(DeviceSettingsList * list) {
+	/* Keep the table at most half full */
+	list->nameIndexSize = 16;
+	while(list->nameIndexSize < list->nDeviceSettings * 2) list->nameIndexSize *= 2;
+	list->nameIndex = malloc((list->nameIndexSize + 1) * sizeof(int));
+	if (list->nameIndex == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	int i;
+	for(i = 0; i < list->nameIndexSize; i++) {
+		list->nameIndex[i] = -1;
+	}
+	SHADOWED_PROFILES(list) = 0;
+	for(i = 0; i < list->nDeviceSettings; i++) {
+		indexProfile(list, i);
+	}
+}
+
+/* Returns the index of the (first) profile for the device name, -1 if there is none */
+int findProfile(DeviceSettingsList * list, const char * deviceName) {
+	if(deviceName == NULL) return -1;
+	if(list->nameIndex == NULL) {
+		buildNameIndex(list);
+	}
+	unsigned long slot = hashName(deviceName) & (list->nameIndexSize - 1);
+	while(list->nameIndex[slot] != -1) {
+		if(!strcmp(list->deviceSettings[list->nameIndex[slot]].inputDeviceName, deviceName)) {
+			return list->nameIndex[slot];
+		}
+		slot = (slot + 1) & (list->nameIndexSize - 1);
+	}
+	return -1;
+}
 
+static void initSettingsList(DeviceSettingsList * list) {
 	/* Allocate initial space for settings */
+	list->nameIndex = NULL;
+	list->nameIndexSize = 0;
 	list->nDeviceSettings = 0;
 	list->nDeviceSettingsSpace = 10;
 	list->deviceSettings = malloc (sizeof(DeviceSettings) * list->nDeviceSettingsSpace);
@@ -56,14 +160,50 @@ int loadSettings(DeviceSettingsList * list, char * onlyForDevice, char * onlyFil
 		fprintf(stderr, "Out of memory.\n");
 		exit(1);
 	}
+}
+
+/* Removes all profiles that are not for the given device */
+static void keepOnlyProfilesFor(DeviceSettingsList * list, char * deviceName) {
+	int i, j = 0;
+	for(i = 0; i < list->nDeviceSettings; i++) {
+		DeviceSettings * settings = &(list->deviceSettings[i]);
+		if(settings->inputDeviceName != NULL && !strcmp(settings->inputDeviceName, deviceName)) {
+			list->deviceSettings[j++] = *settings;
+		} else {
+			free(settings->inputDeviceName);
+			free(settings->attachedOutput);
+			free(settings->inputDeviceIDs);
+		}
+	}
+	list->nDeviceSettings = j;
+	invalidateNameIndex(list);
+}
+
+int loadSettings(DeviceSettingsList * list, char * onlyForDevice, char * onlyFile) {
+
+	initSettingsList(list);
 
 	if(!onlyFile) {
-		if(!addDeviceSettingsFromFile(getPrivateFileName(), list, onlyForDevice)) {
+		/* Use the compiled profiles if they are up to date */
+		if(loadSettingsFromCache(list, onlyForDevice)) {
+			return 1;
+		}
+
+		CacheSourceStamp stamps[CACHE_SOURCES];
+		getCacheSourceStamps(stamps);
+
+		if(!addDeviceSettingsFromFile(getPrivateFileName(), list, NULL)) {
 			printf("INFO: Configuration file %s could not be loaded.\n", getPrivateFileName());
 		}
-		if(!addDeviceSettingsFromFile(getGlobalFileName(), list, onlyForDevice)) {
+		if(!addDeviceSettingsFromFile(getGlobalFileName(), list, NULL)) {
 			printf("INFO: Configuration file %s could not be loaded.\n", getGlobalFileName());
 		}
+
+		/* Compile all profiles, even if only one is requested */
+		writeSettingsCache(list, stamps);
+		if(onlyForDevice != NULL) {
+			keepOnlyProfilesFor(list, onlyForDevice);
+		}
 	} else {
 		if(!addDeviceSettingsFromFile(onlyFile, list, onlyForDevice)) {
 			return 0;
@@ -74,10 +214,30 @@ int loadSettings(DeviceSettingsList * list, char * onlyForDevice, char * onlyFil
 	return 1;
 }
 
-/* attachedOutput and inputDeviceName will be used, don't free them afterwards!! */
-void addDeviceSettings(DeviceSettingsList * list, char* inputDeviceName, char* attachedOutput, int autoOutput, int autoCalibration, int outputMinX, int outputMaxX, int outputMinY, int outputMaxY, int swapAxes) {
+/* Numbers are written and read with "." as decimal point, whatever the locale of the program */
+static locale_t getNumericLocale() {
+	static locale_t numericLocale = (locale_t) 0;
+	if(numericLocale == (locale_t) 0) {
+		numericLocale = newlocale(LC_NUMERIC_MASK, "C", (locale_t) 0);
+	}
+	return numericLocale;
+}
+
+static void setProfileMatrix(DeviceSettings * profile, const float * matrix) {
+	profile->hasMatrix = (matrix != NULL);
+	if(matrix != NULL) {
+		memmove(profile->matrix, matrix, sizeof profile->matrix);
+	} else {
+		memset(profile->matrix, 0, sizeof profile->matrix);
+	}
+}
+
+/* attachedOutput and inputDeviceName will be used, don't free them afterwards!!
+   matrix (6 values) is NULL if the profile is calibrated with the min/max values only. */
+void addDeviceSettings(DeviceSettingsList * list, char* inputDeviceName, char* attachedOutput, int autoOutput, int autoCalibration, int outputMinX, int outputMaxX, int outputMinY, int outputMaxY, int swapAxes, const float * matrix) {
 	if(list->nDeviceSettings + 1 > list->nDeviceSettingsSpace) {
-		list->nDeviceSettingsSpace += 10;
+		/* Grow geometrically, so adding n profiles doesn't copy O(n^2) entries */
+		list->nDeviceSettingsSpace = (list->nDeviceSettingsSpace < 10 ? 10 : list->nDeviceSettingsSpace * 2);
 		list->deviceSettings = realloc(list->deviceSettings, sizeof(DeviceSettings) * list->nDeviceSettingsSpace);
 		if (list->deviceSettings == NULL) {
 			fprintf(stderr, "Out of memory.\n");
@@ -98,16 +258,21 @@ void addDeviceSettings(DeviceSettingsList * list, char* inputDeviceName, char* a
 	list->deviceSettings[i].outputMinY = outputMinY;
 	list->deviceSettings[i].outputMaxY = outputMaxY;
 	list->deviceSettings[i].swapAxes = swapAxes;
+	setProfileMatrix(&(list->deviceSettings[i]), matrix);
 	list->deviceSettings[i].inputDeviceIDs = malloc(MAX_DEVICES_PER_PROFILE * sizeof(int));
 	if (list->deviceSettings[i].inputDeviceIDs == NULL) {
 		fprintf(stderr, "Out of memory.\n");
 	}
 
-}
+	if(list->nameIndex != NULL) {
+		if(list->nDeviceSettings * 2 > list->nameIndexSize) {
+			/* Will be rebuilt with more space when needed */
+			invalidateNameIndex(list);
+		} else {
+			indexProfile(list, i);
+		}
+	}
 
-/* settings->attachedOutput and settings->inputDeviceName will be used, don't free them afterwards!! */
-void addDeviceSettingsEntry(DeviceSettingsList * list, DeviceSettings* settings) {
-	addDeviceSettings(list, settings->inputDeviceName, settings->attachedOutput, settings->autoOutput, settings->autoCalibration, settings->outputMinX, settings->outputMaxX, settings->outputMinY, settings->outputMaxY, settings->swapAxes);
 }
 
 void clearDeviceSettingsEntry(DeviceSettings* entry) {
@@ -122,6 +287,7 @@ void clearDeviceSettingsEntry(DeviceSettings* entry) {
 	entry->outputMinY = 0;
 	entry->outputMaxY = 0;
 	entry->swapAxes = 0;
+	setProfileMatrix(entry, NULL);
 }
 
 void freeSettings(DeviceSettingsList * list) {
@@ -139,6 +305,8 @@ void freeSettings(DeviceSettingsList * list) {
 		list->nDeviceSettings = 0;
 	}
 
+	invalidateNameIndex(list);
+
 	if(list->nDeviceSettingsSpace > 0) {
 		/* Free old settings */
 		free(list->deviceSettings);
@@ -148,16 +316,28 @@ void freeSettings(DeviceSettingsList * list) {
 
 }
 
+static void clearProfile(DeviceSettings * profile) {
+	free(profile->inputDeviceName);
+	profile->inputDeviceName = NULL;
+	free(profile->attachedOutput);
+	profile->attachedOutput = NULL;
+}
+
 void deleteProfile(DeviceSettingsList * list, char * deviceName) {
-	int i;
-	for(i = 0; i < list->nDeviceSettings; i++) {
-		if(list->deviceSettings[i].inputDeviceName != NULL && !strcmp(deviceName, list->deviceSettings[i].inputDeviceName)) {
-			free(list->deviceSettings[i].inputDeviceName);
-			list->deviceSettings[i].inputDeviceName = NULL;
-			free(list->deviceSettings[i].attachedOutput);
-			list->deviceSettings[i].attachedOutput = NULL;
-		}
+	int i = findProfile(list, deviceName);
+	if(i == -1) return;
+	if(SHADOWED_PROFILES(list) == 0) {
+		/* The only profile with that name */
+		unindexProfile(list, i);
+		clearProfile(&(list->deviceSettings[i]));
+		return;
 	}
+
+	/* There may be more than one profile with that name; the index only knows the first */
+	do {
+		clearProfile(&(list->deviceSettings[i]));
+		invalidateNameIndex(list);
+	} while((i = findProfile(list, deviceName)) != -1);
 }
 
 void changeProfile(DeviceSettingsList * list, DeviceSettings * newSettings) {
@@ -170,23 +350,22 @@ void changeProfile(DeviceSettingsList * list, DeviceSettings * newSettings) {
 		/* We don't have to free it as it will be added to list and thus be freed when list is freed */
 	}
 
-	for(i = 0; i < list->nDeviceSettings; i++) {
-		if(list->deviceSettings[i].inputDeviceName != NULL && !strcmp(newSettings->inputDeviceName, list->deviceSettings[i].inputDeviceName)) {
-			if(list->deviceSettings[i].attachedOutput != NULL) {
-				free(list->deviceSettings[i].attachedOutput);
-			}
-			list->deviceSettings[i].attachedOutput = outp;
-			list->deviceSettings[i].autoOutput = newSettings->autoOutput;
-			list->deviceSettings[i].autoCalibration = newSettings->autoCalibration;
-			list->deviceSettings[i].outputMinX = newSettings->outputMinX;
-			list->deviceSettings[i].outputMaxX = newSettings->outputMaxX;
-			list->deviceSettings[i].outputMinY = newSettings->outputMinY;
-			list->deviceSettings[i].outputMaxY = newSettings->outputMaxY;
-			list->deviceSettings[i].swapAxes = newSettings->swapAxes;
-
-			found = 1;
-			break;
+	i = findProfile(list, newSettings->inputDeviceName);
+	if(i != -1) {
+		if(list->deviceSettings[i].attachedOutput != NULL) {
+			free(list->deviceSettings[i].attachedOutput);
 		}
+		list->deviceSettings[i].attachedOutput = outp;
+		list->deviceSettings[i].autoOutput = newSettings->autoOutput;
+		list->deviceSettings[i].autoCalibration = newSettings->autoCalibration;
+		list->deviceSettings[i].outputMinX = newSettings->outputMinX;
+		list->deviceSettings[i].outputMaxX = newSettings->outputMaxX;
+		list->deviceSettings[i].outputMinY = newSettings->outputMinY;
+		list->deviceSettings[i].outputMaxY = newSettings->outputMaxY;
+		list->deviceSettings[i].swapAxes = newSettings->swapAxes;
+		setProfileMatrix(&(list->deviceSettings[i]), newSettings->hasMatrix ? newSettings->matrix : NULL);
+
+		found = 1;
 	}
 
 
@@ -197,15 +376,65 @@ void changeProfile(DeviceSettingsList * list, DeviceSettings * newSettings) {
 			strcpy(inp, newSettings->inputDeviceName);
 			/* We don't have to free it as it will be added to list and thus be freed when list is freed */
 		}
-		addDeviceSettings(list, inp, outp, newSettings->autoOutput, newSettings->autoCalibration, newSettings->outputMinX, newSettings->outputMaxX, newSettings->outputMinY, newSettings->outputMaxY, newSettings->swapAxes);
+		addDeviceSettings(list, inp, outp, newSettings->autoOutput, newSettings->autoCalibration, newSettings->outputMinX, newSettings->outputMaxX, newSettings->outputMinY, newSettings->outputMaxY, newSettings->swapAxes, newSettings->hasMatrix ? newSettings->matrix : NULL);
 	}
 
 }
 
+static void writeProfile(FILE * fileDesc, DeviceSettings * profile) {
+	fprintf(fileDesc, "[profile]\n");
+
+	fprintf(fileDesc, "device=%s\n", profile->inputDeviceName);
+
+	if(profile->autoOutput) {
+		fprintf(fileDesc, "output=AUTO_FIRST_LVDS\n");
+	} else if(profile->attachedOutput) {
+		fprintf(fileDesc, "output=%s\n", profile->attachedOutput);
+	}
+
+	if(! profile->autoCalibration) {
+		fprintf(fileDesc, "minx=%i\n", profile->outputMinX);
+		fprintf(fileDesc, "maxx=%i\n", profile->outputMaxX);
+		fprintf(fileDesc, "miny=%i\n", profile->outputMinY);
+		fprintf(fileDesc, "maxy=%i\n", profile->outputMaxY);
+		fprintf(fileDesc, "swapaxes=%i\n", profile->swapAxes);
+		if(profile->hasMatrix) {
+			/* Enough digits to read back the same floats */
+			locale_t oldLocale = uselocale(getNumericLocale());
+			fprintf(fileDesc, "matrix=%.9g %.9g %.9g %.9g %.9g %.9g\n", profile->matrix[0], profile->matrix[1], profile->matrix[2],
+					profile->matrix[3], profile->matrix[4], profile->matrix[5]);
+			uselocale(oldLocale);
+		}
+	}
+	fprintf(fileDesc, "\n");
+}
+
+/* Writes the complete file. It is written to a temporary file first and then renamed,
+   so readers never see a half-written file. */
 int saveDeviceSettingsToFile(char * fileName, DeviceSettingsList * list) {
+	char * tempName = malloc(strlen(fileName) + 8);
+	if(tempName == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	strcpy(tempName, fileName);
+	strcat(tempName, ".XXXXXX");
+
 	/* Try to open file */
-	FILE * fileDesc = fopen(fileName, "w");
+	int fd = mkstemp(tempName);
+	if(fd < 0) {
+		free(tempName);
+		return 0;
+	}
+	/* Keep the permissions of the file we replace */
+	struct stat st;
+	fchmod(fd, stat(fileName, &st) == 0 ? (st.st_mode & 07777) : 0644);
+
+	FILE * fileDesc = fdopen(fd, "w");
 	if (!fileDesc ) {
+		close(fd);
+		unlink(tempName);
+		free(tempName);
 		return 0;
 	}
 
@@ -215,127 +444,380 @@ int saveDeviceSettingsToFile(char * fileName, DeviceSettingsList * list) {
 		if(profile->inputDeviceName == NULL) {
 			/* Has been deleted */
 		} else {
-			fprintf(fileDesc, "[profile]\n");
+			writeProfile(fileDesc, profile);
+		}
+	}
 
-			fprintf(fileDesc, "device=%s\n", profile->inputDeviceName);
+	int result = (fflush(fileDesc) == 0 && fsync(fd) == 0);
+	if(fclose(fileDesc) != 0 || !result || rename(tempName, fileName) != 0) {
+		unlink(tempName);
+		result = 0;
+	}
+	free(tempName);
+	return result;
+}
 
-			if(profile->autoOutput) {
-				fprintf(fileDesc, "output=AUTO_FIRST_LVDS\n");
-			} else if(profile->attachedOutput) {
-				fprintf(fileDesc, "output=%s\n", profile->attachedOutput);
+/* Reads the whole file from the current position of fd into one buffer, terminated by an
+   additional 0 byte. fd is left open. */
+static char * readWholeFile(int fd, size_t * out_size) {
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		return NULL;
+	}
+	size_t space = (st.st_size > 0 ? st.st_size : 0) + 1;
+	size_t size = 0;
+	char * buffer = malloc(space + 1);
+	if(buffer == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	while(1) {
+		/* The file may grow while we read it */
+		if(size == space) {
+			space *= 2;
+			buffer = realloc(buffer, space + 1);
+			if(buffer == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
 			}
+		}
+		ssize_t n = read(fd, buffer + size, space - size);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			free(buffer);
+			return NULL;
+		}
+		if(n == 0) break;
+		size += n;
+	}
+	buffer[size] = 0;
+	*out_size = size;
+	return buffer;
+}
 
-			if(! profile->autoCalibration) {
-				fprintf(fileDesc, "minx=%i\n", profile->outputMinX);
-				fprintf(fileDesc, "maxx=%i\n", profile->outputMaxX);
-				fprintf(fileDesc, "miny=%i\n", profile->outputMinY);
-				fprintf(fileDesc, "maxy=%i\n", profile->outputMaxY);
-				fprintf(fileDesc, "swapaxes=%i\n", profile->swapAxes);
+static char * copyValue(const char * value) {
+	if(value == NULL) return NULL;
+	char * result = strdup(value);
+	if(result == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return result;
+}
+
+/* loadedSettings points into the parse buffer, so the strings are copied here.
+   In a journal, profiles replace existing ones and [delete] sections remove them. */
+static void addParsedProfile(DeviceSettingsList * list, DeviceSettings * loadedSettings, int section, int isJournal, char * onlyForDevice) {
+	if(onlyForDevice == NULL || (loadedSettings->inputDeviceName != NULL && !strcmp(onlyForDevice, loadedSettings->inputDeviceName))) {
+		if(section == SECTION_DELETE) {
+			if(loadedSettings->inputDeviceName != NULL) {
+				deleteProfile(list, loadedSettings->inputDeviceName);
+			}
+		} else if(isJournal) {
+			if(loadedSettings->inputDeviceName != NULL) {
+				changeProfile(list, loadedSettings);
 			}
-			fprintf(fileDesc, "\n");
+		} else {
+			addDeviceSettings(list, copyValue(loadedSettings->inputDeviceName), copyValue(loadedSettings->attachedOutput),
+				loadedSettings->autoOutput, loadedSettings->autoCalibration, loadedSettings->outputMinX, loadedSettings->outputMaxX,
+				loadedSettings->outputMinY, loadedSettings->outputMaxY, loadedSettings->swapAxes,
+				loadedSettings->hasMatrix ? loadedSettings->matrix : NULL);
 		}
 	}
+}
 
-
-	fclose(fileDesc);
+static int parseNumber(char * fileName, int lineNumber, char * key, char * value, int * out_value) {
+	char * end;
+	errno = 0;
+	long number = strtol(value, &end, 0);
+	if(end == value || *end != 0 || errno != 0 || number < INT_MIN || number > INT_MAX) {
+		fprintf(stderr, "%s:%i: invalid number '%s' for %s\n", fileName, lineNumber, value, key);
+		return 0;
+	}
+	*out_value = (int) number;
 	return 1;
 }
 
-int addDeviceSettingsFromFile(char * fileName, DeviceSettingsList * list, char * onlyForDevice) {
-	/* Try to open file */
-	FILE * fileDesc = fopen(fileName, "r");
-	if (!fileDesc ) {
+/* Six numbers separated by spaces */
+static int parseMatrix(char * fileName, int lineNumber, char * key, char * value, float * out_matrix) {
+	float matrix[6];
+	char * pos = value;
+	locale_t oldLocale = uselocale(getNumericLocale());
+	int i;
+	for(i = 0; i < 6; i++) {
+		char * end;
+		errno = 0;
+		matrix[i] = strtof(pos, &end);
+		if(end == pos || errno != 0 || !isfinite(matrix[i])) break;
+		pos = end;
+	}
+	uselocale(oldLocale);
+	while(*pos == ' ' || *pos == '\t') pos++;
+	if(i < 6 || *pos != 0) {
+		fprintf(stderr, "%s:%i: invalid matrix '%s' for %s\n", fileName, lineNumber, value, key);
 		return 0;
 	}
+	memcpy(out_matrix, matrix, sizeof matrix);
+	return 1;
+}
+
+/* Parses a profile file or journal of size bytes in buffer, which must be followed by a 0 byte.
+   Lines are tokenized in place, so only the strings of the profiles that are actually added get
+   allocated. name is only used in messages. */
+void addDeviceSettingsFromBuffer(char * fileName, char * buffer, size_t size, DeviceSettingsList * list, char * onlyForDevice, int isJournal) {
+	if(isJournal) {
+		/* A record that is still being appended is ignored; complete records end with an empty line */
+		while(size > 0 && !(size >= 2 && buffer[size - 1] == '\n' && buffer[size - 2] == '\n')) {
+			size--;
+		}
+		buffer[size] = 0;
+	}
 
 	int profileCount = 0;
+	int section = SECTION_PROFILE;
 	DeviceSettings loadedSettings;
 	int calibLoaded = 0;
-
-	char line[256];
+	int lineNumber = 0;
 
 	clearDeviceSettingsEntry(&loadedSettings);
 	loadedSettings.autoCalibration = 1;
 
-	while(1) {
-		char* readline = fgets(line, 256, fileDesc);
-		if(!readline) break;
-	
-		/* Remove newline at end */
-		int i; int eqAt = -1;
-		for(i = 0; i<256; i++) {
-			if(line[i] == '=' && eqAt == -1) eqAt = i;
-			if(line[i] == '\n') line[i] = 0;
-			if(line[i] == 0) break;
-		}
-	
-		if(!strcmp(line, "[profile]")) {
+	char * line = buffer;
+	char * bufferEnd = buffer + size;
+	while(line < bufferEnd) {
+		lineNumber++;
+
+		/* Terminate line */
+		char * lineEnd = memchr(line, '\n', bufferEnd - line);
+		if(lineEnd == NULL) lineEnd = bufferEnd;
+		*lineEnd = 0;
+		char * next = lineEnd + 1;
+		if(lineEnd > line && lineEnd[-1] == '\r') lineEnd[-1] = 0;
+
+		char * eq = strchr(line, '=');
+
+		if(!strcmp(line, "[profile]") || (isJournal && !strcmp(line, "[delete]"))) {
 			/* New profile shall be started */
 			if(profileCount > 0) {
-				if(onlyForDevice == NULL || (loadedSettings.inputDeviceName != NULL && !strcmp(onlyForDevice, loadedSettings.inputDeviceName))) {
-					/* Add previous profile */
-					addDeviceSettingsEntry(list, &loadedSettings);
-				}
+				/* Add previous profile */
+				addParsedProfile(list, &loadedSettings, section, isJournal, onlyForDevice);
 			}
 			/* Start new profile */
 			clearDeviceSettingsEntry(&loadedSettings);
 			loadedSettings.autoCalibration = 1;
 			calibLoaded = 0;
 			profileCount++;
-		} else if(eqAt > 0) {
-			char * befEq=strndup(line, eqAt);
-			char * afEq=strndup(line + eqAt + 1, strlen(line) - (eqAt + 1));
-			if(!befEq || !afEq) {
-				fprintf(stderr, "Out of memory.\n");
-				exit(1);
-			}
-			
-			if(!strcmp(befEq,"device")) {
-				loadedSettings.inputDeviceName = strdup(afEq);
-			} else if(!strcmp(befEq,"output")) {
-				if(!strcmp(afEq, "AUTO_FIRST_LVDS")) {
+			section = (line[1] == 'd' ? SECTION_DELETE : SECTION_PROFILE);
+		} else if(line[0] == 0) {
+			/* Empty line */
+		} else if(eq == NULL || eq == line) {
+			fprintf(stderr, "%s:%i: expected key=value\n", fileName, lineNumber);
+		} else if(profileCount == 0) {
+			fprintf(stderr, "%s:%i: setting outside of a [profile] section\n", fileName, lineNumber);
+		} else {
+			*eq = 0;
+			char * key = line;
+			char * value = eq + 1;
+
+			if(!strcmp(key,"device")) {
+				loadedSettings.inputDeviceName = value;
+			} else if(!strcmp(key,"output")) {
+				if(!strcmp(value, "AUTO_FIRST_LVDS")) {
 					loadedSettings.attachedOutput = NULL;
 					loadedSettings.autoOutput = 1;
 				} else {
-					loadedSettings.attachedOutput = strdup(afEq);
+					loadedSettings.attachedOutput = value;
 					loadedSettings.autoOutput = 0;
 				}
-			} else if(!strcmp(befEq,"minx")) {
-				loadedSettings.outputMinX = strtol(afEq, NULL, 0);
-				calibLoaded |= BIT_0;
-
-			} else if(!strcmp(befEq,"maxx")) {
-				loadedSettings.outputMaxX = strtol(afEq, NULL, 0);
-				calibLoaded |= BIT_1;
-				
-			} else if(!strcmp(befEq,"miny")) {
-				loadedSettings.outputMinY = strtol(afEq, NULL, 0);
-				calibLoaded |= BIT_2;
-				
-			} else if(!strcmp(befEq,"maxy")) {
-				loadedSettings.outputMaxY = strtol(afEq, NULL, 0);
-				calibLoaded |= BIT_3;
-				
-			} else if(!strcmp(befEq,"swapaxes")) {
-				loadedSettings.swapAxes = (strtol(afEq, NULL, 0) != 0);
+			} else if(!strcmp(key,"minx")) {
+				if(parseNumber(fileName, lineNumber, key, value, &loadedSettings.outputMinX)) calibLoaded |= BIT_0;
+			} else if(!strcmp(key,"maxx")) {
+				if(parseNumber(fileName, lineNumber, key, value, &loadedSettings.outputMaxX)) calibLoaded |= BIT_1;
+			} else if(!strcmp(key,"miny")) {
+				if(parseNumber(fileName, lineNumber, key, value, &loadedSettings.outputMinY)) calibLoaded |= BIT_2;
+			} else if(!strcmp(key,"maxy")) {
+				if(parseNumber(fileName, lineNumber, key, value, &loadedSettings.outputMaxY)) calibLoaded |= BIT_3;
+			} else if(!strcmp(key,"swapaxes")) {
+				int swapAxes;
+				if(parseNumber(fileName, lineNumber, key, value, &swapAxes)) loadedSettings.swapAxes = (swapAxes != 0);
+			} else if(!strcmp(key,"matrix")) {
+				if(parseMatrix(fileName, lineNumber, key, value, loadedSettings.matrix)) loadedSettings.hasMatrix = 1;
+			} else {
+				fprintf(stderr, "%s:%i: unknown key '%s'\n", fileName, lineNumber, key);
 			}
 			if(calibLoaded == (BIT_0 | BIT_1 | BIT_2 | BIT_3)) {
 				loadedSettings.autoCalibration = 0;
 			}
-
-			free(befEq);
-			free(afEq);
 		}
 
+		line = next;
 	}
 	if(profileCount > 0) {
 		/* Add last profile */
-				if(onlyForDevice == NULL || (loadedSettings.inputDeviceName != NULL && !strcmp(onlyForDevice, loadedSettings.inputDeviceName))) {
-			addDeviceSettingsEntry(list, &loadedSettings);
-		}
+		addParsedProfile(list, &loadedSettings, section, isJournal, onlyForDevice);
 	}
+}
 
-	fclose(fileDesc);
+static int parseProfileFile(char * fileName, int fd, DeviceSettingsList * list, char * onlyForDevice, int isJournal) {
+	size_t size;
+	char * buffer = readWholeFile(fd, &size);
+	if(buffer == NULL) {
+		return 0;
+	}
+	addDeviceSettingsFromBuffer(fileName, buffer, size, list, onlyForDevice, isJournal);
+	free(buffer);
 	return 1;
 }
 
+static char * getJournalFileName(char * fileName) {
+	char * journalName = malloc(strlen(fileName) + strlen(JOURNAL_FILE_SUFFIX) + 1);
+	if(journalName == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	strcpy(journalName, fileName);
+	strcat(journalName, JOURNAL_FILE_SUFFIX);
+	return journalName;
+}
+
+/* Adds the profiles of the file with the changes of the journal open as journalFd (-1 if there
+   is none) applied. The caller holds a lock on the journal, see addDeviceSettingsFromFile(). */
+static int addProfileStore(char * fileName, int journalFd, DeviceSettingsList * list, char * onlyForDevice) {
+	DeviceSettingsList fileList;
+	initSettingsList(&fileList);
+
+	int fileLoaded = 0, journalLoaded = 0;
+	int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+	if(fd >= 0) {
+		fileLoaded = parseProfileFile(fileName, fd, &fileList, onlyForDevice, 0);
+		close(fd);
+	}
+	if(journalFd >= 0) {
+		char * journalName = getJournalFileName(fileName);
+		journalLoaded = parseProfileFile(journalName, journalFd, &fileList, onlyForDevice, 1);
+		free(journalName);
+	}
+
+	/* Move the profiles to the list; the journal only applies to its own file, so this is done afterwards */
+	int i;
+	for(i = 0; i < fileList.nDeviceSettings; i++) {
+		DeviceSettings * settings = &(fileList.deviceSettings[i]);
+		if(settings->inputDeviceName == NULL) {
+			/* Has been deleted */
+			free(settings->attachedOutput);
+		} else {
+			addDeviceSettings(list, settings->inputDeviceName, settings->attachedOutput, settings->autoOutput, settings->autoCalibration,
+				settings->outputMinX, settings->outputMaxX, settings->outputMinY, settings->outputMaxY, settings->swapAxes,
+				settings->hasMatrix ? settings->matrix : NULL);
+		}
+		free(settings->inputDeviceIDs);
+	}
+	fileList.nDeviceSettings = 0;
+	freeSettings(&fileList);
+
+	return fileLoaded || journalLoaded;
+}
+
+/* Adds the profiles of the file with the changes of its journal applied. The file and the
+   journal are read under a shared lock of the journal, so a compaction can't replace the
+   file and empty the journal in between. */
+int addDeviceSettingsFromFile(char * fileName, DeviceSettingsList * list, char * onlyForDevice) {
+	char * journalName = getJournalFileName(fileName);
+	int journalFd = open(journalName, O_RDONLY | O_CLOEXEC);
+	free(journalName);
+	if(journalFd >= 0) {
+		flock(journalFd, LOCK_SH);
+	}
+
+	int result = addProfileStore(fileName, journalFd, list, onlyForDevice);
+
+	if(journalFd >= 0) {
+		flock(journalFd, LOCK_UN);
+		close(journalFd);
+	}
+	return result;
+}
+
+/* Appends a record to the journal of the file with a single write, so readers
+   either see the whole record or none of it */
+static int appendJournalRecord(char * fileName, char * record, size_t length) {
+	char * journalName = getJournalFileName(fileName);
+	int fd = open(journalName, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	free(journalName);
+	if(fd < 0) {
+		return 0;
+	}
+	/* Don't append while the journal is being read or compacted */
+	flock(fd, LOCK_EX);
+	int result = (write(fd, record, length) == (ssize_t) length);
+	struct stat st;
+	int compact = (result && fstat(fd, &st) == 0 && st.st_size > JOURNAL_COMPACT_SIZE);
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if(compact) {
+		compactProfileStore(fileName);
+	}
+	return result;
+}
+
+/* Changes or adds the profile in the file. Only the change is written. */
+int storeProfileChange(char * fileName, DeviceSettings * newSettings) {
+	char * record = NULL;
+	size_t length = 0;
+	FILE * stream = open_memstream(&record, &length);
+	if(stream == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	writeProfile(stream, newSettings);
+	fclose(stream);
+
+	int result = appendJournalRecord(fileName, record, length);
+	free(record);
+	return result;
+}
+
+/* Removes the profile of the device from the file. Only the change is written. */
+int storeProfileDeletion(char * fileName, char * deviceName) {
+	char * record = NULL;
+	size_t length = 0;
+	FILE * stream = open_memstream(&record, &length);
+	if(stream == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	fprintf(stream, "[delete]\ndevice=%s\n\n", deviceName);
+	fclose(stream);
+
+	int result = appendJournalRecord(fileName, record, length);
+	free(record);
+	return result;
+}
+
+/* Writes the file with all journal records applied and empties the journal */
+int compactProfileStore(char * fileName) {
+	char * journalName = getJournalFileName(fileName);
+	int fd = open(journalName, O_RDWR | O_CLOEXEC);
+	free(journalName);
+	if(fd < 0) {
+		/* No journal, nothing to do */
+		return 1;
+	}
+	/* Readers hold a shared lock while they read the file and the journal, so none of them
+	   sees the new file together with the old records or the old file without them */
+	flock(fd, LOCK_EX);
+
+	DeviceSettingsList list;
+	initSettingsList(&list);
+	addProfileStore(fileName, fd, &list, NULL);
+	int result = saveDeviceSettingsToFile(fileName, &list);
+	freeSettings(&list);
+
+	if(result) {
+		result = (ftruncate(fd, 0) == 0);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+	return result;
+}
@@ -12,12 +12,16 @@ public struct DeviceSettings {
 	int outputMinY;
 	int outputMaxY;
 	int swapAxes;
+	int hasMatrix;
+	float matrix[6];
 }
 
 public struct DeviceSettingsList {
 	DeviceSettings * deviceSettings;
 	int nDeviceSettings;
 	int nDeviceSettingsSpace;
+	int * nameIndex;
+	int nameIndexSize;
 }
 
 public struct InputDeviceInformation {
@@ -28,11 +32,27 @@ public struct InputDeviceInformation {
 
 extern int loadSettings(DeviceSettingsList * list, char * onlyForDevice, char * onlyFile);
 extern void freeSettings(DeviceSettingsList * list);
+extern int findProfile(DeviceSettingsList * list, char * deviceName);
 extern char* getGlobalFileName();
 extern char* getPrivateFileName();
-extern void changeProfile(DeviceSettingsList * list, DeviceSettings * newSettings);
-extern void deleteProfile(DeviceSettingsList * list, char * deviceName);
-extern int saveDeviceSettingsToFile(char * fileName, DeviceSettingsList * list);
+extern int storeProfileChange(char * fileName, DeviceSettings * newSettings);
+extern int storeProfileDeletion(char * fileName, char * deviceName);
+
+public struct ControlReply {
+	uint32 magic;
+	uint32 version;
+	int status;
+	int latency;
+	int count;
+	int size;
+}
+
+public const int CONTROL_ERROR_REQUEST = 1;
+
+extern int controlReloadProfile(char * displayName, char * deviceName, ControlReply * reply);
+extern int controlApplyDevice(char * displayName, int deviceId, ControlReply * reply);
+extern int controlPreviewProfile(char * displayName, DeviceSettings * settings, ControlReply * reply);
+extern char * getDisplayString(void* display);
 
 extern InputDeviceInformation * getTouchscreens(void* display);
 extern void freeInputDevices(InputDeviceInformation * information);
@@ -60,7 +80,9 @@ public class SettingsWindow {
 	Button btnCalibrate;
 	Button btnMonitors;
 	Button btnRevert;
+	Button btnSave;
 	Button btnApplyForAll;
+	Label lblCalibration;
 	TestArea testArea;
 	ComboBox cmbOutDevice;
 	ComboBox cmbDevice;
@@ -73,6 +95,8 @@ public class SettingsWindow {
 	MonitorInformation[] monitors;
 	/* If set to true, changing the active item in cmbOutDevice will temporarily be ignored */
 	bool ignoreOutputChange = false;
+	/* The helper uses settings that haven't been saved yet */
+	bool previewPending = false;
 	int selectedMonitorIndex = -1;
 	int monitorCount = 0;
 	int screenWidth;
@@ -87,6 +111,11 @@ public class SettingsWindow {
 	public bool autoCalibration;
 	public int outputMinX; public int outputMaxX; public int outputMinY; public int outputMaxY;
 	public bool swapAxes;
+	public bool hasMatrix;
+	public float matrix[6];
+
+	/* Crosses to tap per calibration */
+	public int calibrationPoints = Calibrator.DEFAULT_POINTS;
 
 	void *display;
 
@@ -110,8 +139,10 @@ public class SettingsWindow {
 		btnTestFullscreen = (Button) builder.get_object("btnTestFullscreen");
 		btnApplyForAll = (Button) builder.get_object("btnApplyForAll");
 		btnRevert = (Button) builder.get_object("btnRevert");
+		btnSave = (Button) builder.get_object("btnSave");
 		btnCalibrate = (Button) builder.get_object("btnCalibrate");
 		btnMonitors = (Button) builder.get_object("btnMonitors");
+		lblCalibration = (Label) builder.get_object("lblCalibration");
 		cmbOutDevice = (ComboBox) builder.get_object("cmbOutDevice");
 		cmbDevice = (ComboBox) builder.get_object("cmbDevice");
 		aspScreen = (AspectFrame) builder.get_object("aspScreen");
@@ -144,6 +175,7 @@ public class SettingsWindow {
 			oldSelectedMonitorName = null;
 			selectedMonitorName = null;
 			autoCalibration = true;
+			hasMatrix = false;
 		} else {
 			firstLVDS = (list.deviceSettings[0].autoOutput != 0);
 			oldSelectedMonitorName = (string) list.deviceSettings[0].attachedOutput;
@@ -154,6 +186,10 @@ public class SettingsWindow {
 			outputMinY = list.deviceSettings[0].outputMinY;
 			outputMaxY = list.deviceSettings[0].outputMaxY;
 			swapAxes = (list.deviceSettings[0].swapAxes != 0);
+			hasMatrix = (list.deviceSettings[0].hasMatrix != 0);
+			for(int i = 0; i < 6; i++) {
+				matrix[i] = list.deviceSettings[0].matrix[i];
+			}
 		}
 
 		freeSettings(&list);
@@ -163,9 +199,30 @@ public class SettingsWindow {
 	}
 	
 	public void saveDeviceSettings() {
-		DeviceSettingsList list = DeviceSettingsList();
-		loadSettings(&list, null, getPrivateFileName());
+		DeviceSettings d = getDeviceSettings();
+
+		/* Only the change is appended to the journal of the file */
+		storeProfileChange(getPrivateFileName(), &d);
+	}
 
+	/* Lets the helper apply the current settings without saving them */
+	public void previewDeviceSettings() {
+		DeviceSettings d = getDeviceSettings();
+		ControlReply reply = ControlReply();
+		if(controlPreviewProfile(getDisplayString(display), &d, &reply) != 0) {
+			setPreviewPending(true);
+		} else {
+			/* No helper that could preview them, so save right away */
+			storeProfileChange(getPrivateFileName(), &d);
+		}
+	}
+
+	private void setPreviewPending(bool pending) {
+		previewPending = pending;
+		btnSave.sensitive = pending;
+	}
+
+	private DeviceSettings getDeviceSettings() {
 		DeviceSettings d = DeviceSettings();
 		d.inputDeviceName = (char *) selectedDeviceName;
 		d.attachedOutput = (char *) selectedMonitorName;
@@ -176,21 +233,15 @@ public class SettingsWindow {
 		d.outputMinY = outputMinY;
 		d.outputMaxY = outputMaxY;
 		d.swapAxes = ( swapAxes ? 1 : 0);
-
-
-		changeProfile(&list, &d);
-		saveDeviceSettingsToFile(getPrivateFileName(), &list);
-		freeSettings(&list);
+		d.hasMatrix = ( hasMatrix ? 1 : 0);
+		for(int i = 0; i < 6; i++) {
+			d.matrix[i] = matrix[i];
+		}
+		return d;
 	}
 
 	private void resetDeviceSettings() {
-		DeviceSettingsList list = DeviceSettingsList();
-		loadSettings(&list, null, getPrivateFileName());
-
-
-		deleteProfile(&list, (char *) selectedDeviceName);
-		saveDeviceSettingsToFile(getPrivateFileName(), &list);
-		freeSettings(&list);
+		storeProfileDeletion(getPrivateFileName(), (char *) selectedDeviceName);
 	}
 
 	private void makeGlobal() {
@@ -200,6 +251,11 @@ public class SettingsWindow {
 			string err;
 			//TODO escape string
 			string cmd = "/usr/bin/gtouchsett --set-global '" + selectedDeviceName + "' '" + (selectedMonitorName == null? "" : selectedMonitorName) + "' " + (autoCalibration?"1":"0") + " " +  (autoCalibration?"0":outputMinX.to_string()) + " " + (autoCalibration?"0":outputMaxX.to_string()) + " " + (autoCalibration?"0":outputMinY.to_string()) + " " + (autoCalibration?"0":outputMaxY.to_string()) + " " + (swapAxes ?"1":"0");
+			if(!autoCalibration && hasMatrix) {
+				for(int i = 0; i < 6; i++) {
+					cmd += " " + ((double) matrix[i]).to_string();
+				}
+			}
 			Process.spawn_sync(null, { "/usr/bin/gksu", "--message", "Please enter your password to apply the settings for all users.", cmd}, null, 0, null, null, out err, out exitcode );
 
 			if(exitcode == 0) {
@@ -222,20 +278,37 @@ public class SettingsWindow {
 		reloadHelper();
 	}
 
+	/* Lets the helper re-read the saved profile of the selected device, which drops the preview */
 	public void reloadHelper() {
-		try {
-			Process.spawn_command_line_async("killall -SIGUSR1 touchscreen-helper");
-		} catch(SpawnError e) {
+		setPreviewPending(false);
+
+		/* Only the helper of our display re-reads the profile of the selected device */
+		ControlReply reply = ControlReply();
+		if(controlReloadProfile(getDisplayString(display), (char *) selectedDeviceName, &reply) != 0) {
+			debug("Settings applied by touchscreen-helper in %d us", reply.latency);
+		} else if(reply.status == CONTROL_ERROR_REQUEST) {
 			MessageDialog md = new MessageDialog(window, Gtk.DialogFlags.MODAL, Gtk.MessageType.ERROR, Gtk.ButtonsType.CLOSE, "Error applying the settings");
-			md.secondary_text = e.message;
+			md.secondary_text = "The running touchscreen-helper doesn't understand the request.";
 			md.run();
 			md.destroy();
 		}
+	}
 
+	/* Shows how far the taps of the last calibration were off from the fitted calibration */
+	public void showCalibrationError(int points, double mean, double max) {
+		lblCalibration.set_markup("Calibrated with %d points: %.1f pixels off on average,\n%.1f at most. Calibrate again if that is too much.".printf(points, mean, max));
+	}
+
+	/* Lets the helper write the calibration it currently uses for the device again */
+	public void reapplyHelper(int deviceID) {
+		ControlReply reply = ControlReply();
+		controlApplyDevice(getDisplayString(display), deviceID, &reply);
 	}
 
 	private void connectSignals() {
 	        window.destroy.connect(() => {
+			/* Unsaved settings are dropped */
+			if(previewPending) reloadHelper();
 			Gtk.main_quit();
 		});
 		btnClose.clicked.connect(() => {
@@ -244,6 +317,11 @@ public class SettingsWindow {
 		btnClearTest.clicked.connect(() => {
 			testArea.clear();
 		});
+		btnSave.clicked.connect(() => {
+			saveDeviceSettings();
+			/* Calibration is unchanged, so the helper doesn't write anything */
+			reloadHelper();
+		});
 		btnRevert.clicked.connect(() => {
 			resetDeviceSettings();
 			reloadHelper();
@@ -256,7 +334,7 @@ public class SettingsWindow {
 			testArea.fullscreen(window, selectedMonitorIndex < monitorCount ? selectedMonitorIndex : -1);
 		});
 		btnCalibrate.clicked.connect(() => {
-			calibrator = new Calibrator(this, selectedMonitorIndex < monitorCount ? selectedMonitorIndex : -1, selectedMonitorName, display, touchscreens[cmbDevice.active].deviceID);
+			calibrator = new Calibrator(this, selectedMonitorIndex < monitorCount ? selectedMonitorIndex : -1, selectedMonitorName, display, touchscreens[cmbDevice.active].deviceID, calibrationPoints);
 		});
 		window.get_screen().monitors_changed.connect(() => {
 			loadMonitors();
@@ -287,12 +365,12 @@ public class SettingsWindow {
 					selectedMonitorName = monitors[selectedMonitorIndex].name;
 				}
 				drwMonitors.queue_draw();
-				saveDeviceSettings();
-				reloadHelper();
+				previewDeviceSettings();
 			}
 		});
 		cmbDevice.changed.connect(() => {
 			if(cmbDevice.active >= 0) {
+				if(previewPending) reloadHelper();
 				selectedDeviceName = (string) touchscreens[cmbDevice.active].deviceName;
 				loadDeviceSettings();
 			}
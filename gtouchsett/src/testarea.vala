@@ -2,18 +2,39 @@ using Gtk, Gdk;
 
 public class TestArea {
 
+	/* Microseconds per frame of a 60 Hz display; GTK 2 has no frame clock to ask */
+	const int64 FRAME_INTERVAL = 16667;
+
 	public DrawingArea drwTest;
 	bool testDown = false;
-	Cairo.Context testContext = null;
 	double testLastX = 0;
 	double testLastY = 0;
-	public Gdk.Pixmap testPixmap;
+	/* Client-side image of the ink, as large as the screen so that it never has to grow when the
+	   window is resized or made fullscreen; shared with the fullscreen test area. */
+	public Cairo.ImageSurface? testSurface;
+
+	/* Points received since the last frame. Each stroke starts at pendingX[i], pendingY[i]
+	   where pendingMove[i] is set. */
+	double[] pendingX = new double[64];
+	double[] pendingY = new double[64];
+	bool[] pendingMove = new bool[64];
+	int nPending = 0;
+	/* End of the segment drawn last, where the pending path continues */
+	double pathStartX;
+	double pathStartY;
+	/* Union of the bounding boxes of the pending segments */
+	double damageMinX;
+	double damageMinY;
+	double damageMaxX;
+	double damageMaxY;
+	uint frameSource = 0;
+	int64 lastFrameTime = 0;
 
 	public TestAreaFullscreen fullscreenWindow = null;
 
-	public TestArea(DrawingArea drawingArea, Gdk.Pixmap? pixmap) {
+	public TestArea(DrawingArea drawingArea, Cairo.ImageSurface? surface) {
 		drwTest = drawingArea;
-		testPixmap = pixmap;
+		testSurface = surface;
 
 		//drwTest.modify_bg(Gtk.StateType.NORMAL, drwTest.style.white);
 
@@ -23,48 +44,66 @@ public class TestArea {
 
 	private void connectSignals() {
 		drwTest.configure_event.connect(() => {
-			int w=0, h=0;
-			if(testPixmap != null) testPixmap.get_size(out w, out h);
-			/* Make pixmap larger if necessary. */
-			int nw = max(w, drwTest.allocation.width);
-			int nh = max(h, drwTest.allocation.height);
-			if(nw!=w || nh!=h) {
-				var pixmap = new Gdk.Pixmap(drwTest.window, nw, nh, -1);
-				pixmap.draw_rectangle(drwTest.style.white_gc, true, 0, 0, nw, nh);
-				if(testPixmap != null) {
-					/* Draw old content */
-					pixmap.draw_drawable(drwTest.style.fg_gc[Gtk.StateType.NORMAL],testPixmap, 0, 0, 0, 0,  w, h);
-				}
-				testPixmap = pixmap;
+			int w = 0, h = 0;
+			if(testSurface != null) {
+				w = testSurface.get_width();
+				h = testSurface.get_height();
+			}
+			if(w >= drwTest.allocation.width && h >= drwTest.allocation.height) {
+				return true;
+			}
+			/* Only happens when the screen has grown since the surface was made */
+			Gdk.Screen screen = drwTest.get_screen();
+			int nw = max(max(w, drwTest.allocation.width), screen.get_width());
+			int nh = max(max(h, drwTest.allocation.height), screen.get_height());
+			var surface = new Cairo.ImageSurface(Cairo.Format.RGB24, nw, nh);
+			var cr = new Cairo.Context(surface);
+			cr.set_source_rgb(1, 1, 1);
+			cr.paint();
+			if(testSurface != null) {
+				flushPending();
+				cr.set_source_surface(testSurface, 0, 0);
+				cr.paint();
 			}
+			testSurface = surface;
 			return true;
 		});
 		drwTest.expose_event.connect((sender, evt) => {
-			drwTest.window.draw_drawable(drwTest.style.fg_gc[Gtk.StateType.NORMAL],testPixmap, evt.area.x, evt.area.y, evt.area.x, evt.area.y, evt.area.width, evt.area.height);
+			if(testSurface == null) return true;
+			var cr = Gdk.cairo_create(drwTest.window);
+			Gdk.cairo_rectangle(cr, evt.area);
+			cr.clip();
+			cr.set_source_surface(testSurface, 0, 0);
+			cr.paint();
 			return true;
 		});
 		drwTest.button_press_event.connect((sender, evt) => {
 			testDown = true;
-			testContext = Gdk.cairo_create(testPixmap);
-			testContext.set_line_width(1.0);
 			testLastX = evt.x;
 			testLastY = evt.y;
+			addPoint(evt.x, evt.y, true);
 			return true;
 		});
 		drwTest.button_release_event.connect((sender,evt) => {
 			if(testDown) {
 				testDown = false;
-				drawTestSegment(evt.x, evt.y);
-				testContext = null;
+				addPoint(evt.x, evt.y, false);
 			}
 			return true;
 		});
 		drwTest.motion_notify_event.connect((sender,evt) => {
 			if(testDown) {
-				drawTestSegment(evt.x, evt.y);
+				addPoint(evt.x, evt.y, false);
 			}
 			return true;
 		});
+		drwTest.unrealize.connect(() => {
+			flushPending();
+			if(frameSource != 0) {
+				Source.remove(frameSource);
+				frameSource = 0;
+			}
+		});
 
 	}
 	
@@ -80,25 +119,84 @@ public class TestArea {
 	}
 
 
-	private void drawTestSegment(double x, double y) {
-		testContext.set_source_rgb(0,0,0);
-		testContext.move_to(testLastX, testLastY);
-		testContext.line_to(x,y);
-		testContext.stroke();
-		drwTest.queue_draw_area((int) minDbl(testLastX, x) - 1, (int) minDbl(testLastY, y) - 1, (int) maxDbl(testLastX, x)- (int) minDbl(testLastX, x) + 2, (int) maxDbl(testLastY, y)- (int) minDbl(testLastY, y) + 2);
-		testLastX = x;
-		testLastY = y;
+	/* Queues a point of the current stroke; it is drawn with the next frame */
+	private void addPoint(double x, double y, bool move) {
+		if(nPending == pendingX.length) {
+			pendingX.resize(nPending * 2);
+			pendingY.resize(nPending * 2);
+			pendingMove.resize(nPending * 2);
+		}
+		if(nPending == 0) {
+			pathStartX = testLastX;
+			pathStartY = testLastY;
+			damageMinX = damageMaxX = testLastX;
+			damageMinY = damageMaxY = testLastY;
+		}
+		pendingX[nPending] = x;
+		pendingY[nPending] = y;
+		pendingMove[nPending] = move;
+		nPending++;
+		damageMinX = minDbl(damageMinX, x);
+		damageMinY = minDbl(damageMinY, y);
+		damageMaxX = maxDbl(damageMaxX, x);
+		damageMaxY = maxDbl(damageMaxY, y);
+		if(!move) {
+			testLastX = x;
+			testLastY = y;
+		}
+		scheduleFrame();
+	}
+
+	/* The first point after a pause is drawn right away, later ones at most once per frame.
+	   The priority is above the one GDK processes the queued redraws with, so the damage
+	   is painted in the same main loop iteration. */
+	private void scheduleFrame() {
+		if(frameSource != 0) return;
+		int64 wait = lastFrameTime + FRAME_INTERVAL - get_monotonic_time();
+		uint delay = wait > 0 ? (uint) ((wait + 999) / 1000) : 0;
+		frameSource = Timeout.add(delay, () => {
+			frameSource = 0;
+			lastFrameTime = get_monotonic_time();
+			flushPending();
+			return false;
+		}, Priority.HIGH_IDLE + 10);
+	}
+
+	/* Strokes all pending points as one path and queues a single redraw of their bounding box */
+	public void flushPending() {
+		if(nPending == 0 || testSurface == null) return;
+		var cr = new Cairo.Context(testSurface);
+		cr.set_source_rgb(0,0,0);
+		cr.set_line_width(1.0);
+		int i;
+		if(!pendingMove[0]) {
+			cr.move_to(pathStartX, pathStartY);
+		}
+		for(i = 0; i < nPending; i++) {
+			if(pendingMove[i]) {
+				cr.move_to(pendingX[i], pendingY[i]);
+			} else {
+				cr.line_to(pendingX[i], pendingY[i]);
+			}
+		}
+		cr.stroke();
+		drwTest.queue_draw_area((int) damageMinX - 1, (int) damageMinY - 1, (int) damageMaxX - (int) damageMinX + 3, (int) damageMaxY - (int) damageMinY + 3);
+		nPending = 0;
 	}
 
 
 	public void clear() {
-		int w, h;
-		testPixmap.get_size(out w, out h);
-		testPixmap.draw_rectangle(drwTest.style.white_gc, true, 0, 0, w, h);
+		nPending = 0;
+		if(testSurface != null) {
+			var cr = new Cairo.Context(testSurface);
+			cr.set_source_rgb(1, 1, 1);
+			cr.paint();
+		}
 		drwTest.queue_draw();
 	}
 	
 	public void fullscreen(Gtk.Window parent, int monitor) {
+		flushPending();
 		fullscreenWindow = new TestAreaFullscreen(this, parent, monitor);
 	
 	}
@@ -139,7 +237,7 @@ public class TestAreaFullscreen {
 		}
 
 		window = (Gtk.Window) builder.get_object("winFullScreenTest");
-		testArea = new TestArea(builder.get_object("drwTest") as DrawingArea, parentTestArea.testPixmap);
+		testArea = new TestArea(builder.get_object("drwTest") as DrawingArea, parentTestArea.testSurface);
 		btnLeave = (Button) builder.get_object("btnLeave");
 		btnClear = (Button) builder.get_object("btnClear");
 		btnBarUp = (Button) builder.get_object("btnBarUp");
@@ -165,7 +263,8 @@ public class TestAreaFullscreen {
 	}
 	
 	private void close() {
-		parentTestArea.testPixmap = testArea.testPixmap;
+		testArea.flushPending();
+		parentTestArea.testSurface = testArea.testSurface;
 		parentTestArea.redraw();
 		window.dispose();
 		//parentTestArea.fullscreenWindow = null;
@@ -6,11 +6,9 @@
 #include <X11/Xatom.h>
 #include <X11/extensions/XInput2.h>
 #include <X11/extensions/XInput.h>
-
-Atom absXAtom;
-Atom absYAtom;
-Atom absXAtomMT;
-Atom absYAtomMT;
+#include <string.h>
+#include <stdint.h>
+#include "atoms.h"
 
 typedef struct _InputDeviceInformation {
 	char* deviceName;
@@ -25,10 +23,10 @@ int isAbsoluteInputDevice(XIDeviceInfo * deviceInfo) {
 		if(deviceInfo->classes[c]->type == XIValuatorClass) {
 			XIValuatorClassInfo* valuatorInfo = (XIValuatorClassInfo *) deviceInfo->classes[c];
 			if(valuatorInfo->mode == XIModeAbsolute) {
-				if(valuatorInfo->label == absXAtom || valuatorInfo->label == absXAtomMT) {
+				if(valuatorInfo->label == atoms[ATOM_ABS_X] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_X]) {
 					xFound = 1;
 					if(yFound) return 1;
-				} else if(valuatorInfo->label == absYAtom || valuatorInfo->label == absYAtomMT) {
+				} else if(valuatorInfo->label == atoms[ATOM_ABS_Y] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_Y]) {
 					yFound = 1;
 					if(xFound) return 1;
 				}
@@ -40,11 +38,6 @@ int isAbsoluteInputDevice(XIDeviceInfo * deviceInfo) {
 }
 
 InputDeviceInformation * getTouchscreens(Display* display) {
-	absXAtom = XInternAtom(display, "Abs X", False);
-	absYAtom = XInternAtom(display, "Abs Y", False);
-	absXAtomMT = XInternAtom(display, "Abs MT Position X", False);
-	absYAtomMT = XInternAtom(display, "Abs MT Position Y", False);
-
 	int n;
 	int touchscreenCount = 0;
 	XIDeviceInfo *info = XIQueryDevice(display, XIAllDevices, &n);
@@ -110,42 +103,6 @@ void freeInputDevices(InputDeviceInformation * information) {
 	free(information);
 }
 
-int getLastRawCoordinates(Display* display, int deviceID, int * out_x, int * out_y) {
-	int n;
-	XIDeviceInfo *info = XIQueryDevice(display, deviceID, &n);
-	if (!info) {
-		return 0;
-	}
-	if(n != 1) {
-		XIFreeDeviceInfo(info);
-		return 0;
-	}
-
-	int c, xFound, yFound;
-	for(c = 0; c < info[0].num_classes; c++) {
-		if(info[0].classes[c]->type == XIValuatorClass) {
-			XIValuatorClassInfo* valuatorInfo = (XIValuatorClassInfo *) info[0].classes[c];
-			if(valuatorInfo->mode == XIModeAbsolute) {
-				if(valuatorInfo->label == absXAtom || valuatorInfo->label == absXAtomMT) {
-					xFound = 1;
-					* out_x = valuatorInfo->value;
-				} else if(valuatorInfo->label == absYAtom || valuatorInfo->label == absYAtomMT) {
-					yFound = 1;
-					* out_y = valuatorInfo->value;
-				}
-			}
-		}
-	}	
-	
-	XIFreeDeviceInfo(info);
-	if(xFound && yFound) {
-		return 1;
-	} else {
-		return 0;
-	}
-
-}
-
 void getMinMaxXY(Display* display, int deviceID, int* out_minX, int* out_maxX, int* out_minY, int* out_maxY) {
 
 	int n;
@@ -163,10 +120,10 @@ void getMinMaxXY(Display* display, int deviceID, int* out_minX, int* out_maxX, i
 		if(info->classes[c]->type == XIValuatorClass) {
 			XIValuatorClassInfo* valuatorInfo = (XIValuatorClassInfo *) info->classes[c];
 			if(valuatorInfo->mode == XIModeAbsolute) {
-				if(valuatorInfo->label == absXAtom || valuatorInfo->label == absXAtomMT) {
+				if(valuatorInfo->label == atoms[ATOM_ABS_X] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_X]) {
 					*out_minX = valuatorInfo->min;
 					*out_maxX = valuatorInfo->max;
-				} else if(valuatorInfo->label == absYAtom || valuatorInfo->label == absYAtomMT) {
+				} else if(valuatorInfo->label == atoms[ATOM_ABS_Y] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_Y]) {
 					*out_minY = valuatorInfo->min;
 					*out_maxY = valuatorInfo->max;
 				}
@@ -178,54 +135,265 @@ void getMinMaxXY(Display* display, int deviceID, int* out_minX, int* out_maxX, i
 
 }
 
-void resetCalibration(Display* display, int deviceID, int factor) {
-	XDevice *dev = XOpenDevice(display, deviceID);
-	if(dev) {
-		
-
-		int minX = 0, maxX = 1000, minY = 0, maxY = 1000;
-		getMinMaxXY(display, deviceID, &minX, &maxX, &minY, &maxY);
-		minX *= factor;
-		maxX *= factor;
-		minY *= factor;
-		maxY *= factor;
-
-		long data[] = { minX, maxX, minY, maxX };
-		int i;
-		XChangeDeviceProperty(display, dev, XInternAtom(display,
-			"Evdev Axis Calibration", 0), XA_INTEGER, 32, PropModeReplace, (unsigned char*) data, 4);
-
-		unsigned char data2[] = {0, 0};
-		XChangeDeviceProperty(display, dev, XInternAtom(display,
-			"Evdev Axis Inversion", 0), XA_INTEGER, 8, PropModeReplace, data2, 2);
-
-		unsigned char axesSwap = 0;
-
-		XChangeDeviceProperty(display, dev, XInternAtom(display,
-			"Evdev Axes Swap", 0), XA_INTEGER, 8, PropModeReplace, &axesSwap, 1);
-
-
-		long l;
-		if((sizeof l) == 4) {
-			float data4[] = { 1., 0., 0., 
-				          0., 1., 0.,
-				          0., 0., 1. };
-
-			XChangeDeviceProperty(display, dev, XInternAtom(display,
-				"Coordinate Transformation Matrix", 0), XInternAtom(display,
-				"FLOAT", 0), 32, PropModeReplace, (unsigned char*) data4, 9);
-		} else if((sizeof l) == 8) {
-			/* Xlib needs the floats long-aligned, so add "buffer" elements. */
-			float data4[] = { 1., 0., 0., 0., 0., 0., 
-				          0., 0., 1., 0., 0., 0.,
-				          0., 0., 0., 0., 1., 0. };
-
-			XChangeDeviceProperty(display, dev, XInternAtom(display,
-				"Coordinate Transformation Matrix", 0), XInternAtom(display,
-				"FLOAT", 0), 32, PropModeReplace, (unsigned char*) data4, 9);
+/* Makes the device report its raw coordinates: every calibration property the device has
+   is set to leave them unchanged. Properties the driver doesn't know aren't written, they
+   would be created and make the device look like one of another driver. */
+void resetCalibration(void * d, int deviceID) {
+	Display *display = d;
+	int nProperties;
+	Atom *properties = XIListProperties(display, deviceID, &nProperties);
+	if(properties == NULL) return;
+
+	int minX = 0, maxX = 1000, minY = 0, maxY = 1000;
+	getMinMaxXY(display, deviceID, &minX, &maxX, &minY, &maxY);
+
+	/* Format 32 data is passed as 32 bit values to XIChangeProperty(), not as longs */
+	int32_t calib[] = { minX, maxX, minY, maxY };
+	unsigned char inversion[] = { 0, 0 };
+	unsigned char axesSwap = 0;
+	float identity[] = { 1., 0., 0.,
+	                     0., 1., 0.,
+	                     0., 0., 1. };
+
+	int p;
+	for(p = 0; p < nProperties; p++) {
+		if(properties[p] == atoms[ATOM_EVDEV_AXIS_CALIBRATION]) {
+			XIChangeProperty(display, deviceID, properties[p], XA_INTEGER, 32, PropModeReplace, (unsigned char*) calib, 4);
+		} else if(properties[p] == atoms[ATOM_EVDEV_AXIS_INVERSION]) {
+			XIChangeProperty(display, deviceID, properties[p], XA_INTEGER, 8, PropModeReplace, inversion, 2);
+		} else if(properties[p] == atoms[ATOM_EVDEV_AXES_SWAP]) {
+			XIChangeProperty(display, deviceID, properties[p], XA_INTEGER, 8, PropModeReplace, &axesSwap, 1);
+		} else if(properties[p] == atoms[ATOM_TRANSFORMATION_MATRIX] || properties[p] == atoms[ATOM_LIBINPUT_CALIBRATION_MATRIX]) {
+			XIChangeProperty(display, deviceID, properties[p], atoms[ATOM_FLOAT], 32, PropModeReplace, (unsigned char*) identity, 9);
+		}
+	}
+
+	XFree(properties);
+	XFlush(display);
+}
+
+/* Most samples kept of one press; the median needs all of them */
+#define MAX_RAW_SAMPLES 1024
+
+/* Milliseconds after the press and before the release in which the finger is still landing or
+   already lifting; samples from then are ignored if there are any others */
+#define RAW_DWELL_SETTLE_MS 50
+
+/* Collects the raw coordinates the device reports while it is pressed */
+typedef struct _RawSampler {
+	Display * display;
+	int deviceID;
+	int opcode;		/* Major opcode of XInput */
+	int axisX;		/* Valuator numbers of the absolute axes */
+	int axisY;
+	int pressed;
+	int touchID;		/* Touch that is sampled if the press is a touch */
+	int lastX;		/* Raw events only contain the valuators that have changed */
+	int lastY;
+	Time pressTime;
+	int nSamples;
+	int samplesX[MAX_RAW_SAMPLES];
+	int samplesY[MAX_RAW_SAMPLES];
+	Time samplesTime[MAX_RAW_SAMPLES];
+} RawSampler;
+
+static int compareInts(const void * a, const void * b) {
+	int x = *(const int *) a, y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+static int median(int * values, int n) {
+	qsort(values, n, sizeof(int), compareInts);
+	return values[n / 2];
+}
+
+static void selectRawEvents(RawSampler * sampler, int touch, int enable) {
+	unsigned char mask[XIMaskLen(XI_LASTEVENT)];
+	memset(mask, 0, sizeof mask);
+	if(enable) {
+		XISetMask(mask, XI_RawMotion);
+		XISetMask(mask, XI_RawButtonPress);
+		XISetMask(mask, XI_RawButtonRelease);
+#ifdef XI_RawTouchBegin
+		if(touch) {
+			XISetMask(mask, XI_RawTouchBegin);
+			XISetMask(mask, XI_RawTouchUpdate);
+			XISetMask(mask, XI_RawTouchEnd);
+		}
+#endif
+	}
+
+	XIEventMask eventMask;
+	eventMask.deviceid = sampler->deviceID;
+	eventMask.mask_len = sizeof mask;
+	eventMask.mask = mask;
+	XISelectEvents(sampler->display, DefaultRootWindow(sampler->display), &eventMask, 1);
+	XFlush(sampler->display);
+}
+
+/* Starts listening to the raw events of the device. Returns NULL if the server can't send them. */
+void * startRawSampling(void * d, int deviceID) {
+	Display *display = d;
+	int opcode, event, error;
+	if(!XQueryExtension(display, "XInputExtension", &opcode, &event, &error)) {
+		return NULL;
+	}
+	/* Raw events reach clients without a grab since 2.1, raw touch events exist since 2.2 */
+	int major = 2, minor = 2;
+	if(XIQueryVersion(display, &major, &minor) != Success || major < 2 || (major == 2 && minor < 1)) {
+		return NULL;
+	}
+
+	RawSampler *sampler = calloc(1, sizeof(RawSampler));
+	if(sampler == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	sampler->display = display;
+	sampler->deviceID = deviceID;
+	sampler->opcode = opcode;
+	sampler->axisX = sampler->axisY = -1;
+
+	int n;
+	XIDeviceInfo *info = XIQueryDevice(display, deviceID, &n);
+	if(info != NULL) {
+		int c;
+		for(c = 0; c < info->num_classes; c++) {
+			if(info->classes[c]->type == XIValuatorClass) {
+				XIValuatorClassInfo* valuatorInfo = (XIValuatorClassInfo *) info->classes[c];
+				if(valuatorInfo->mode == XIModeAbsolute) {
+					if(valuatorInfo->label == atoms[ATOM_ABS_X] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_X]) {
+						sampler->axisX = valuatorInfo->number;
+					} else if(valuatorInfo->label == atoms[ATOM_ABS_Y] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_Y]) {
+						sampler->axisY = valuatorInfo->number;
+					}
+				}
+			}
+		}
+		XIFreeDeviceInfo(info);
+	}
+	if(sampler->axisX == -1 || sampler->axisY == -1) {
+		free(sampler);
+		return NULL;
+	}
+
+	selectRawEvents(sampler, major > 2 || minor >= 2, 1);
+	return sampler;
+}
+
+void stopRawSampling(void * s) {
+	RawSampler *sampler = s;
+	if(sampler == NULL) return;
+	selectRawEvents(sampler, 0, 0);
+	free(sampler);
+}
+
+/* The file descriptor to watch for new events */
+int getRawSamplerFd(void * s) {
+	return ConnectionNumber(((RawSampler *) s)->display);
+}
+
+/* Takes the valuators of the axes from the event; raw values are those of the device,
+   before any calibration or transformation of the X server */
+static void updateRawPosition(RawSampler * sampler, XIRawEvent * event) {
+	double *value = event->raw_values;
+	int i;
+	for(i = 0; i < event->valuators.mask_len * 8; i++) {
+		if(XIMaskIsSet(event->valuators.mask, i)) {
+			if(i == sampler->axisX) sampler->lastX = (int) *value;
+			if(i == sampler->axisY) sampler->lastY = (int) *value;
+			value++;
+		}
+	}
+	if(sampler->pressed && sampler->nSamples < MAX_RAW_SAMPLES) {
+		sampler->samplesX[sampler->nSamples] = sampler->lastX;
+		sampler->samplesY[sampler->nSamples] = sampler->lastY;
+		sampler->samplesTime[sampler->nSamples] = event->time;
+		sampler->nSamples++;
+	}
+}
+
+/* Keeps only the samples of the dwell, away from the press and the release. Server times are
+   32 bit milliseconds that wrap around. */
+static void filterDwellSamples(RawSampler * sampler, Time releaseTime) {
+	int i, n = 0;
+	for(i = 0; i < sampler->nSamples; i++) {
+		if((uint32_t) (sampler->samplesTime[i] - sampler->pressTime) >= RAW_DWELL_SETTLE_MS &&
+				(uint32_t) (releaseTime - sampler->samplesTime[i]) >= RAW_DWELL_SETTLE_MS) {
+			sampler->samplesX[n] = sampler->samplesX[i];
+			sampler->samplesY[n] = sampler->samplesY[i];
+			sampler->samplesTime[n] = sampler->samplesTime[i];
+			n++;
 		}
+	}
+	/* A quick tap has no dwell; all of it is better than nothing */
+	if(n > 0) sampler->nSamples = n;
+}
 
-		XCloseDevice(display, dev);
-		XFlush(display);
+/* Handles the queued events until a press of the device has ended. Returns 1 and the median
+   of the positions sampled while the press dwelled if so, 0 when there are no more events. */
+int nextRawTap(void * s, int * out_x, int * out_y) {
+	RawSampler *sampler = s;
+	Display *display = sampler->display;
+
+	while(XPending(display)) {
+		XEvent ev;
+		XNextEvent(display, &ev);
+		XGenericEventCookie *cookie = &(ev.xcookie);
+		if(cookie->type != GenericEvent || cookie->extension != sampler->opcode || !XGetEventData(display, cookie)) {
+			continue;
+		}
+
+		XIRawEvent *event = cookie->data;
+		int tap = 0;
+		if(event->deviceid == sampler->deviceID) {
+			switch(cookie->evtype) {
+#ifdef XI_RawTouchBegin
+				case XI_RawTouchBegin:
+#endif
+				case XI_RawButtonPress:
+					/* A touchscreen may send both an emulated button and touch events */
+					if(!sampler->pressed) {
+						sampler->pressed = 1;
+						sampler->nSamples = 0;
+						sampler->pressTime = event->time;
+						sampler->touchID = (cookie->evtype == XI_RawButtonPress ? -1 : event->detail);
+					}
+					if(sampler->touchID == -1 || event->detail == sampler->touchID) {
+						updateRawPosition(sampler, event);
+					}
+					break;
+#ifdef XI_RawTouchBegin
+				case XI_RawTouchUpdate:
+#endif
+				case XI_RawMotion:
+					if(cookie->evtype == XI_RawMotion || event->detail == sampler->touchID) {
+						updateRawPosition(sampler, event);
+					}
+					break;
+#ifdef XI_RawTouchBegin
+				case XI_RawTouchEnd:
+#endif
+				case XI_RawButtonRelease:
+					if(sampler->pressed && (cookie->evtype == XI_RawButtonRelease ? sampler->touchID == -1 : event->detail == sampler->touchID)) {
+						sampler->pressed = 0;
+						if(sampler->nSamples == 0) {
+							/* The device didn't move since the previous press */
+							sampler->samplesX[0] = sampler->lastX;
+							sampler->samplesY[0] = sampler->lastY;
+							sampler->nSamples = 1;
+						} else {
+							filterDwellSamples(sampler, event->time);
+						}
+						*out_x = median(sampler->samplesX, sampler->nSamples);
+						*out_y = median(sampler->samplesY, sampler->nSamples);
+						tap = 1;
+					}
+					break;
+			}
+		}
+		XFreeEventData(display, cookie);
+		if(tap) return 1;
 	}
+	return 0;
 }
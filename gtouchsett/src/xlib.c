@@ -5,9 +5,16 @@
 #include <X11/Xos.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/Xrandr.h>
+#include <string.h>
+#include <math.h>
+#include "atoms.h"
+#include "affine.h"
 
 void* initXlib() {
 	Display *display = XOpenDisplay((char *) NULL);
+	if(display != NULL) {
+		initAtoms(display);
+	}
 	return display;
 }
 
@@ -15,6 +22,11 @@ void finishXlib(void* display) {
 	XCloseDisplay(display);
 }
 
+/* Name of the display, identifies the helper serving it */
+char* getDisplayString(void* display) {
+	return DisplayString((Display *) display);
+}
+
 int getOutputRotation(void * display, char * outputName, int * out_rotation, int * out_mirrorX, int * out_mirrorY) {
 	XRRScreenResources *res = XRRGetScreenResourcesCurrent(display, DefaultRootWindow(display));
 	int found = 0;
@@ -60,3 +72,73 @@ int getOutputRotation(void * display, char * outputName, int * out_rotation, int
 	return found;
 
 }
+
+static int getOrientation(int rotation, int mirrorX, int mirrorY) {
+	int orientation = AFFINE_ROTATE_0;
+	if(rotation == 90) {
+		orientation = AFFINE_ROTATE_90;
+	} else if(rotation == 180) {
+		orientation = AFFINE_ROTATE_180;
+	} else if(rotation == 270) {
+		orientation = AFFINE_ROTATE_270;
+	}
+	if(mirrorX) orientation |= AFFINE_REFLECT_X;
+	if(mirrorY) orientation |= AFFINE_REFLECT_Y;
+	return orientation;
+}
+
+/* Fits the calibration matrix of a profile to n taps: devX/devY are the tapped device coordinates
+   relative to the axis ranges, targetX/targetY the positions of the targets in pixels of the output
+   (width x height) with the given rotation (in degrees) and reflection. The matrix maps onto the
+   unrotated output, so it stays valid when the output is rotated later. residuals receives the
+   distance of each tap from its target in pixels. Returns 0 if the taps don't span an area. */
+int solveCalibration(int n, float * devX, float * devY, float * targetX, float * targetY, int width, int height,
+		int rotation, int mirrorX, int mirrorY, float * out_matrix, float * out_residuals) {
+	AffineMatrix toPixels;
+	if(!affineSolve(devX, devY, targetX, targetY, n, &toPixels, out_residuals)) {
+		return 0;
+	}
+
+	/* Pixels to the unit square, then undo the orientation of the output */
+	AffineMatrix unrotate;
+	if(width <= 0 || height <= 0 || !affineInvert(affineOrientation(getOrientation(rotation, mirrorX, mirrorY)), &unrotate)) {
+		return 0;
+	}
+	AffineMatrix result = affineMultiply(unrotate, affineMultiply(affinePlacement(0., 0., 1. / width, 1. / height), toPixels));
+
+	memcpy(out_matrix, result.m, 6 * sizeof(float));
+	return 1;
+}
+
+/* The min/max values (and whether the axes are swapped) that come closest to the matrix, for
+   helpers and devices that can't use it. They are the raw values at the edges of the output.
+   Returns 0 and leaves the out parameters alone if the matrix can't be inverted. */
+int getMatrixLimits(float * matrix, int minX, int maxX, int minY, int maxY,
+		int * out_minX, int * out_maxX, int * out_minY, int * out_maxY, int * out_swapAxes) {
+	AffineMatrix m = affineMatrix(matrix[0], matrix[1], matrix[2], matrix[3], matrix[4], matrix[5]);
+	AffineMatrix inverse;
+	if(!affineInvert(m, &inverse)) return 0;
+
+	/* The horizontal output axis mostly follows device Y if the axes are swapped */
+	int swap = fabsf(m.m[1]) > fabsf(m.m[0]);
+
+	float edges[4][2] = { { 0., .5 }, { 1., .5 }, { .5, 0. }, { .5, 1. } };
+	float raw[4];
+	int i;
+	for(i = 0; i < 4; i++) {
+		float x, y;
+		affineApply(&inverse, edges[i][0], edges[i][1], &x, &y);
+		/* Edges 0 and 1 give the X calibration, which is applied to device Y after swapping */
+		if((i < 2) != swap) {
+			raw[i] = minX + x * (maxX - minX);
+		} else {
+			raw[i] = minY + y * (maxY - minY);
+		}
+	}
+	*out_minX = (int) lrintf(raw[0]);
+	*out_maxX = (int) lrintf(raw[1]);
+	*out_minY = (int) lrintf(raw[2]);
+	*out_maxY = (int) lrintf(raw[3]);
+	*out_swapAxes = swap;
+	return 1;
+}
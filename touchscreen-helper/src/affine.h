@@ -0,0 +1,204 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef AFFINE_H_
+#define AFFINE_H_
+
+#include <math.h>
+
+/* 2D affine transformations as 3x3 matrices in row-major order, the layout of the
+   "Coordinate Transformation Matrix" device property. Coordinates are relative, the
+   screen is the unit square. Everything is inline, so the compiler folds constant
+   arguments, and the helper and gtouchsett share the same math. */
+
+/* Same bits as the Rotation of RandR */
+#define AFFINE_ROTATE_0		1
+#define AFFINE_ROTATE_90	2
+#define AFFINE_ROTATE_180	4
+#define AFFINE_ROTATE_270	8
+#define AFFINE_REFLECT_X	16
+#define AFFINE_REFLECT_Y	32
+
+/* Four rotations times the four combinations of reflections; they result in 8 different transformations */
+#define AFFINE_ORIENTATIONS 16
+
+typedef struct _AffineMatrix {
+	float m[9];
+} AffineMatrix;
+
+static inline AffineMatrix affineMatrix(float a, float b, float c, float d, float e, float f) {
+	AffineMatrix r = { { a, b, c,
+	                     d, e, f,
+	                     0., 0., 1. } };
+	return r;
+}
+
+static inline AffineMatrix affineIdentity(void) {
+	return affineMatrix(1., 0., 0., 0., 1., 0.);
+}
+
+/* a * b, i.e. b is applied first */
+static inline AffineMatrix affineMultiply(AffineMatrix a, AffineMatrix b) {
+	AffineMatrix r;
+	int i, j;
+	for(i = 0; i < 3; i++) {
+		for(j = 0; j < 3; j++) {
+			r.m[i * 3 + j] = a.m[i * 3] * b.m[j] + a.m[i * 3 + 1] * b.m[3 + j] + a.m[i * 3 + 2] * b.m[6 + j];
+		}
+	}
+	return r;
+}
+
+static inline void affineApply(const AffineMatrix * a, float x, float y, float * outX, float * outY) {
+	*outX = a->m[0] * x + a->m[1] * y + a->m[2];
+	*outY = a->m[3] * x + a->m[4] * y + a->m[5];
+}
+
+/* Maps the unit square onto itself like the rotation and reflection of an output do */
+static inline AffineMatrix affineOrientation(int rotation) {
+	AffineMatrix r = affineIdentity();
+	if(rotation & AFFINE_ROTATE_180) {
+		r = affineMatrix(-1., 0., 1., 0., -1., 1.);
+	} else if(rotation & AFFINE_ROTATE_90) {
+		r = affineMatrix(0., -1., 1., 1., 0., 0.);
+	} else if(rotation & AFFINE_ROTATE_270) {
+		r = affineMatrix(0., 1., 0., -1., 0., 1.);
+	}
+
+	/* Reflections are applied after the rotation */
+	if(rotation & AFFINE_REFLECT_X) {
+		r = affineMultiply(affineMatrix(-1., 0., 1., 0., 1., 0.), r);
+	}
+	if(rotation & AFFINE_REFLECT_Y) {
+		r = affineMultiply(affineMatrix(1., 0., 0., 0., -1., 1.), r);
+	}
+	return r;
+}
+
+/* Index of the orientation in tables of AFFINE_ORIENTATIONS entries */
+static inline int affineOrientationIndex(int rotation) {
+	int index = 0;
+	if(rotation & AFFINE_ROTATE_180) {
+		index = 2;
+	} else if(rotation & AFFINE_ROTATE_90) {
+		index = 1;
+	} else if(rotation & AFFINE_ROTATE_270) {
+		index = 3;
+	}
+	if(rotation & AFFINE_REFLECT_X) index |= 4;
+	if(rotation & AFFINE_REFLECT_Y) index |= 8;
+	return index;
+}
+
+static inline int affineOrientationFromIndex(int index) {
+	int rotation = AFFINE_ROTATE_0 << (index & 3);
+	if(index & 4) rotation |= AFFINE_REFLECT_X;
+	if(index & 8) rotation |= AFFINE_REFLECT_Y;
+	return rotation;
+}
+
+/* Maps the unit square onto the rectangle at x, y of the given size */
+static inline AffineMatrix affinePlacement(float x, float y, float width, float height) {
+	return affineMatrix(width, 0., x, 0., height, y);
+}
+
+/* Maps device coordinates relative to the axis ranges onto the unit square, calibrated the
+   way the evdev driver applies "Evdev Axes Swap", "Evdev Axis Calibration" (calibMinX..calibMaxY,
+   in device units, must not be empty) and "Evdev Axis Inversion", in this order */
+static inline AffineMatrix affineAxisCalibration(float minX, float maxX, float minY, float maxY,
+		float calibMinX, float calibMaxX, float calibMinY, float calibMaxY, int axesSwap, int invertX, int invertY) {
+	AffineMatrix r = affineMatrix(maxX - minX, 0., minX, 0., maxY - minY, minY);
+	if(axesSwap) {
+		r = affineMultiply(affineMatrix(0., 1., 0., 1., 0., 0.), r);
+	}
+	r = affineMultiply(affineMatrix(1. / (calibMaxX - calibMinX), 0., -calibMinX / (calibMaxX - calibMinX),
+			0., 1. / (calibMaxY - calibMinY), -calibMinY / (calibMaxY - calibMinY)), r);
+	if(invertX) {
+		r = affineMultiply(affineMatrix(-1., 0., 1., 0., 1., 0.), r);
+	}
+	if(invertY) {
+		r = affineMultiply(affineMatrix(1., 0., 0., 0., -1., 1.), r);
+	}
+	return r;
+}
+
+/* Returns 0 if a can't be inverted; result is the identity then */
+static inline int affineInvert(AffineMatrix a, AffineMatrix * result) {
+	double det = (double) a.m[0] * a.m[4] - (double) a.m[1] * a.m[3];
+	if(det == 0.) {
+		*result = affineIdentity();
+		return 0;
+	}
+	double b0 = a.m[4] / det, b1 = -a.m[1] / det;
+	double b3 = -a.m[3] / det, b4 = a.m[0] / det;
+	*result = affineMatrix(b0, b1, -(b0 * a.m[2] + b1 * a.m[5]), b3, b4, -(b3 * a.m[2] + b4 * a.m[5]));
+	return 1;
+}
+
+/* Least squares fit of the matrix mapping the n points (fromX[i], fromY[i]) onto the points
+   (toX[i], toY[i]). Needs at least three points that aren't on a line, returns 0 otherwise.
+   If residuals isn't NULL, it receives the distance of each mapped point from its target.
+   The points are centered first, which decouples the translation from the linear part;
+   the remaining 2x2 normal equations are solved directly, so nothing is allocated. */
+static inline int affineSolve(const float * fromX, const float * fromY, const float * toX, const float * toY, int n,
+		AffineMatrix * result, float * residuals) {
+	if(n < 3) return 0;
+
+	double meanX = 0., meanY = 0., meanU = 0., meanV = 0.;
+	int i;
+	for(i = 0; i < n; i++) {
+		meanX += fromX[i];
+		meanY += fromY[i];
+		meanU += toX[i];
+		meanV += toY[i];
+	}
+	meanX /= n;
+	meanY /= n;
+	meanU /= n;
+	meanV /= n;
+
+	double sxx = 0., sxy = 0., syy = 0., sxu = 0., syu = 0., sxv = 0., syv = 0.;
+	for(i = 0; i < n; i++) {
+		double x = fromX[i] - meanX, y = fromY[i] - meanY;
+		double u = toX[i] - meanU, v = toY[i] - meanV;
+		sxx += x * x;
+		sxy += x * y;
+		syy += y * y;
+		sxu += x * u;
+		syu += y * u;
+		sxv += x * v;
+		syv += y * v;
+	}
+
+	/* Collinear points leave one direction undetermined */
+	double det = sxx * syy - sxy * sxy;
+	if(det <= 1e-9 * sxx * syy || det == 0.) return 0;
+
+	double a = (syy * sxu - sxy * syu) / det, b = (sxx * syu - sxy * sxu) / det;
+	double d = (syy * sxv - sxy * syv) / det, e = (sxx * syv - sxy * sxv) / det;
+	*result = affineMatrix(a, b, meanU - a * meanX - b * meanY, d, e, meanV - d * meanX - e * meanY);
+
+	if(residuals != NULL) {
+		for(i = 0; i < n; i++) {
+			float x, y;
+			affineApply(result, fromX[i], fromY[i], &x, &y);
+			residuals[i] = hypotf(x - toX[i], y - toY[i]);
+		}
+	}
+	return 1;
+}
+
+#endif /* AFFINE_H_ */
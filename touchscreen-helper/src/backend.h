@@ -0,0 +1,83 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BACKEND_H_
+#define BACKEND_H_
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include "outputs.h"
+
+/* All requests the helper makes to query the display and to calibrate devices go through a
+   backend, so the apply pipeline can run against the X server or an in-memory fake. */
+typedef struct _Backend Backend;
+
+/* Calibration properties a device may have, depending on its driver */
+#define DEVICE_CAP_MATRIX		(1 << 0)	/* Coordinate Transformation Matrix */
+#define DEVICE_CAP_EVDEV_CALIBRATION	(1 << 1)
+#define DEVICE_CAP_EVDEV_INVERSION	(1 << 2)
+#define DEVICE_CAP_EVDEV_SWAP		(1 << 3)
+#define DEVICE_CAP_LIBINPUT_MATRIX	(1 << 4)
+#define DEVICE_CAP_EVDEV		(DEVICE_CAP_EVDEV_CALIBRATION | DEVICE_CAP_EVDEV_INVERSION | DEVICE_CAP_EVDEV_SWAP)
+
+/* Values of the calibration properties of a device */
+typedef struct _CalibrationProperties {
+	float matrix[9];		/* Coordinate Transformation Matrix */
+	long calib[4];			/* Evdev Axis Calibration: min x, max x, min y, max y */
+	unsigned char flip[2];		/* Evdev Axis Inversion */
+	unsigned char axesSwap;		/* Evdev Axes Swap */
+	float libinputMatrix[9];	/* libinput Calibration Matrix */
+} CalibrationProperties;
+
+struct _Backend {
+	const char * name;
+	void * data;		/* State of the implementation */
+	unsigned long roundTrips;	/* Waits for replies so far; replies collected together count once */
+
+	/* Takes a snapshot of all outputs and CRTCs, see outputs.h */
+	void (*takeOutputSnapshot)(Backend *, OutputSnapshot *);
+	/* Like XIQueryDevice(); the result is released with freeDevices */
+	XIDeviceInfo * (*queryDevices)(Backend *, int, int *);
+	void (*freeDevices)(Backend *, XIDeviceInfo *);
+	/* Sets results[i] to the DEVICE_CAP_* flags of device deviceIDs[i], 0 if it doesn't exist.
+	   All n devices are queried with a single round trip. */
+	void (*probeCapabilities)(Backend *, const int *, int, int *);
+	/* Writes those calibration properties of the device that are given as DEVICE_CAP_* flags
+	   without waiting for a reply. Returns FALSE if the device is known not to exist. */
+	int (*writeCalibration)(Backend *, int, int, const CalibrationProperties *);
+	/* Serial of the next request, to recognize events caused by our own requests */
+	unsigned long (*nextRequest)(Backend *);
+	/* Sends a request without reply. Events carry the serial of the last request the server
+	   has processed, so events generated after it can't be mistaken for ones of the requests before. */
+	void (*fence)(Backend *);
+	/* Waits until all requests have been processed */
+	void (*sync)(Backend *);
+	void (*destroy)(Backend *);
+};
+
+/* The atom table of the display must live as long as the backend */
+Backend * createXlibBackend(Display *, Window, Atom *);
+
+/* The fake backend simulates a screen with outputs, CRTCs and input devices; it fills the atom table itself */
+Backend * createFakeBackend(int, int, Atom *);
+int fakeAddCrtc(Backend *, int, int, int, int, Rotation);
+void fakeSetCrtc(Backend *, int, int, int, int, int, Rotation);
+int fakeAddOutput(Backend *, const char *, int);
+int fakeAddDevice(Backend *, const char *, int, int, int, int, int);
+unsigned long fakeGetRequests(Backend *);
+void fakeResetRequests(Backend *);
+
+#endif /* BACKEND_H_ */
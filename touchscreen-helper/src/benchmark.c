@@ -0,0 +1,288 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "touchscreen-helper.h"
+#include "backend.h"
+#include "affine.h"
+#include "benchmark.h"
+
+/* The only screen of the simulated display */
+static HelperScreen * screen;
+static int hdmiCrtc;
+static int rotated = FALSE;
+static int firstDeviceID;
+
+static int compareTimes(const void * a, const void * b) {
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return (x > y) - (x < y);
+}
+
+/* Everything is probed and applied from scratch, as on startup */
+static void passDeviceScan() {
+	forgetAllDevices(screen);
+	handleDeviceChange(screen);
+}
+
+/* An output is rotated, only the devices on it need new properties */
+static void passRotation() {
+	rotated = !rotated;
+	if(rotated) {
+		fakeSetCrtc(screen->backend, hdmiCrtc, 1280, 0, 1080, 1920, RR_Rotate_90);
+		screen->screenHeight = 1920;
+	} else {
+		fakeSetCrtc(screen->backend, hdmiCrtc, 1280, 0, 1920, 1080, RR_Rotate_0);
+		screen->screenHeight = 1080;
+	}
+	screen->screenWidth = 1280 + (rotated ? 1080 : 1920);
+	handleDisplayChange(screen);
+}
+
+/* Nothing has changed, so nothing should be written */
+static void passUnchanged() {
+	handleDisplayChange(screen);
+}
+
+/* A single device is plugged in again */
+static void passHotplug() {
+	forgetDevice(screen, firstDeviceID);
+	detachDevice(screen, firstDeviceID);
+	handleDeviceAdded(screen, firstDeviceID);
+}
+
+static void measure(const char * name, void (*pass)(), int iterations) {
+	long long *times = malloc(iterations * sizeof(long long));
+	if(times == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	Backend * backend = screen->backend;
+	fakeResetRequests(backend);
+	backend->roundTrips = 0;
+	int i;
+	for(i = 0; i < iterations; i++) {
+		long long start = getMicroseconds();
+		pass();
+		times[i] = getMicroseconds() - start;
+	}
+	unsigned long roundTrips = backend->roundTrips;
+	unsigned long requests = fakeGetRequests(backend);
+
+	qsort(times, iterations, sizeof(long long), compareTimes);
+	printf("%-12s %7i passes  median %8lli us  p95 %8lli us  max %8lli us  %6.1f round trips  %6.1f requests\n",
+			name, iterations, times[iterations / 2], times[(iterations * 95) / 100], times[iterations - 1],
+			roundTrips / (double) iterations, requests / (double) iterations);
+	free(times);
+}
+
+static void printProfileName(FILE * stream, int i) {
+	fprintf(stream, "device=Benchmark Touchscreen %i", i);
+	if(i % 10 == 0) {
+		int c;
+		for(c = 0; c < 1000; c++) fputc('a' + c % 26, stream);
+	}
+	fprintf(stream, "\n");
+}
+
+/* Profile text like a settings file with many devices: half of them calibrated with a matrix,
+   every tenth with a long name. As a journal, the same records are changes; with deletes,
+   every odd record is followed by deleting the one before it. */
+static char * makeProfileText(int withDeletes, size_t * out_size) {
+	char * text = NULL;
+	size_t size = 0;
+	FILE * stream = open_memstream(&text, &size);
+	if(stream == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	int i;
+	for(i = 0; i < BENCHMARK_PROFILES; i++) {
+		fprintf(stream, "[profile]\n");
+		printProfileName(stream, i);
+		fprintf(stream, "output=%s\nminx=%i\nmaxx=%i\nminy=%i\nmaxy=%i\nswapaxes=%i\n",
+				(i % 3 ? "HDMI1" : "AUTO_FIRST_LVDS"), 100 + i, 3995 - i, 120 + i, 3975 - i, i % 2);
+		if(i % 2 == 0) {
+			fprintf(stream, "matrix=%.9g %.9g %.9g %.9g %.9g %.9g\n", 1.02f + i / 1e4f, -0.0031f, -0.012f, 0.0027f, 0.98f, 0.0095f + i / 1e5f);
+		}
+		fprintf(stream, "\n");
+		if(withDeletes && i % 2 == 1) {
+			fprintf(stream, "[delete]\n");
+			printProfileName(stream, i - 1);
+			fprintf(stream, "\n");
+		}
+	}
+	fclose(stream);
+	*out_size = size;
+	return text;
+}
+
+/* The parser works in place, so every pass parses a fresh copy; copying isn't timed */
+static void measureParser(const char * name, const char * text, size_t size, int isJournal, int expectedProfiles, int iterations) {
+	long long *times = malloc(iterations * sizeof(long long));
+	char * buffer = malloc(size + 1);
+	if(times == NULL || buffer == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	int i;
+	for(i = 0; i < iterations; i++) {
+		DeviceSettingsList list;
+		memset(&list, 0, sizeof list);
+		memcpy(buffer, text, size);
+		buffer[size] = 0;
+
+		long long start = getMicroseconds();
+		addDeviceSettingsFromBuffer("benchmark", buffer, size, &list, NULL, isJournal);
+		times[i] = getMicroseconds() - start;
+
+		/* Deleted profiles stay in the list without a name */
+		int p, profiles = 0;
+		for(p = 0; p < list.nDeviceSettings; p++) {
+			if(list.deviceSettings[p].inputDeviceName != NULL) profiles++;
+		}
+		if(profiles != expectedProfiles) {
+			fprintf(stderr, "Parsed %i profiles instead of %i.\n", profiles, expectedProfiles);
+			exit(1);
+		}
+		freeSettings(&list);
+	}
+
+	qsort(times, iterations, sizeof(long long), compareTimes);
+	long long median = times[iterations / 2];
+	printf("%-12s %7i passes  median %8lli us  p95 %8lli us  max %8lli us  %6.1f MB/s\n",
+			name, iterations, median, times[(iterations * 95) / 100], times[iterations - 1],
+			median > 0 ? size / (double) median : 0.);
+	free(buffer);
+	free(times);
+}
+
+/* Fits calibrations to a grid of taps like gtouchsett's. The solver works on the caller's arrays
+   only, so the time per fit is that of the arithmetic and grows linearly with the points. */
+static void measureSolver(int gridSize, int iterations) {
+	long long *times = malloc(iterations * sizeof(long long));
+	if(times == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	/* Taps slightly off the targets of a skewed, rotated device */
+	AffineMatrix device = affineMultiply(affineOrientation(AFFINE_ROTATE_90), affineMatrix(1.02, -0.0031, -0.012, 0.0027, 0.98, 0.0095));
+	AffineMatrix inverse;
+	affineInvert(device, &inverse);
+	int n = gridSize * gridSize;
+	float tapX[BENCHMARK_MAX_POINTS], tapY[BENCHMARK_MAX_POINTS], targetX[BENCHMARK_MAX_POINTS], targetY[BENCHMARK_MAX_POINTS];
+	float residuals[BENCHMARK_MAX_POINTS];
+	int i;
+	for(i = 0; i < n; i++) {
+		targetX[i] = (i % gridSize + .5f) / gridSize * 1920;
+		targetY[i] = (i / gridSize + .5f) / gridSize * 1080;
+		affineApply(&inverse, targetX[i] / 1920, targetY[i] / 1080, &tapX[i], &tapY[i]);
+		tapX[i] += (i % 3 - 1) * 0.002f;
+		tapY[i] += (i % 5 - 2) * 0.001f;
+	}
+
+	for(i = 0; i < iterations; i++) {
+		AffineMatrix result;
+		int s, solved = 1;
+		long long start = getMicroseconds();
+		for(s = 0; s < BENCHMARK_SOLVES; s++) {
+			solved &= affineSolve(tapX, tapY, targetX, targetY, n, &result, residuals);
+		}
+		times[i] = getMicroseconds() - start;
+		if(!solved) {
+			fprintf(stderr, "Solver rejected a grid of %i points.\n", n);
+			exit(1);
+		}
+	}
+
+	qsort(times, iterations, sizeof(long long), compareTimes);
+	char name[32];
+	snprintf(name, sizeof name, "%i points", n);
+	/* Microseconds per BENCHMARK_SOLVES fits are nanoseconds per fit */
+	printf("%-12s %7i passes  median %8lli ns  p95 %8lli ns  max %8lli ns  per fit\n",
+			name, iterations, times[iterations / 2] * 1000 / BENCHMARK_SOLVES,
+			times[(iterations * 95) / 100] * 1000 / BENCHMARK_SOLVES, times[iterations - 1] * 1000 / BENCHMARK_SOLVES);
+	free(times);
+}
+
+/* Runs the apply pipeline against the fake backend and prints timings and request counts per pass.
+   Latencies are simulated per round trip and per request, in microseconds. */
+int runBenchmark(int iterations, int roundTripLatency, int requestLatency) {
+	if(iterations < 1) iterations = 1;
+
+	HelperDisplay * hd = addDisplay(NULL, 1);
+	screen = &(hd->screens[0]);
+	screen->backend = createFakeBackend(roundTripLatency, requestLatency, hd->atoms);
+	Backend * backend = screen->backend;
+
+	/* Integrated panel left of a full HD monitor, plus two disconnected outputs */
+	int lvdsCrtc = fakeAddCrtc(backend, 0, 0, 1280, 800, RR_Rotate_0);
+	hdmiCrtc = fakeAddCrtc(backend, 1280, 0, 1920, 1080, RR_Rotate_0);
+	fakeAddCrtc(backend, 0, 0, 0, 0, RR_Rotate_0);
+	fakeAddOutput(backend, "LVDS1", lvdsCrtc);
+	fakeAddOutput(backend, "HDMI1", hdmiCrtc);
+	fakeAddOutput(backend, "VGA1", -1);
+	fakeAddOutput(backend, "DP1", -1);
+	screen->screenWidth = 1280 + 1920;
+	screen->screenHeight = 1080;
+
+	/* Half of the devices on each output; some with a transformation matrix, some automatically calibrated.
+	   Devices with a matrix are driven by evdev or libinput, the others by an old evdev. */
+	int i;
+	for(i = 0; i < BENCHMARK_DEVICES; i++) {
+		char name[64];
+		snprintf(name, sizeof name, "Benchmark Touchscreen %i", i);
+		int capabilities = (i % 2 ? DEVICE_CAP_EVDEV : DEVICE_CAP_MATRIX | (i % 4 == 0 ? DEVICE_CAP_EVDEV : DEVICE_CAP_LIBINPUT_MATRIX));
+		int id = fakeAddDevice(backend, name, 0, 4095, 0, 4095, capabilities);
+		if(i == 0) firstDeviceID = id;
+		addDeviceSettings(&(screen->profiles), strdup(name), (i % 2 ? strdup("HDMI1") : NULL), (i % 2 == 0), (i % 4 == 0),
+				100, 3995, 120, 3975, (i % 3 == 0), NULL);
+	}
+
+	printf("Benchmark with %i devices, %i us per round trip, %i us per request\n", BENCHMARK_DEVICES, roundTripLatency, requestLatency);
+	handleDeviceChange(screen);
+
+	measure("device scan", passDeviceScan, iterations);
+	measure("rotation", passRotation, iterations);
+	measure("unchanged", passUnchanged, iterations);
+	measure("hotplug", passHotplug, iterations);
+
+	size_t size;
+	char * text = makeProfileText(0, &size);
+	printf("Parser with %i profiles, %zu bytes\n", BENCHMARK_PROFILES, size);
+	measureParser("profiles", text, size, 0, BENCHMARK_PROFILES, iterations);
+	measureParser("journal", text, size, 1, BENCHMARK_PROFILES, iterations);
+	free(text);
+	text = makeProfileText(1, &size);
+	printf("Journal with %i changes and %i deletes, %zu bytes\n", BENCHMARK_PROFILES, BENCHMARK_PROFILES / 2, size);
+	measureParser("deletes", text, size, 1, BENCHMARK_PROFILES / 2, iterations);
+	free(text);
+
+	printf("Calibration solver, %i fits per pass\n", BENCHMARK_SOLVES);
+	int gridSize;
+	for(gridSize = 2; gridSize * gridSize <= BENCHMARK_MAX_POINTS; gridSize++) {
+		measureSolver(gridSize, iterations);
+	}
+
+	removeDisplay(hd, FALSE);
+	screen = NULL;
+	return 0;
+}
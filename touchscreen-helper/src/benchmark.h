@@ -0,0 +1,31 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+/* Simulated input devices, one profile each */
+#define BENCHMARK_DEVICES 8
+/* Profiles in the text the parser benchmark parses */
+#define BENCHMARK_PROFILES 1000
+/* Calibrations the solver benchmark fits per pass, and their largest number of points */
+#define BENCHMARK_SOLVES 1000
+#define BENCHMARK_MAX_POINTS 25
+#define DEFAULT_BENCHMARK_ITERATIONS 1000
+
+int runBenchmark(int, int, int);
+
+#endif /* BENCHMARK_H_ */
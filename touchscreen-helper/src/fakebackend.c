@@ -0,0 +1,335 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "backend.h"
+#include "atoms.h"
+
+#define FAKE_MAX_CRTCS 16
+#define FAKE_MAX_OUTPUTS 16
+#define FAKE_MAX_DEVICES 64
+/* IDs as on a real server: 2 and 3 are the master devices */
+#define FAKE_FIRST_DEVICE_ID 6
+#define FAKE_FIRST_XID 0x40
+
+typedef struct _FakeOutput {
+	char * name;
+	RROutput id;
+	int crtc;	/* Index into crtcs, -1 if the output is not active */
+} FakeOutput;
+
+typedef struct _FakeDevice {
+	char * name;
+	int minX;
+	int maxX;
+	int minY;
+	int maxY;
+	int capabilities;	/* DEVICE_CAP_* flags */
+} FakeDevice;
+
+typedef struct _FakeBackendData {
+	CrtcState crtcs[FAKE_MAX_CRTCS];
+	int nCrtcs;
+	FakeOutput outputs[FAKE_MAX_OUTPUTS];
+	int nOutputs;
+	FakeDevice devices[FAKE_MAX_DEVICES];
+	int nDevices;
+	/* Simulated costs in microseconds: a round trip waits for the reply and
+	   for all requests queued before it */
+	int roundTripLatency;
+	int requestLatency;
+	unsigned long serial;
+	unsigned long queuedRequests;
+	unsigned long requests;
+	Atom * atoms;		/* Filled by createFakeBackend() */
+} FakeBackendData;
+
+static void waitMicroseconds(long us) {
+	if(us <= 0) return;
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while(nanosleep(&ts, &ts) != 0);
+}
+
+static void queueRequests(FakeBackendData * data, int n) {
+	data->serial += n;
+	data->requests += n;
+	data->queuedRequests += n;
+}
+
+static void roundTrip(Backend * backend) {
+	FakeBackendData *data = backend->data;
+	queueRequests(data, 1);
+	backend->roundTrips++;
+	waitMicroseconds(data->roundTripLatency + (long) data->queuedRequests * data->requestLatency);
+	data->queuedRequests = 0;
+}
+
+static void fakeTakeOutputSnapshot(Backend * backend, OutputSnapshot * snapshot) {
+	FakeBackendData *data = backend->data;
+
+	/* Same requests as takeOutputSnapshot(): the resources, then all CRTCs and outputs together */
+	roundTrip(backend);
+	if(data->nCrtcs + data->nOutputs > 0) {
+		queueRequests(data, data->nCrtcs + data->nOutputs - 1);
+		roundTrip(backend);
+	}
+	snapshot->crtcs = malloc(sizeof(CrtcState) * (data->nCrtcs > 0 ? data->nCrtcs : 1));
+	snapshot->outputs = malloc(sizeof(OutputState) * (data->nOutputs > 0 ? data->nOutputs : 1));
+	if(snapshot->crtcs == NULL || snapshot->outputs == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	int c;
+	for(c = 0; c < data->nCrtcs; c++) {
+		snapshot->crtcs[c] = data->crtcs[c];
+	}
+	snapshot->nCrtcs = data->nCrtcs;
+
+	int o;
+	for(o = 0; o < data->nOutputs; o++) {
+		OutputState *output = &(snapshot->outputs[o]);
+		output->name = strdup(data->outputs[o].name);
+		output->id = data->outputs[o].id;
+		output->crtc = data->outputs[o].crtc;
+		output->order = o;
+		output->changed = 0;
+	}
+	snapshot->nOutputs = data->nOutputs;
+
+	finishOutputSnapshot(snapshot);
+}
+
+/* Device info is allocated in one block like XIQueryDevice() does, terminated by an
+   entry with deviceid -1 */
+static XIDeviceInfo * fakeQueryDevices(Backend * backend, int deviceID, int * n) {
+	FakeBackendData *data = backend->data;
+	roundTrip(backend);
+
+	int first = 0, last = data->nDevices - 1, masters = 0;
+	if(deviceID == XIAllDevices || deviceID == XIAllMasterDevices) {
+		masters = 2;
+		if(deviceID == XIAllMasterDevices) last = -1;
+	} else {
+		first = last = deviceID - FAKE_FIRST_DEVICE_ID;
+		if(first < 0 || first >= data->nDevices) {
+			*n = 0;
+			return NULL;
+		}
+	}
+	int count = masters + (last - first + 1);
+
+	size_t size = (count + 1) * sizeof(XIDeviceInfo)
+			+ (last - first + 1) * (2 * sizeof(XIAnyClassInfo *) + 2 * sizeof(XIValuatorClassInfo));
+	XIDeviceInfo *info = calloc(1, size);
+	if(info == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	XIAnyClassInfo **classes = (XIAnyClassInfo **) &(info[count + 1]);
+	XIValuatorClassInfo *valuators = (XIValuatorClassInfo *) &(classes[2 * (last - first + 1)]);
+
+	int i = 0, d;
+	for(i = 0; i < masters; i++) {
+		info[i].deviceid = 2 + i;
+		info[i].name = (i == 0 ? "Virtual core pointer" : "Virtual core keyboard");
+		info[i].use = (i == 0 ? XIMasterPointer : XIMasterKeyboard);
+		info[i].attachment = 3 - i;
+		info[i].enabled = True;
+	}
+	for(d = first; d <= last; d++, i++) {
+		FakeDevice *device = &(data->devices[d]);
+		info[i].deviceid = FAKE_FIRST_DEVICE_ID + d;
+		info[i].name = device->name;
+		info[i].use = XISlavePointer;
+		info[i].attachment = 2;
+		info[i].enabled = True;
+		info[i].num_classes = 2;
+		info[i].classes = classes;
+
+		int axis;
+		for(axis = 0; axis < 2; axis++) {
+			valuators->type = XIValuatorClass;
+			valuators->sourceid = info[i].deviceid;
+			valuators->number = axis;
+			valuators->label = data->atoms[axis == 0 ? ATOM_ABS_X : ATOM_ABS_Y];
+			valuators->min = (axis == 0 ? device->minX : device->minY);
+			valuators->max = (axis == 0 ? device->maxX : device->maxY);
+			valuators->mode = XIModeAbsolute;
+			*(classes++) = (XIAnyClassInfo *) (valuators++);
+		}
+	}
+	info[count].deviceid = -1;
+
+	*n = count;
+	return info;
+}
+
+static void fakeFreeDevices(Backend * backend, XIDeviceInfo * info) {
+	free(info);
+}
+
+static void fakeProbeCapabilities(Backend * backend, const int * deviceIDs, int n, int * results) {
+	FakeBackendData *data = backend->data;
+	if(n == 0) return;
+	/* One request per device, the last one is waited for */
+	queueRequests(data, n - 1);
+	roundTrip(backend);
+	int i;
+	for(i = 0; i < n; i++) {
+		int d = deviceIDs[i] - FAKE_FIRST_DEVICE_ID;
+		results[i] = (d >= 0 && d < data->nDevices ? data->devices[d].capabilities : 0);
+	}
+}
+
+static int fakeWriteCalibration(Backend * backend, int deviceID, int properties, const CalibrationProperties * values) {
+	FakeBackendData *data = backend->data;
+
+	int d = deviceID - FAKE_FIRST_DEVICE_ID;
+	if(d < 0 || d >= data->nDevices) {
+		return 0;
+	}
+
+	/* One request per property, none of them waits for a reply */
+	int p, count = 0;
+	for(p = properties; p != 0; p &= p - 1) {
+		count++;
+	}
+	queueRequests(data, count);
+	return 1;
+}
+
+static unsigned long fakeNextRequest(Backend * backend) {
+	return ((FakeBackendData *) backend->data)->serial + 1;
+}
+
+static void fakeFence(Backend * backend) {
+	queueRequests(backend->data, 1);
+}
+
+static void fakeSync(Backend * backend) {
+	roundTrip(backend);
+}
+
+static void fakeDestroy(Backend * backend) {
+	FakeBackendData *data = backend->data;
+	int i;
+	for(i = 0; i < data->nOutputs; i++) {
+		free(data->outputs[i].name);
+	}
+	for(i = 0; i < data->nDevices; i++) {
+		free(data->devices[i].name);
+	}
+	free(data);
+	free(backend);
+}
+
+/* Latencies are given in microseconds */
+Backend * createFakeBackend(int roundTripLatency, int requestLatency, Atom * atoms) {
+	Backend *backend = malloc(sizeof(Backend));
+	FakeBackendData *data = calloc(1, sizeof(FakeBackendData));
+	if(backend == NULL || data == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	data->roundTripLatency = roundTripLatency;
+	data->requestLatency = requestLatency;
+	data->atoms = atoms;
+
+	/* Without a server, atoms only need to be distinct */
+	int a;
+	for(a = 0; a < ATOM_COUNT; a++) {
+		atoms[a] = a + 1;
+	}
+
+	backend->name = "fake";
+	backend->data = data;
+	backend->roundTrips = 0;
+	backend->takeOutputSnapshot = fakeTakeOutputSnapshot;
+	backend->queryDevices = fakeQueryDevices;
+	backend->freeDevices = fakeFreeDevices;
+	backend->probeCapabilities = fakeProbeCapabilities;
+	backend->writeCalibration = fakeWriteCalibration;
+	backend->nextRequest = fakeNextRequest;
+	backend->fence = fakeFence;
+	backend->sync = fakeSync;
+	backend->destroy = fakeDestroy;
+	return backend;
+}
+
+/* Returns the index of the new CRTC, -1 if there are too many */
+int fakeAddCrtc(Backend * backend, int x, int y, int width, int height, Rotation rotation) {
+	FakeBackendData *data = backend->data;
+	if(data->nCrtcs == FAKE_MAX_CRTCS) return -1;
+	CrtcState *crtc = &(data->crtcs[data->nCrtcs]);
+	crtc->id = FAKE_FIRST_XID + data->nCrtcs;
+	crtc->x = x;
+	crtc->y = y;
+	crtc->width = width;
+	crtc->height = height;
+	crtc->rotation = rotation;
+	return data->nCrtcs++;
+}
+
+void fakeSetCrtc(Backend * backend, int c, int x, int y, int width, int height, Rotation rotation) {
+	FakeBackendData *data = backend->data;
+	if(c < 0 || c >= data->nCrtcs) return;
+	data->crtcs[c].x = x;
+	data->crtcs[c].y = y;
+	data->crtcs[c].width = width;
+	data->crtcs[c].height = height;
+	data->crtcs[c].rotation = rotation;
+}
+
+/* Adds an output shown on CRTC c (-1 for an inactive output). Returns its index or -1. */
+int fakeAddOutput(Backend * backend, const char * name, int c) {
+	FakeBackendData *data = backend->data;
+	if(data->nOutputs == FAKE_MAX_OUTPUTS) return -1;
+	FakeOutput *output = &(data->outputs[data->nOutputs]);
+	output->name = strdup(name);
+	output->id = FAKE_FIRST_XID + FAKE_MAX_CRTCS + data->nOutputs;
+	output->crtc = (c >= 0 && c < data->nCrtcs ? c : -1);
+	return data->nOutputs++;
+}
+
+/* Adds an absolute input device with the given axis ranges and DEVICE_CAP_* flags.
+   Returns its device ID or -1. */
+int fakeAddDevice(Backend * backend, const char * name, int minX, int maxX, int minY, int maxY, int capabilities) {
+	FakeBackendData *data = backend->data;
+	if(data->nDevices == FAKE_MAX_DEVICES) return -1;
+	FakeDevice *device = &(data->devices[data->nDevices]);
+	device->name = strdup(name);
+	device->minX = minX;
+	device->maxX = maxX;
+	device->minY = minY;
+	device->maxY = maxY;
+	device->capabilities = capabilities;
+	return FAKE_FIRST_DEVICE_ID + data->nDevices++;
+}
+
+unsigned long fakeGetRequests(Backend * backend) {
+	return ((FakeBackendData *) backend->data)->requests;
+}
+
+void fakeResetRequests(Backend * backend) {
+	((FakeBackendData *) backend->data)->requests = 0;
+}
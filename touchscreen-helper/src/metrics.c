@@ -0,0 +1,78 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "metrics.h"
+
+HelperMetrics metrics;
+
+/* Cheap enough to be always on: a few additions and a bit scan */
+void recordValue(Histogram * histogram, uint64_t value) {
+	int bucket = (value == 0 ? 0 : 64 - __builtin_clzll(value));
+	if(bucket >= HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS - 1;
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum += value;
+	if(value > histogram->max) histogram->max = value;
+}
+
+/* Returns an upper bound of the given percentile, exact to the bucket */
+uint64_t getPercentile(Histogram * histogram, int percent) {
+	if(histogram->count == 0) return 0;
+	uint64_t rank = (histogram->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	int b;
+	for(b = 0; b < HISTOGRAM_BUCKETS - 1; b++) {
+		seen += histogram->buckets[b];
+		if(seen >= rank) {
+			uint64_t upper = (b == 0 ? 0 : (1ULL << b) - 1);
+			return (upper < histogram->max ? upper : histogram->max);
+		}
+	}
+	return histogram->max;
+}
+
+static void printHistogram(FILE * file, const char * name, Histogram * histogram) {
+	if(histogram->count == 0) {
+		fprintf(file, "%-16s no samples\n", name);
+		return;
+	}
+	fprintf(file, "%-16s %8llu samples  mean %8llu  p50 <= %8llu  p95 <= %8llu  p99 <= %8llu  max %8llu\n",
+			name, (unsigned long long) histogram->count,
+			(unsigned long long) (histogram->sum / histogram->count),
+			(unsigned long long) getPercentile(histogram, 50),
+			(unsigned long long) getPercentile(histogram, 95),
+			(unsigned long long) getPercentile(histogram, 99),
+			(unsigned long long) histogram->max);
+}
+
+void printMetrics(FILE * file, HelperMetrics * m) {
+	fprintf(file, "Uptime: %lli s\n", (long long) (m->uptime / 1000000));
+	fprintf(file, "Events: %llu RandR, %llu hierarchy, %llu property\n",
+			(unsigned long long) m->randrEvents, (unsigned long long) m->hierarchyEvents, (unsigned long long) m->propertyEvents);
+	fprintf(file, "Control requests: %llu\n", (unsigned long long) m->controlRequests);
+	fprintf(file, "Reloads: %llu complete, %llu single profile\n",
+			(unsigned long long) m->reloads, (unsigned long long) m->profileReloads);
+	fprintf(file, "Devices matched: %llu\n", (unsigned long long) m->devicesMatched);
+	fprintf(file, "Apply passes: %llu; devices written: %llu, up to date: %llu, failed: %llu\n",
+			(unsigned long long) m->applyPasses, (unsigned long long) m->propertyWrites,
+			(unsigned long long) m->writesSkipped, (unsigned long long) m->applyFailures);
+	printHistogram(file, "Display (us)", &(m->displayLatency));
+	printHistogram(file, "Hotplug (us)", &(m->hotplugLatency));
+	printHistogram(file, "Pass (us)", &(m->passTime));
+	printHistogram(file, "Round trips", &(m->passRoundTrips));
+	printHistogram(file, "Reload (us)", &(m->reloadTime));
+}
@@ -0,0 +1,238 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* strndup() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/randr.h>
+#include "outputs.h"
+
+static int compareOutputNames(const void * a, const void * b) {
+	return strcmp(((const OutputState *) a)->name, ((const OutputState *) b)->name);
+}
+
+/* Returns the index of the CRTC in the snapshot, -1 if crtc is None or unknown */
+static int findCrtcIndex(OutputSnapshot * snapshot, RRCrtc crtc) {
+	int c;
+	for(c = 0; c < snapshot->nCrtcs && crtc != 0; c++) {
+		if(snapshot->crtcs[c].id == crtc) return c;
+	}
+	return -1;
+}
+
+static int isLVDS(const char * name) {
+	return strstr(name, "LVDS") != NULL || strstr(name, "lvds") != NULL;
+}
+
+/* The requests for all CRTCs and outputs are sent at once and their replies collected
+   afterwards, so a snapshot takes two round trips however many outputs there are */
+void takeOutputSnapshot(Display * display, Window root, OutputSnapshot * snapshot) {
+	xcb_connection_t *conn = XGetXCBConnection(display);
+	xcb_randr_get_screen_resources_current_reply_t *res = xcb_randr_get_screen_resources_current_reply(conn,
+			xcb_randr_get_screen_resources_current(conn, root), NULL);
+
+	int ncrtc = 0, noutput = 0;
+	xcb_randr_crtc_t *crtcs = NULL;
+	xcb_randr_output_t *outputs = NULL;
+	xcb_timestamp_t timestamp = XCB_CURRENT_TIME;
+	if(res != NULL) {
+		ncrtc = xcb_randr_get_screen_resources_current_crtcs_length(res);
+		crtcs = xcb_randr_get_screen_resources_current_crtcs(res);
+		noutput = xcb_randr_get_screen_resources_current_outputs_length(res);
+		outputs = xcb_randr_get_screen_resources_current_outputs(res);
+		timestamp = res->config_timestamp;
+	}
+
+	snapshot->nCrtcs = 0;
+	snapshot->nOutputs = 0;
+	snapshot->lvdsOutput = -1;
+	snapshot->crtcs = malloc(sizeof(CrtcState) * (ncrtc > 0 ? ncrtc : 1));
+	snapshot->outputs = malloc(sizeof(OutputState) * (noutput > 0 ? noutput : 1));
+	xcb_randr_get_crtc_info_cookie_t *crtcCookies = malloc(sizeof(xcb_randr_get_crtc_info_cookie_t) * (ncrtc > 0 ? ncrtc : 1));
+	xcb_randr_get_output_info_cookie_t *outputCookies = malloc(sizeof(xcb_randr_get_output_info_cookie_t) * (noutput > 0 ? noutput : 1));
+	if(snapshot->crtcs == NULL || snapshot->outputs == NULL || crtcCookies == NULL || outputCookies == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	int c, o;
+	for(c = 0; c < ncrtc; c++) {
+		crtcCookies[c] = xcb_randr_get_crtc_info(conn, crtcs[c], timestamp);
+	}
+	for(o = 0; o < noutput; o++) {
+		outputCookies[o] = xcb_randr_get_output_info(conn, outputs[o], timestamp);
+	}
+
+	for(c = 0; c < ncrtc; c++) {
+		xcb_randr_get_crtc_info_reply_t *crtcInf = xcb_randr_get_crtc_info_reply(conn, crtcCookies[c], NULL);
+		CrtcState *crtc = &(snapshot->crtcs[c]);
+		crtc->id = crtcs[c];
+		if(crtcInf) {
+			crtc->x = crtcInf->x;
+			crtc->y = crtcInf->y;
+			crtc->width = crtcInf->width;
+			crtc->height = crtcInf->height;
+			crtc->rotation = crtcInf->rotation;
+			free(crtcInf);
+		} else {
+			crtc->x = crtc->y = crtc->width = crtc->height = 0;
+			crtc->rotation = RR_Rotate_0;
+		}
+	}
+	snapshot->nCrtcs = ncrtc;
+
+	for(o = 0; o < noutput; o++) {
+		xcb_randr_get_output_info_reply_t *outpInf = xcb_randr_get_output_info_reply(conn, outputCookies[o], NULL);
+		if(!outpInf) continue;
+		OutputState *output = &(snapshot->outputs[snapshot->nOutputs]);
+		output->name = strndup((char *) xcb_randr_get_output_info_name(outpInf), xcb_randr_get_output_info_name_length(outpInf));
+		output->id = outputs[o];
+		output->order = o;
+		output->changed = 0;
+		output->crtc = findCrtcIndex(snapshot, outpInf->crtc);
+		free(outpInf);
+		snapshot->nOutputs++;
+	}
+	free(crtcCookies);
+	free(outputCookies);
+	free(res);
+
+	finishOutputSnapshot(snapshot);
+}
+
+/* Sorts the outputs by name and finds the automatic output */
+void finishOutputSnapshot(OutputSnapshot * snapshot) {
+	int o;
+	qsort(snapshot->outputs, snapshot->nOutputs, sizeof(OutputState), compareOutputNames);
+
+	/* The automatic output is the first LVDS output in the order of the screen resources */
+	snapshot->lvdsOutput = -1;
+	for(o = 0; o < snapshot->nOutputs; o++) {
+		if(isLVDS(snapshot->outputs[o].name) && (snapshot->lvdsOutput == -1
+				|| snapshot->outputs[o].order < snapshot->outputs[snapshot->lvdsOutput].order)) {
+			snapshot->lvdsOutput = o;
+		}
+	}
+}
+
+void freeOutputSnapshot(OutputSnapshot * snapshot) {
+	int o;
+	for(o = 0; o < snapshot->nOutputs; o++) {
+		free(snapshot->outputs[o].name);
+	}
+	free(snapshot->outputs);
+	free(snapshot->crtcs);
+	snapshot->outputs = NULL;
+	snapshot->crtcs = NULL;
+	snapshot->nOutputs = 0;
+	snapshot->nCrtcs = 0;
+	snapshot->lvdsOutput = -1;
+}
+
+OutputState * findOutput(OutputSnapshot * snapshot, const char * name) {
+	OutputState key;
+	key.name = (char *) name;
+	return bsearch(&key, snapshot->outputs, snapshot->nOutputs, sizeof(OutputState), compareOutputNames);
+}
+
+/* Returns the CRTC the output is shown on, or NULL if the output is not active */
+CrtcState * getOutputCrtc(OutputSnapshot * snapshot, OutputState * output) {
+	if(output == NULL || output->crtc == -1) return NULL;
+	return &(snapshot->crtcs[output->crtc]);
+}
+
+/* FNV-1a over everything that influences the calibration of the devices */
+static unsigned long hashValue(unsigned long hash, unsigned long value) {
+	int i;
+	for(i = 0; i < (int) sizeof value; i++) {
+		hash ^= (value >> (i * 8)) & 0xff;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+unsigned long getLayoutFingerprint(OutputSnapshot * snapshot, int screenWidth, int screenHeight) {
+	unsigned long hash = 2166136261UL;
+	hash = hashValue(hash, screenWidth);
+	hash = hashValue(hash, screenHeight);
+
+	int i;
+	for(i = 0; i < snapshot->nCrtcs; i++) {
+		hash = hashValue(hash, snapshot->crtcs[i].id);
+		hash = hashValue(hash, snapshot->crtcs[i].x);
+		hash = hashValue(hash, snapshot->crtcs[i].y);
+		hash = hashValue(hash, snapshot->crtcs[i].width);
+		hash = hashValue(hash, snapshot->crtcs[i].height);
+		hash = hashValue(hash, snapshot->crtcs[i].rotation);
+	}
+	for(i = 0; i < snapshot->nOutputs; i++) {
+		hash = hashValue(hash, snapshot->outputs[i].id);
+		hash = hashValue(hash, snapshot->outputs[i].crtc);
+	}
+	return hash;
+}
+
+/* Applies the contents of a CRTC change event to the snapshot and marks the outputs
+   shown on that CRTC as changed. Returns 0 if the CRTC is unknown and a new snapshot is needed. */
+int updateSnapshotCrtc(OutputSnapshot * snapshot, XRRCrtcChangeNotifyEvent * evt) {
+	int c = findCrtcIndex(snapshot, evt->crtc);
+	if(c == -1) return 0;
+
+	CrtcState *crtc = &(snapshot->crtcs[c]);
+	if(evt->mode == None) {
+		crtc->x = crtc->y = crtc->width = crtc->height = 0;
+	} else {
+		crtc->x = evt->x;
+		crtc->y = evt->y;
+		crtc->width = evt->width;
+		crtc->height = evt->height;
+	}
+	crtc->rotation = evt->rotation;
+
+	int o;
+	for(o = 0; o < snapshot->nOutputs; o++) {
+		if(snapshot->outputs[o].crtc == c) snapshot->outputs[o].changed = 1;
+	}
+	return 1;
+}
+
+/* Applies the contents of an output change event to the snapshot and marks the output
+   as changed. Returns 0 if the output or its CRTC is unknown and a new snapshot is needed. */
+int updateSnapshotOutput(OutputSnapshot * snapshot, XRROutputChangeNotifyEvent * evt) {
+	int o;
+	for(o = 0; o < snapshot->nOutputs; o++) {
+		if(snapshot->outputs[o].id == evt->output) {
+			int c = findCrtcIndex(snapshot, evt->crtc);
+			if(evt->crtc != None && c == -1) return 0;
+			snapshot->outputs[o].crtc = c;
+			snapshot->outputs[o].changed = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void clearOutputChanges(OutputSnapshot * snapshot) {
+	int o;
+	for(o = 0; o < snapshot->nOutputs; o++) {
+		snapshot->outputs[o].changed = 0;
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef OUTPUTS_H_
+#define OUTPUTS_H_
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+typedef struct _CrtcState {
+	RRCrtc id;
+	int x;
+	int y;
+	int width;
+	int height;
+	Rotation rotation;
+} CrtcState;
+
+typedef struct _OutputState {
+	char * name;
+	RROutput id;
+	int crtc;	/* Index into OutputSnapshot.crtcs, -1 if the output is not active */
+	int order;	/* Position in the screen resources */
+	int changed;	/* Set by RRNotify events since the last apply pass */
+} OutputState;
+
+/* State of all outputs and CRTCs of a screen, taken once per display change */
+typedef struct _OutputSnapshot {
+	CrtcState * crtcs;
+	int nCrtcs;
+	OutputState * outputs;	/* Sorted by name */
+	int nOutputs;
+	int lvdsOutput;		/* Index of the first LVDS output, -1 if there is none */
+} OutputSnapshot;
+
+void takeOutputSnapshot(Display *, Window, OutputSnapshot *);
+void finishOutputSnapshot(OutputSnapshot *);
+void freeOutputSnapshot(OutputSnapshot *);
+OutputState * findOutput(OutputSnapshot *, const char *);
+CrtcState * getOutputCrtc(OutputSnapshot *, OutputState *);
+unsigned long getLayoutFingerprint(OutputSnapshot *, int, int);
+int updateSnapshotCrtc(OutputSnapshot *, XRRCrtcChangeNotifyEvent *);
+int updateSnapshotOutput(OutputSnapshot *, XRROutputChangeNotifyEvent *);
+void clearOutputChanges(OutputSnapshot *);
+
+#endif /* OUTPUTS_H_ */
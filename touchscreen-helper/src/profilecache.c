@@ -0,0 +1,324 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "profilecache.h"
+
+char* cacheFileName = NULL;
+
+char* getCacheFileName() {
+	if(cacheFileName == NULL) {
+		char * privateFile = getPrivateFileName();
+		cacheFileName = malloc((strlen(privateFile) + strlen(CACHE_FILE_SUFFIX) + 1)*sizeof(char));
+		strcpy(cacheFileName, privateFile);
+		strcat(cacheFileName, CACHE_FILE_SUFFIX);
+	}
+	return cacheFileName;
+}
+
+char* sourceFileNames[CACHE_SOURCES] = { NULL, NULL, NULL, NULL };
+
+static char* getSourceFileName(int source) {
+	if(sourceFileNames[source] == NULL) {
+		char * fileName = (source < 2 ? getPrivateFileName() : getGlobalFileName());
+		if(source % 2 == 0) {
+			sourceFileNames[source] = fileName;
+		} else {
+			sourceFileNames[source] = malloc((strlen(fileName) + strlen(JOURNAL_FILE_SUFFIX) + 1)*sizeof(char));
+			strcpy(sourceFileNames[source], fileName);
+			strcat(sourceFileNames[source], JOURNAL_FILE_SUFFIX);
+		}
+	}
+	return sourceFileNames[source];
+}
+
+static uint32_t hashBytes(uint32_t hash, const char * data, size_t length) {
+	size_t i;
+	for(i = 0; i < length; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static uint32_t hashString(const char * str) {
+	return hashBytes(2166136261U, str, strlen(str));
+}
+
+static uint32_t hashFileContent(const char * fileName) {
+	uint32_t hash = 2166136261U;
+	FILE * fileDesc = fopen(fileName, "r");
+	if(!fileDesc) {
+		return hash;
+	}
+	char buffer[4096];
+	size_t n;
+	while((n = fread(buffer, 1, sizeof buffer, fileDesc)) > 0) {
+		hash = hashBytes(hash, buffer, n);
+	}
+	fclose(fileDesc);
+	return hash;
+}
+
+static void getStamp(const char * fileName, CacheSourceStamp * stamp) {
+	struct stat st;
+	memset(stamp, 0, sizeof(CacheSourceStamp));
+	if(stat(fileName, &st) != 0) {
+		return;
+	}
+	stamp->exists = 1;
+	stamp->size = st.st_size;
+	stamp->mtimeSec = st.st_mtim.tv_sec;
+	stamp->mtimeNsec = st.st_mtim.tv_nsec;
+	stamp->inode = st.st_ino;
+}
+
+/* Stamps of the source files; to be taken before the files are parsed */
+void getCacheSourceStamps(CacheSourceStamp * stamps) {
+	int s;
+	for(s = 0; s < CACHE_SOURCES; s++) {
+		getStamp(getSourceFileName(s), &(stamps[s]));
+		if(stamps[s].exists) {
+			stamps[s].contentHash = hashFileContent(getSourceFileName(s));
+		}
+	}
+}
+
+/* Stamps of the source files without the content hash, which would mean reading them */
+void getCacheSourceStats(CacheSourceStamp * stamps) {
+	int s;
+	for(s = 0; s < CACHE_SOURCES; s++) {
+		getStamp(getSourceFileName(s), &(stamps[s]));
+	}
+}
+
+/* Whether the stats of the source files are the same; content hashes aren't compared */
+int sameCacheSourceStats(CacheSourceStamp * a, CacheSourceStamp * b) {
+	int s;
+	for(s = 0; s < CACHE_SOURCES; s++) {
+		if(a[s].exists != b[s].exists || a[s].size != b[s].size || a[s].mtimeSec != b[s].mtimeSec
+				|| a[s].mtimeNsec != b[s].mtimeNsec || a[s].inode != b[s].inode) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Checks if the source files are still the ones the cache has been compiled from. */
+static int isCacheUpToDate(CacheHeader * header) {
+	int s;
+	for(s = 0; s < CACHE_SOURCES; s++) {
+		CacheSourceStamp current;
+		CacheSourceStamp * cached = &(header->sources[s]);
+		getStamp(getSourceFileName(s), &current);
+		if(current.exists != cached->exists) return 0;
+		if(!current.exists) continue;
+		if(current.size != cached->size || current.mtimeSec != cached->mtimeSec
+				|| current.mtimeNsec != cached->mtimeNsec || current.inode != cached->inode) {
+			return 0;
+		}
+		/* The file might have been changed again within the timestamp granularity
+		   right after the cache was built, so only trust its content in that case */
+		if(current.mtimeSec >= header->buildTime - 1
+				&& hashFileContent(getSourceFileName(s)) != cached->contentHash) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static char * getPoolString(const char * pool, uint32_t poolSize, int32_t offset) {
+	if(offset < 0 || (uint32_t) offset >= poolSize) return NULL;
+	if(memchr(pool + offset, 0, poolSize - offset) == NULL) return NULL;
+	char * result = strdup(pool + offset);
+	if(result == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return result;
+}
+
+static void addCachedProfile(DeviceSettingsList * list, CachedProfile * profile, const char * pool, uint32_t poolSize) {
+	addDeviceSettings(list, getPoolString(pool, poolSize, profile->inputDeviceName),
+		getPoolString(pool, poolSize, profile->attachedOutput), profile->autoOutput, profile->autoCalibration,
+		profile->outputMinX, profile->outputMaxX, profile->outputMinY, profile->outputMaxY, profile->swapAxes,
+		profile->hasMatrix ? profile->matrix : NULL);
+}
+
+/* Loads the merged private and global settings from the compiled cache.
+   Returns 0 if there is no valid cache for the current files. */
+int loadSettingsFromCache(DeviceSettingsList * list, char * onlyForDevice) {
+	int fd = open(getCacheFileName(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		return 0;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CacheHeader)) {
+		close(fd);
+		return 0;
+	}
+	size_t fileSize = st.st_size;
+	char * data = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		return 0;
+	}
+
+	int result = 0;
+	CacheHeader * header = (CacheHeader *) data;
+	size_t profilesSize = (size_t) header->nProfiles * sizeof(CachedProfile);
+	size_t indexSize = (size_t) header->indexSize * sizeof(int32_t);
+	if(header->magic == CACHE_MAGIC && header->version == CACHE_VERSION
+			&& sizeof(CacheHeader) + profilesSize + indexSize + header->stringPoolSize == fileSize
+			&& header->indexSize > 0 && (header->indexSize & (header->indexSize - 1)) == 0
+			&& isCacheUpToDate(header)) {
+		CachedProfile * profiles = (CachedProfile *) (data + sizeof(CacheHeader));
+		int32_t * index = (int32_t *) (data + sizeof(CacheHeader) + profilesSize);
+		const char * pool = data + sizeof(CacheHeader) + profilesSize + indexSize;
+		uint32_t i;
+
+		if(onlyForDevice == NULL) {
+			for(i = 0; i < header->nProfiles; i++) {
+				addCachedProfile(list, &(profiles[i]), pool, header->stringPoolSize);
+			}
+		} else {
+			/* All profiles with the same name are in the same probe chain, in file order */
+			uint32_t slot = hashString(onlyForDevice) & (header->indexSize - 1);
+			for(i = 0; i < header->indexSize && index[slot] != -1; i++) {
+				if(index[slot] >= 0 && (uint32_t) index[slot] < header->nProfiles) {
+					CachedProfile * profile = &(profiles[index[slot]]);
+					if(profile->inputDeviceName >= 0 && (uint32_t) profile->inputDeviceName < header->stringPoolSize
+							&& !strcmp(pool + profile->inputDeviceName, onlyForDevice)) {
+						addCachedProfile(list, profile, pool, header->stringPoolSize);
+					}
+				}
+				slot = (slot + 1) & (header->indexSize - 1);
+			}
+		}
+		result = 1;
+	}
+
+	munmap(data, fileSize);
+	return result;
+}
+
+static int32_t addPoolString(char * pool, uint32_t * poolSize, const char * str) {
+	if(str == NULL) return -1;
+	int32_t offset = *poolSize;
+	strcpy(pool + offset, str);
+	*poolSize += strlen(str) + 1;
+	return offset;
+}
+
+/* Compiles the list into the cache file. The file is replaced atomically. */
+int writeSettingsCache(DeviceSettingsList * list, CacheSourceStamp * stamps) {
+	CacheHeader header;
+	memset(&header, 0, sizeof header);
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.buildTime = time(NULL);
+	memcpy(header.sources, stamps, sizeof header.sources);
+
+	header.indexSize = 16;
+	while(header.indexSize < (uint32_t) list->nDeviceSettings * 2) header.indexSize *= 2;
+
+	uint32_t poolSpace = 0;
+	int i;
+	for(i = 0; i < list->nDeviceSettings; i++) {
+		if(list->deviceSettings[i].inputDeviceName == NULL) continue;
+		poolSpace += strlen(list->deviceSettings[i].inputDeviceName) + 1;
+		if(list->deviceSettings[i].attachedOutput != NULL) {
+			poolSpace += strlen(list->deviceSettings[i].attachedOutput) + 1;
+		}
+	}
+
+	CachedProfile * profiles = malloc(sizeof(CachedProfile) * (list->nDeviceSettings + 1));
+	int32_t * index = malloc(sizeof(int32_t) * header.indexSize);
+	char * pool = malloc(poolSpace + 1);
+	if(profiles == NULL || index == NULL || pool == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for(i = 0; i < (int) header.indexSize; i++) {
+		index[i] = -1;
+	}
+
+	for(i = 0; i < list->nDeviceSettings; i++) {
+		DeviceSettings * settings = &(list->deviceSettings[i]);
+		if(settings->inputDeviceName == NULL) {
+			/* Has been deleted */
+			continue;
+		}
+		CachedProfile * profile = &(profiles[header.nProfiles]);
+		profile->inputDeviceName = addPoolString(pool, &header.stringPoolSize, settings->inputDeviceName);
+		profile->attachedOutput = addPoolString(pool, &header.stringPoolSize, settings->attachedOutput);
+		profile->autoOutput = settings->autoOutput;
+		profile->autoCalibration = settings->autoCalibration;
+		profile->outputMinX = settings->outputMinX;
+		profile->outputMaxX = settings->outputMaxX;
+		profile->outputMinY = settings->outputMinY;
+		profile->outputMaxY = settings->outputMaxY;
+		profile->swapAxes = settings->swapAxes;
+		profile->hasMatrix = settings->hasMatrix;
+		memcpy(profile->matrix, settings->matrix, sizeof profile->matrix);
+
+		uint32_t slot = hashString(settings->inputDeviceName) & (header.indexSize - 1);
+		while(index[slot] != -1) {
+			slot = (slot + 1) & (header.indexSize - 1);
+		}
+		index[slot] = header.nProfiles;
+		header.nProfiles++;
+	}
+
+	char * tempName = malloc(strlen(getCacheFileName()) + 8);
+	strcpy(tempName, getCacheFileName());
+	strcat(tempName, ".XXXXXX");
+
+	int result = 0;
+	int fd = mkstemp(tempName);
+	if(fd >= 0) {
+		FILE * fileDesc = fdopen(fd, "w");
+		if(fileDesc) {
+			int ok = fwrite(&header, sizeof header, 1, fileDesc) == 1
+				&& fwrite(profiles, sizeof(CachedProfile), header.nProfiles, fileDesc) == header.nProfiles
+				&& fwrite(index, sizeof(int32_t), header.indexSize, fileDesc) == header.indexSize
+				&& fwrite(pool, 1, header.stringPoolSize, fileDesc) == header.stringPoolSize;
+			if(fclose(fileDesc) == 0 && ok && rename(tempName, getCacheFileName()) == 0) {
+				result = 1;
+			}
+		} else {
+			close(fd);
+		}
+		if(!result) {
+			unlink(tempName);
+		}
+	}
+
+	free(tempName);
+	free(pool);
+	free(index);
+	free(profiles);
+	return result;
+}
@@ -0,0 +1,73 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PROFILECACHE_H_
+#define PROFILECACHE_H_
+
+#include <stdint.h>
+#include "profiles.h"
+
+#define CACHE_FILE_SUFFIX ".cache"
+#define CACHE_MAGIC 0x43485354	/* "TSHC" */
+#define CACHE_VERSION 3
+#define CACHE_SOURCES 4		/* Private and global settings file and their journals */
+
+/* State of a text file the cache has been compiled from */
+typedef struct _CacheSourceStamp {
+	int64_t size;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	int64_t inode;
+	uint32_t contentHash;
+	int32_t exists;
+} CacheSourceStamp;
+
+/* The cache file consists of the header, nProfiles CachedProfile entries,
+   the hash index (indexSize int32 entries, -1 = empty) and the string pool. */
+typedef struct _CacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	int64_t buildTime;
+	CacheSourceStamp sources[CACHE_SOURCES];
+	uint32_t nProfiles;
+	uint32_t indexSize;
+	uint32_t stringPoolSize;
+	uint32_t reserved;
+} CacheHeader;
+
+typedef struct _CachedProfile {
+	int32_t inputDeviceName;	/* Offsets into the string pool, -1 for NULL */
+	int32_t attachedOutput;
+	int32_t autoOutput;
+	int32_t autoCalibration;
+	int32_t outputMinX;
+	int32_t outputMaxX;
+	int32_t outputMinY;
+	int32_t outputMaxY;
+	int32_t swapAxes;
+	int32_t hasMatrix;
+	float matrix[6];
+} CachedProfile;
+
+char* getCacheFileName();
+int loadSettingsFromCache(DeviceSettingsList *, char *);
+int writeSettingsCache(DeviceSettingsList *, CacheSourceStamp *);
+void getCacheSourceStamps(CacheSourceStamp *);
+void getCacheSourceStats(CacheSourceStamp *);
+int sameCacheSourceStats(CacheSourceStamp *, CacheSourceStamp *);
+
+#endif /* PROFILECACHE_H_ */
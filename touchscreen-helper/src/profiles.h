@@ -17,8 +17,15 @@
 #ifndef PROFILES_H_
 #define PROFILES_H_
 
+#include <stddef.h>
+
 #define MAX_DEVICES_PER_PROFILE 10
 
+/* Changes to a settings file are appended to this journal first */
+#define JOURNAL_FILE_SUFFIX ".journal"
+/* Size at which the journal is merged into the settings file */
+#define JOURNAL_COMPACT_SIZE 16384
+
 typedef struct _DeviceSettings {
 	char * inputDeviceName;
 	char * attachedOutput;
@@ -33,19 +40,32 @@ typedef struct _DeviceSettings {
 //	int inverseX;
 //	int inverseY;
 	int swapAxes;
+	int hasMatrix;		/* Calibrated with matrix instead of the min/max values */
+	float matrix[6];	/* Affine matrix (first two rows) from device coordinates relative to the
+				   axis ranges to the unrotated output, both as unit square */
 } DeviceSettings;
 
 typedef struct _DeviceSettingsList {
 	DeviceSettings * deviceSettings;
 	int nDeviceSettings;
 	int nDeviceSettingsSpace;
+	int * nameIndex;	/* Hash table of profile indices by device name, built on demand */
+	int nameIndexSize;
 } DeviceSettingsList;
 
-void addDeviceSettings(DeviceSettingsList*, char*, char*, int, int, int, int, int, int, int);
+void addDeviceSettings(DeviceSettingsList*, char*, char*, int, int, int, int, int, int, int, const float *);
 int loadSettings(DeviceSettingsList*, char *, char *);
 void freeSettings(DeviceSettingsList*);
+int findProfile(DeviceSettingsList*, const char*);
 int addDeviceSettingsFromFile(char *, DeviceSettingsList *, char *);
+void addDeviceSettingsFromBuffer(char *, char *, size_t, DeviceSettingsList *, char *, int);
 char* getGlobalFileName();
+void changeProfile(DeviceSettingsList *, DeviceSettings *);
+void deleteProfile(DeviceSettingsList *, char *);
+int saveDeviceSettingsToFile(char *, DeviceSettingsList *);
+int storeProfileChange(char *, DeviceSettings *);
+int storeProfileDeletion(char *, char *);
+int compactProfileStore(char *);
 char* getPrivateFileName();
 
 #endif /* PROFILES_H_ */
@@ -14,15 +14,33 @@
  PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* accept4() and struct ucred */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <pthread.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "touchscreen-helper.h"
 #include "profiles.h"
+#include "profilecache.h"
+#include "atoms.h"
+#include "outputs.h"
+#include "control.h"
+#include "backend.h"
+#include "benchmark.h"
+#include "metrics.h"
 #include <signal.h> 
 
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
@@ -76,29 +94,78 @@ static void daemonize(void) {
 	r = r;
 }
 
-Display *display;
-Window root;
-int screenNum;
-int lastScreenWidth;
-int lastScreenHeight;
+BOOL debugMode = FALSE;
+
+/* Milliseconds to wait for further RandR events before applying a display change */
+int settleTime = DEFAULT_SETTLE_TIME;
 
-Atom absXAtom;
-Atom absYAtom;
-Atom absXAtomMT;
-Atom absYAtomMT;
-Atom floatAtom;
+/* Changes of the settings files and their journals are noticed through inotify */
+int inotifyDesc = -1;
+ConfigWatch configWatches[CONFIG_WATCHES];
 
-BOOL debugMode = FALSE;
+/* Signals (SIGUSR1 = reload) are blocked and delivered through this descriptor */
+int signalDesc = -1;
+
+/* The settings files are parsed once and copied to every screen */
+DeviceSettingsList loadedProfiles;
+/* Stats of the settings files and journals when loadedProfiles was loaded */
+CacheSourceStamp loadedStamps[CACHE_SOURCES];
+
+/* All displays served by this instance; their connections are multiplexed in xLoop() */
+HelperDisplay ** displays = NULL;
+int nDisplays = 0;
+
+/* For the metrics: start of the helper and last return from poll() */
+long long startTime = 0;
+long long lastWakeup = 0;
+int passDepth = 0;
+long long passStart = 0;
+unsigned long passStartRoundTrips = 0;
 
-int randrEvBase = 0;
-int xinputEvBase = 0;
+long long getMilliseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long getMicroseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-pthread_t signalThread;
-sigset_t signalSet;
+/* Round trips of the backends of all screens so far */
+static unsigned long getRoundTrips() {
+	unsigned long roundTrips = 0;
+	int i, s;
+	for(i = 0; i < nDisplays; i++) {
+		for(s = 0; s < displays[i]->nScreens; s++) {
+			if(displays[i]->screens[s].backend != NULL) {
+				roundTrips += displays[i]->screens[s].backend->roundTrips;
+			}
+		}
+	}
+	return roundTrips;
+}
 
-BOOL updateSignalReceived = FALSE;
+/* Apply passes are timed and their round trips counted; nested passes belong to the outer one */
+void beginApplyPass() {
+	if(passDepth++ == 0) {
+		passStart = getMicroseconds();
+		passStartRoundTrips = getRoundTrips();
+	}
+}
 
-DeviceSettingsList profiles;
+/* Returns the time the pass has ended */
+long long endApplyPass() {
+	long long now = getMicroseconds();
+	if(--passDepth == 0) {
+		metrics.applyPasses++;
+		recordValue(&metrics.passTime, now - passStart);
+		recordValue(&metrics.passRoundTrips, getRoundTrips() - passStartRoundTrips);
+	}
+	return now;
+}
 
 void swap(int *a, int *b) {
 	int temp = *a;
@@ -106,34 +173,268 @@ void swap(int *a, int *b) {
 	*b = temp;
 }
 
-void setCalibration(int id, int minX, int maxX, int minY, int maxY, int axesSwap, int screenWidth, int screenHeight, int outputX, int outputY, int outputWidth, int outputHeight, int rotation) {
+/* Adds a display with nScreens empty screens to the served ones. The backends of
+   the screens are created by the caller. xdisplay is NULL for the benchmark. */
+HelperDisplay * addDisplay(Display * xdisplay, int nScreens) {
+	HelperDisplay ** newDisplays = realloc(displays, (nDisplays + 1) * sizeof(HelperDisplay *));
+	HelperDisplay * hd = calloc(1, sizeof(HelperDisplay));
+	HelperScreen * screens = calloc(nScreens, sizeof(HelperScreen));
+	if(newDisplays == NULL || hd == NULL || screens == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	displays = newDisplays;
+	displays[nDisplays++] = hd;
+
+	hd->xdisplay = xdisplay;
+	hd->name = strdup(xdisplay != NULL ? DisplayString(xdisplay) : "benchmark");
+	hd->controlDesc = -1;
+	int c;
+	for(c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+		hd->controlClients[c].desc = -1;
+	}
+	hd->defaultScreen = (xdisplay != NULL ? DefaultScreen(xdisplay) : 0);
+	hd->screens = screens;
+	hd->nScreens = nScreens;
+
+	int s;
+	for(s = 0; s < nScreens; s++) {
+		screens[s].display = hd;
+		screens[s].screenNum = s;
+		if(xdisplay != NULL) {
+			screens[s].root = RootWindow(xdisplay, s);
+			screens[s].screenWidth = DisplayWidth(xdisplay, s);
+			screens[s].screenHeight = DisplayHeight(xdisplay, s);
+		}
+	}
+	return hd;
+}
+
+/* Releases the display and removes it from the served ones. A broken connection can't be
+   closed, as Xlib ends the process on I/O errors, so connected must be FALSE then. */
+void removeDisplay(HelperDisplay * hd, int connected) {
+	int s;
+	for(s = 0; s < hd->nScreens; s++) {
+		freeSettings(&(hd->screens[s].profiles));
+		freeOutputSnapshot(&(hd->screens[s].outputSnapshot));
+		if(hd->screens[s].backend != NULL) {
+			hd->screens[s].backend->destroy(hd->screens[s].backend);
+		}
+	}
+	freeSettings(&(hd->previews));
+
+	int c;
+	for(c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+		if(hd->controlClients[c].desc >= 0) close(hd->controlClients[c].desc);
+	}
+	if(hd->controlDesc >= 0) {
+		close(hd->controlDesc);
+		char * controlFile = getControlSocketName(hd->name);
+		if(controlFile != NULL) unlink(controlFile);
+		free(controlFile);
+	}
+	if(hd->xdisplay != NULL && connected) {
+		XCloseDisplay(hd->xdisplay);
+	}
+
+	int i;
+	for(i = 0; i < nDisplays; i++) {
+		if(displays[i] == hd) {
+			memmove(&(displays[i]), &(displays[i + 1]), (nDisplays - i - 1) * sizeof(HelperDisplay *));
+			nDisplays--;
+			break;
+		}
+	}
+	free(hd->screens);
+	free(hd->name);
+	free(hd);
+}
+
+/* Connects to the display and selects the events of all of its screens.
+   Returns NULL if the display can't be served. */
+HelperDisplay * openDisplay(char * name) {
+	Display * xdisplay = XOpenDisplay(name);
+	if (xdisplay == NULL) {
+		fprintf(stderr, "Couldn't connect to X server %s\n", XDisplayName(name));
+		return NULL;
+	}
+
+	int opcode, error, randrEvBase, xinputEvBase;
+	if (!XQueryExtension(xdisplay, "RANDR", &opcode, &randrEvBase,
+			&error)) {
+		printf("X RANDR extension not available on %s.\n", DisplayString(xdisplay));
+		XCloseDisplay(xdisplay);
+		return NULL;
+	}
+
+	/* Which version of XRandR? We support 1.3 */
+	int major = 1, minor = 3;
+	if (!XRRQueryVersion(xdisplay, &major, &minor)) {
+		printf("XRandR version not available on %s.\n", DisplayString(xdisplay));
+		XCloseDisplay(xdisplay);
+		return NULL;
+	} else if(!(major>1 || (major == 1 && minor >= 3))) {
+		printf("XRandR 1.3 not available on %s. Server supports %d.%d\n", DisplayString(xdisplay), major, minor);
+		XCloseDisplay(xdisplay);
+		return NULL;
+	}
+
+	/* XInput Extension available? */
+	if (!XQueryExtension(xdisplay, "XInputExtension", &opcode, &xinputEvBase,
+			&error)) {
+		printf("X Input extension not available on %s.\n", DisplayString(xdisplay));
+		XCloseDisplay(xdisplay);
+		return NULL;
+	}
+
+	/* Which version of XI2? We support 2.0 */
+	major = 2; minor = 0;
+	if (XIQueryVersion(xdisplay, &major, &minor) == BadRequest) {
+		printf("XI2 not available on %s. Server supports %d.%d\n", DisplayString(xdisplay), major, minor);
+		XCloseDisplay(xdisplay);
+		return NULL;
+	}
+
+	HelperDisplay * hd = addDisplay(xdisplay, ScreenCount(xdisplay));
+	hd->randrEvBase = randrEvBase;
+	hd->xinputEvBase = xinputEvBase;
+	internAtoms(xdisplay, hd->atoms);
+
+	int s;
+	for(s = 0; s < hd->nScreens; s++) {
+		XRRSelectInput(xdisplay, hd->screens[s].root, RRScreenChangeNotifyMask | RROutputChangeNotifyMask | RROutputPropertyNotifyMask | RRCrtcChangeNotifyMask);
+		hd->screens[s].backend = createXlibBackend(xdisplay, hd->screens[s].root, hd->atoms);
+	}
+
+	/* Register for XInput device change events */
+	XIEventMask eventmask;
+	unsigned char mask[2] = { 0, 0 }; /* the actual mask */
+
+	eventmask.deviceid = XIAllDevices;
+	eventmask.mask_len = sizeof(mask); /* always in bytes */
+	eventmask.mask = mask;
+	/* now set the mask */
+	XISetMask(mask, XI_HierarchyChanged);
+	XISetMask(mask, XI_PropertyEvent);
+
+	/* Device events concern the whole display, so select them on one root window only */
+	XISelectEvents(xdisplay, hd->screens[hd->defaultScreen].root, &eventmask, 1);
+
+	if(debugMode) {
+		printf("Serving display %s with %i screen(s)\n", hd->name, hd->nScreens);
+	}
+	return hd;
+}
+
+/* Returns the screen with the given root window, or NULL */
+HelperScreen * findScreen(HelperDisplay * hd, Window root) {
+	int s;
+	for(s = 0; s < hd->nScreens; s++) {
+		if(hd->screens[s].root == root) return &(hd->screens[s]);
+	}
+	return NULL;
+}
+
+void invalidateAppliedState(HelperScreen * s, int id) {
+	if(id >= 0 && id < MAX_DEVICE_ID) {
+		s->appliedStates[id].valid = FALSE;
+	}
+}
+
+void invalidateAllAppliedStates(HelperScreen * s) {
+	int id;
+	for(id = 0; id < MAX_DEVICE_ID; id++) {
+		invalidateAppliedState(s, id);
+	}
+}
+
+/* The device has been removed or added, so its ID may now belong to a device with other properties */
+void forgetDevice(HelperScreen * s, int id) {
+	if(id >= 0 && id < MAX_DEVICE_ID) {
+		s->appliedStates[id].valid = FALSE;
+		s->appliedStates[id].probed = FALSE;
+	}
+}
+
+void forgetAllDevices(HelperScreen * s) {
+	int id;
+	for(id = 0; id < MAX_DEVICE_ID; id++) {
+		forgetDevice(s, id);
+	}
+}
+
+/* Returns the matrix mapping the device onto the output in the given orientation. The matrices
+   of all orientations are built at once for the output rectangle, so rotating an output or
+   calibrating further devices on it is a table lookup. */
+static const AffineMatrix * lookupTransform(HelperScreen * s, int rotation, int outputX, int outputY, int outputWidth, int outputHeight, int screenWidth, int screenHeight) {
+	float x = outputX / (float) screenWidth;
+	float y = outputY / (float) screenHeight;
+	float width = outputWidth / (float) screenWidth;
+	float height = outputHeight / (float) screenHeight;
+
+	int i;
+	TransformCache *entry = NULL;
+	for(i = 0; i < TRANSFORM_CACHE_SIZE; i++) {
+		TransformCache *t = &(s->transformCache[i]);
+		if(t->valid && t->x == x && t->y == y && t->width == width && t->height == height) {
+			entry = t;
+			break;
+		}
+	}
+
+	if(entry == NULL) {
+		/* Replace the oldest entry */
+		entry = &(s->transformCache[s->nextTransformCache]);
+		s->nextTransformCache = (s->nextTransformCache + 1) % TRANSFORM_CACHE_SIZE;
+		entry->valid = TRUE;
+		entry->x = x;
+		entry->y = y;
+		entry->width = width;
+		entry->height = height;
+
+		AffineMatrix placement = affinePlacement(x, y, width, height);
+		int o;
+		for(o = 0; o < AFFINE_ORIENTATIONS; o++) {
+			entry->matrices[o] = affineMultiply(placement, affineOrientation(affineOrientationFromIndex(o)));
+		}
+	}
+	return &(entry->matrices[affineOrientationIndex(rotation)]);
+}
+
+void setCalibration(HelperScreen * s, int id, int minX, int maxX, int minY, int maxY, int axesSwap, int screenWidth, int screenHeight, int outputX, int outputY, int outputWidth, int outputHeight, int rotation, const float * profileMatrix) {
 
 	float matrix[] = { 1., 0., 0.,    /* [0] [1] [2] */
 	                   0., 1., 0.,    /* [3] [4] [5] */
 	                   0., 0., 1. };  /* [6] [7] [8] */
 
-	int matrixMode = 0;
-	/* Check if transformation matrix is supported */
-	long l;
-	if((sizeof l) == 4 || (sizeof l) == 8) {
-		/* We only support matrix mode on systems where longs are 32 or 64 bits long */
-		Atom retType;
-		int retFormat;
-		unsigned long retItems, retBytesAfter;
-		unsigned char * data = NULL;
-		if(XIGetProperty(display, id, XInternAtom(display,
-				"Coordinate Transformation Matrix", 0), 0, 9 * 32, False, floatAtom,
-				&retType, &retFormat, &retItems, &retBytesAfter,
-				&data) != Success) {
-			data = NULL;
-		}
-		if(data != NULL && retItems == 9) {
-			matrixMode = 1;
-		}
-		if(data != NULL) {
-			XFree(data);
+	AppliedState *state = NULL;
+	if(id >= 0 && id < MAX_DEVICE_ID) {
+		state = &(s->appliedStates[id]);
+	}
+
+	int capabilities;
+	/* Devices are normally probed in advance, see probeDevices() */
+	if(state != NULL && state->probed) {
+		capabilities = state->capabilities;
+	} else {
+		s->backend->probeCapabilities(s->backend, &id, 1, &capabilities);
+		if(state != NULL) {
+			state->capabilities = capabilities;
+			state->probed = TRUE;
 		}
-	}	
+	}
+
+	/* Only write the properties the driver of the device knows, the others would cause errors.
+	   The libinput driver has no Evdev properties, it gets the same calibration as its own matrix. */
+	int properties = capabilities & (DEVICE_CAP_MATRIX | DEVICE_CAP_EVDEV);
+	if(!(capabilities & DEVICE_CAP_EVDEV) && (capabilities & DEVICE_CAP_LIBINPUT_MATRIX)) {
+		properties |= DEVICE_CAP_LIBINPUT_MATRIX;
+	}
+	if(properties == 0) {
+		if(debugMode) printf("Device %i has no calibration properties\n", id);
+		return;
+	}
+	int matrixMode = capabilities & DEVICE_CAP_MATRIX;
 
 	unsigned char flipHoriz = 0, flipVerti = 0;
 
@@ -141,55 +442,21 @@ void setCalibration(int id, int minX, int maxX, int minY, int maxY, int axesSwap
 
 		if(debugMode) printf("Use matrix method\n");
 
-		/* Output rotation */
-		if(rotation & RR_Rotate_180) {
-			matrix[0] = -1.;
-			matrix[4] = -1;
-			matrix[2] = 1.;
-			matrix[5] = 1.;
-		} else if(rotation & RR_Rotate_90) {
-			matrix[0] = 0.;
-			matrix[1] = -1.;
-			matrix[3] = 1.;
-			matrix[4] = 0.;
-
-			matrix[2] = 1.;
-		} else if(rotation & RR_Rotate_270) {
-			matrix[0] = 0.;
-			matrix[1] = 1.;
-			matrix[3] = -1.;
-			matrix[4] = 0.;
-
-			matrix[5] = 1.;
-		}
-
-		/* Output Reflection */
-		if(rotation & RR_Reflect_X) {
-			matrix[0]*= -1.;
-			matrix[1]*= -1.;
-			matrix[2]*= -1.;
-			matrix[2]+= 1.;
+		/* Output rotation, reflection, size and position */
+		const AffineMatrix *transform = lookupTransform(s, rotation, outputX, outputY, outputWidth, outputHeight, screenWidth, screenHeight);
+
+		if(profileMatrix != NULL && state != NULL && state->axisMaxX > state->axisMinX && state->axisMaxY > state->axisMinY) {
+			/* The profile's matrix replaces the min/max calibration, the driver passes the axes through */
+			AffineMatrix calibration = affineMatrix(profileMatrix[0], profileMatrix[1], profileMatrix[2], profileMatrix[3], profileMatrix[4], profileMatrix[5]);
+			memcpy(matrix, affineMultiply(*transform, calibration).m, sizeof matrix);
+			minX = state->axisMinX;
+			maxX = state->axisMaxX;
+			minY = state->axisMinY;
+			maxY = state->axisMaxY;
+			axesSwap = 0;
+		} else {
+			memcpy(matrix, transform->m, sizeof matrix);
 		}
-		if(rotation & RR_Reflect_Y) {
-			matrix[3]*= -1.;
-			matrix[4]*= -1.;
-			matrix[5]*= -1.;
-			matrix[5]+= 1.;
-		}
-
-		/* Output Size */
-		float widthRel = outputWidth / (float) screenWidth;
-		float heightRel = outputHeight / (float) screenHeight;
-		matrix[0] *= widthRel;
-		matrix[1] *= widthRel;
-		matrix[2] *= widthRel;
-		matrix[3] *= heightRel;
-		matrix[4] *= heightRel;
-		matrix[5] *= heightRel;
-
-		/* Output Position */
-		matrix[2] += outputX / (float) screenWidth;
-		matrix[5] += outputY / (float) screenHeight;
 
 	} else {
 
@@ -242,145 +509,301 @@ void setCalibration(int id, int minX, int maxX, int minY, int maxY, int axesSwap
 
 	}
 
-	XDevice *dev = XOpenDevice(display, id);
-	if(dev) {
-		if(matrixMode) {
-			if((sizeof l) == 4) {
-				XChangeDeviceProperty(display, dev, XInternAtom(display,
-					"Coordinate Transformation Matrix", 0), floatAtom, 32, PropModeReplace, (unsigned char*) matrix, 9);
-			} else if((sizeof l) == 8) {
-				/* Xlib needs the floats long-aligned, so let's align them. */
-				float matrix2[] = { matrix[0], 0., matrix[1], 0., matrix[2], 0.,
-				                    matrix[3], 0., matrix[4], 0., matrix[5], 0.,
-				                    matrix[6], 0., matrix[7], 0., matrix[8], 0.};
-				XChangeDeviceProperty(display, dev, XInternAtom(display,
-					"Coordinate Transformation Matrix", 0), floatAtom, 32, PropModeReplace, (unsigned char*) matrix2, 9);
-			}
+	CalibrationProperties values;
+	memcpy(values.matrix, matrix, sizeof matrix);
+	values.calib[0] = minX;
+	values.calib[1] = maxX;
+	values.calib[2] = minY;
+	values.calib[3] = maxY;
+	values.flip[0] = flipHoriz;
+	values.flip[1] = flipVerti;
+	values.axesSwap = (unsigned char) axesSwap;
+
+	if(properties & DEVICE_CAP_LIBINPUT_MATRIX) {
+		/* libinput works on coordinates relative to the axis ranges */
+		if(state != NULL && state->axisMaxX > state->axisMinX && state->axisMaxY > state->axisMinY && maxX != minX && maxY != minY) {
+			AffineMatrix calibration = affineAxisCalibration(state->axisMinX, state->axisMaxX, state->axisMinY, state->axisMaxY,
+					minX, maxX, minY, maxY, axesSwap, flipHoriz, flipVerti);
+			memcpy(values.libinputMatrix, calibration.m, sizeof values.libinputMatrix);
+		} else {
+			if(debugMode) printf("Axis ranges of device %i unknown, can't write its libinput calibration\n", id);
+			properties &= ~DEVICE_CAP_LIBINPUT_MATRIX;
 		}
+	}
 
-		long calib[] = { minX, maxX, minY, maxY };
-		//TODO instead of long, use platform 32 bit type
-		XChangeDeviceProperty(display, dev, XInternAtom(display,
-			"Evdev Axis Calibration", 0), XA_INTEGER, 32, PropModeReplace, (unsigned char*) calib, 4);
+	/* Only the properties that differ from what has been written before */
+	if(state != NULL && state->valid) {
+		if(!memcmp(state->applied.matrix, values.matrix, sizeof values.matrix)) properties &= ~DEVICE_CAP_MATRIX;
+		if(!memcmp(state->applied.calib, values.calib, sizeof values.calib)) properties &= ~DEVICE_CAP_EVDEV_CALIBRATION;
+		if(!memcmp(state->applied.flip, values.flip, sizeof values.flip)) properties &= ~DEVICE_CAP_EVDEV_INVERSION;
+		if(state->applied.axesSwap == values.axesSwap) properties &= ~DEVICE_CAP_EVDEV_SWAP;
+		if(!memcmp(state->applied.libinputMatrix, values.libinputMatrix, sizeof values.libinputMatrix)) properties &= ~DEVICE_CAP_LIBINPUT_MATRIX;
+		if(properties == 0) {
+			if(debugMode) printf("Calibration of device %i unchanged\n", id);
+			metrics.writesSkipped++;
+			return;
+		}
+	}
 
-		unsigned char flipData[] = {flipHoriz, flipVerti};
-		XChangeDeviceProperty(display, dev, XInternAtom(display,
-			"Evdev Axis Inversion", 0), XA_INTEGER, 8, PropModeReplace, flipData, 2);
+	unsigned long firstSerial = s->backend->nextRequest(s->backend);
+	if(!s->backend->writeCalibration(s->backend, id, properties, &values)) {
+		metrics.applyFailures++;
+	} else {
+		metrics.propertyWrites++;
+		if(state != NULL) {
+			state->valid = TRUE;
+			state->applied = values;
+			/* Property events caused by these requests are our own and don't invalidate the state */
+			state->ownSerialFirst = firstSerial;
+			state->ownSerialLast = s->backend->nextRequest(s->backend) - 1;
+		}
+		/* Otherwise the writes could stay our last requests, and a change by another client
+		   would arrive with the serial of one of them */
+		s->backend->fence(s->backend);
+	}
+}
 
-		unsigned char cAxesSwap = (unsigned char) axesSwap;
-		XChangeDeviceProperty(display, dev, XInternAtom(display,
-			"Evdev Axes Swap", 0), XA_INTEGER, 8, PropModeReplace, &cAxesSwap, 1);
 
-		XCloseDevice(display, dev);
+/* Returns the output the profile is attached to, NULL if it is not attached to any (available) output */
+OutputState * getProfileOutput(HelperScreen * s, DeviceSettings * profile) {
+	if(profile->autoOutput) {
+		if(s->outputSnapshot.lvdsOutput == -1) return NULL;
+		return &(s->outputSnapshot.outputs[s->outputSnapshot.lvdsOutput]);
+	} else if(profile->attachedOutput != NULL) {
+		return findOutput(&(s->outputSnapshot), profile->attachedOutput);
 	}
+	return NULL;
 }
 
+/* Whether the screen calibrates the devices of the profile. The screens of a display share
+   its devices, so a profile belongs to the screen of its output, or to the default screen
+   if it isn't attached to any. */
+int servesProfile(HelperScreen * s, DeviceSettings * profile) {
+	if(profile->attachedOutput != NULL || profile->autoOutput) {
+		return getOutputCrtc(&(s->outputSnapshot), getProfileOutput(s, profile)) != NULL;
+	}
+	return s->screenNum == s->display->defaultScreen;
+}
 
-void handleDisplayChange(XRRScreenChangeNotifyEvent *evt) {
-	int screenWidth, screenHeight;
-	if(evt==NULL) {
-		screenWidth = lastScreenWidth;
-		screenHeight = lastScreenHeight;
-	} else {
-		screenWidth = evt->width;
-		lastScreenWidth = screenWidth;
-		screenHeight = evt->height;
-		lastScreenHeight = screenHeight;
+/* Finds out which calibration properties the devices of profile d (of all profiles the screen
+   serves if -1) have, with one round trip for all devices that haven't been probed since they
+   appeared */
+static void probeDevices(HelperScreen * s, int d) {
+	int deviceIDs[MAX_DEVICE_ID];
+	int results[MAX_DEVICE_ID];
+	int n = 0;
+	int first = (d == -1 ? 0 : d), last = (d == -1 ? s->profiles.nDeviceSettings - 1 : d);
+	int p, id;
+	for(p = first; p <= last; p++) {
+		DeviceSettings *profile = &(s->profiles.deviceSettings[p]);
+		if(profile->inputDeviceCount == 0 || !servesProfile(s, profile)) continue;
+		for(id = 0; id < profile->inputDeviceCount; id++) {
+			int deviceID = profile->inputDeviceIDs[id];
+			/* A device belongs to one profile only, so there are no duplicates */
+			if(deviceID >= 0 && deviceID < MAX_DEVICE_ID && !s->appliedStates[deviceID].probed) {
+				deviceIDs[n++] = deviceID;
+			}
+		}
 	}
+	if(n == 0) return;
 
-	if(debugMode) {
-		printf("Screen size: %ix%i\n", screenWidth, screenHeight);
+	s->backend->probeCapabilities(s->backend, deviceIDs, n, results);
+	int i;
+	for(i = 0; i < n; i++) {
+		if(debugMode) printf("Device %i has calibration properties 0x%x\n", deviceIDs[i], results[i]);
+		s->appliedStates[deviceIDs[i]].capabilities = results[i];
+		s->appliedStates[deviceIDs[i]].probed = TRUE;
 	}
+}
+
+/* Calibrates the devices of profile d using the current output snapshot of the screen.
+   If onlyDevice is not -1, only the device with that ID is calibrated. */
+void calibrateProfile(HelperScreen * s, int d, int onlyDevice) {
+	DeviceSettings *profile = &(s->profiles.deviceSettings[d]);
+	int outputX = 0, outputY = 0, outputWidth = s->screenWidth, outputHeight = s->screenHeight, rotation = 0;
 
-	XRRScreenResources *res = XRRGetScreenResourcesCurrent(display, root);
+	if(profile->inputDeviceCount == 0) return;
 
+	if(profile->attachedOutput != NULL || profile->autoOutput) {
+		OutputState *output = getProfileOutput(s, profile);
+		CrtcState *crtc = getOutputCrtc(&(s->outputSnapshot), output);
+		if(crtc == NULL) {
+			/* The output is not available on this screen or not active (has no CRTC) */
+			return;
+		}
+		if(debugMode) {
+			printf("Output %s -- x: %i; y: %i; w: %i; h: %i\n", output->name, crtc->x, crtc->y, crtc->width, crtc->height);
+		}
+		outputX = crtc->x;
+		outputY = crtc->y;
+		outputWidth = crtc->width;
+		outputHeight = crtc->height;
+		rotation = crtc->rotation;
+	} else if(s->screenNum != s->display->defaultScreen) {
+		/* The whole screen is meant, which is the default one */
+		return;
+	}
+
+	probeDevices(s, d);
+
+	/* Set calibration */
+	int id = 0;
+	for(id = 0; id<profile->inputDeviceCount; id++) {
+		if(onlyDevice != -1 && profile->inputDeviceIDs[id] != onlyDevice) continue;
+		if(debugMode) {
+			printf("Calibrate Device with ID %i\n", profile->inputDeviceIDs[id]);
+		}
+		setCalibration(s, profile->inputDeviceIDs[id], profile->outputMinX, profile->outputMaxX, profile->outputMinY, profile->outputMaxY, profile->swapAxes, s->screenWidth, s->screenHeight, outputX, outputY, outputWidth, outputHeight, rotation,
+				(profile->hasMatrix ? profile->matrix : NULL));
+	}
+}
+
+void calibrateAllProfiles(HelperScreen * s) {
 	int d;
-	for(d = 0; d < profiles.nDeviceSettings; d++) {
-		if(profiles.deviceSettings[d].attachedOutput == NULL && !(profiles.deviceSettings[d].autoOutput)) {
-	
-			/* Set calibration of whole screen */
+	probeDevices(s, -1);
+	for(d = 0; d < s->profiles.nDeviceSettings; d++) {
+		calibrateProfile(s, d, -1);
+	}
+}
 
-			int id = 0;
-			for(id = 0; id<profiles.deviceSettings[d].inputDeviceCount; id++) {
-				if(debugMode) {
-					printf("Calibrate Device with ID %i\n", profiles.deviceSettings[d].inputDeviceIDs[id]);
-				}
-							setCalibration(profiles.deviceSettings[d].inputDeviceIDs[id], profiles.deviceSettings[d].outputMinX, profiles.deviceSettings[d].outputMaxX, profiles.deviceSettings[d].outputMinY, profiles.deviceSettings[d].outputMaxY, profiles.deviceSettings[d].swapAxes, screenWidth, screenHeight, 0, 0, screenWidth, screenHeight, 0); 
+/* Queries all outputs and CRTCs once, profiles are resolved against this snapshot.
+   Returns TRUE if the layout differs from the one of the previous snapshot. */
+int refreshOutputSnapshot(HelperScreen * s) {
+	freeOutputSnapshot(&(s->outputSnapshot));
+	s->backend->takeOutputSnapshot(s->backend, &(s->outputSnapshot));
+
+	unsigned long fingerprint = getLayoutFingerprint(&(s->outputSnapshot), s->screenWidth, s->screenHeight);
+	int changed = (fingerprint != s->lastLayoutFingerprint);
+	s->lastLayoutFingerprint = fingerprint;
+	return changed;
+}
+
+/* Recalibrates all devices, whether the layout has changed or not */
+void handleDisplayChange(HelperScreen * s) {
+	if(debugMode) {
+		printf("Screen %s.%i size: %ix%i\n", s->display->name, s->screenNum, s->screenWidth, s->screenHeight);
+	}
+
+	refreshOutputSnapshot(s);
+	s->outputChangePending = FALSE;
+	calibrateAllProfiles(s);
+}
+
+/* Handles CRTC and output change sub-events. The snapshot is updated from the event
+   contents, so only the profiles attached to the affected outputs need to be recalibrated. */
+void handleRandrNotify(HelperScreen * s, XRRNotifyEvent *evt) {
+	int known;
+	if(evt->subtype == RRNotify_CrtcChange) {
+		known = updateSnapshotCrtc(&(s->outputSnapshot), (XRRCrtcChangeNotifyEvent *) evt);
+	} else if(evt->subtype == RRNotify_OutputChange) {
+		known = updateSnapshotOutput(&(s->outputSnapshot), (XRROutputChangeNotifyEvent *) evt);
+	} else {
+		return;
+	}
+
+	if(known) {
+		if(!s->displayChangePending && !s->outputChangePending) {
+			s->displayEventTime = lastWakeup;
+		}
+		s->outputChangePending = TRUE;
+		s->displayChangeDeadline = getMilliseconds() + settleTime;
+	} else {
+		/* Outputs or CRTCs have been added; we need a complete new snapshot */
+		scheduleDisplayChange(s);
+	}
+}
 
+/* Remember a RandR event; it is applied together with all other events of the same burst
+   once no new event has arrived for settleTime milliseconds */
+void scheduleDisplayChange(HelperScreen * s) {
+	if(!s->displayChangePending && !s->outputChangePending) {
+		s->displayEventTime = lastWakeup;
+	}
+	s->displayChangePending = TRUE;
+	s->displayChangeDeadline = getMilliseconds() + settleTime;
+}
+
+void handlePendingDisplayChange(HelperScreen * s) {
+	beginApplyPass();
+
+	if(!s->displayChangePending) {
+		/* Only outputs we know have changed, the snapshot is already up to date */
+		s->outputChangePending = FALSE;
+		int d;
+		for(d = 0; d < s->profiles.nDeviceSettings; d++) {
+			OutputState *output = getProfileOutput(s, &(s->profiles.deviceSettings[d]));
+			if(output != NULL && output->changed) {
+				calibrateProfile(s, d, -1);
 			}
+		}
+		clearOutputChanges(&(s->outputSnapshot));
+		s->lastLayoutFingerprint = getLayoutFingerprint(&(s->outputSnapshot), s->screenWidth, s->screenHeight);
+	} else {
+		s->displayChangePending = FALSE;
+		s->outputChangePending = FALSE;
 
-		} else if(profiles.deviceSettings[d].inputDeviceCount > 0) {
-			int o;
-			for(o = 0; o < res->noutput; o++) {
-				XRROutputInfo *outpInf = XRRGetOutputInfo(display, res, res->outputs[o]);
-				if((profiles.deviceSettings[d].autoOutput && (strstr(outpInf->name, "LVDS") || strstr(outpInf->name, "lvds")) )
-					|| (profiles.deviceSettings[d].attachedOutput && !strcmp(outpInf->name, profiles.deviceSettings[d].attachedOutput))) {
-					/* This is the attached output */
-					if(outpInf->crtc != 0) {
-						/* The output is active (has a CRTC) */
-
-						XRRCrtcInfo* crtcInf = XRRGetCrtcInfo(display, res, outpInf->crtc);
-						if(debugMode) {
-							printf("Output %s -- x: %i; y: %i; w: %i; h: %i\n", outpInf->name, crtcInf->x, crtcInf->y, crtcInf->width, crtcInf->height);
-						}
-
-						/* Set calibration */
-						int id = 0;
-						for(id = 0; id<profiles.deviceSettings[d].inputDeviceCount; id++) {
-							if(debugMode) {
-								printf("Calibrate Device with ID %i\n", profiles.deviceSettings[d].inputDeviceIDs[id]);
-							}
-
-							setCalibration(profiles.deviceSettings[d].inputDeviceIDs[id], profiles.deviceSettings[d].outputMinX, profiles.deviceSettings[d].outputMaxX, profiles.deviceSettings[d].outputMinY, profiles.deviceSettings[d].outputMaxY, profiles.deviceSettings[d].swapAxes, screenWidth, screenHeight, crtcInf->x, crtcInf->y, crtcInf->width, crtcInf->height, crtcInf->rotation); 
-
-						}
-
-						XRRFreeCrtcInfo(crtcInf);
-					}
-					/* Output found, so break */
-					break;
-				}
-				XRRFreeOutputInfo(outpInf);
+		if(refreshOutputSnapshot(s)) {
+			if(debugMode) {
+				printf("Screen %s.%i size: %ix%i\n", s->display->name, s->screenNum, s->screenWidth, s->screenHeight);
 			}
+			calibrateAllProfiles(s);
+		} else if(debugMode) {
+			printf("Display layout unchanged, nothing to do\n");
 		}
 	}
-	XRRFreeScreenResources(res);
-}
 
-void setAutoCalibrationData(int d, XIDeviceInfo * deviceInfo) {
-	profiles.deviceSettings[d].swapAxes = 0;
+	recordValue(&metrics.displayLatency, endApplyPass() - s->displayEventTime);
+}
 
+/* Reads the ranges of the absolute X and Y axes of the device. Ranges of axes
+   the device doesn't have are left unchanged. */
+static void getAxisRanges(Atom * atoms, XIDeviceInfo * deviceInfo, int * minX, int * maxX, int * minY, int * maxY) {
 	int c;
 	for(c = 0; c < deviceInfo->num_classes; c++) {
 		if(deviceInfo->classes[c]->type == XIValuatorClass) {
 			XIValuatorClassInfo* valuatorInfo = (XIValuatorClassInfo *) deviceInfo->classes[c];
 			if(valuatorInfo->mode == XIModeAbsolute) {
-				if(valuatorInfo->label == absXAtom || valuatorInfo->label == absXAtomMT) {
-					profiles.deviceSettings[d].outputMinX = valuatorInfo->min;
-					profiles.deviceSettings[d].outputMaxX = valuatorInfo->max;
-				} else if(valuatorInfo->label == absYAtom || valuatorInfo->label == absYAtomMT) {
-					profiles.deviceSettings[d].outputMinY = valuatorInfo->min;
-					profiles.deviceSettings[d].outputMaxY = valuatorInfo->max;
+				if(valuatorInfo->label == atoms[ATOM_ABS_X] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_X]) {
+					*minX = valuatorInfo->min;
+					*maxX = valuatorInfo->max;
+				} else if(valuatorInfo->label == atoms[ATOM_ABS_Y] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_Y]) {
+					*minY = valuatorInfo->min;
+					*maxY = valuatorInfo->max;
 				}
 			}
 		}
 	}	
+}
+
+void setAutoCalibrationData(HelperScreen * s, int d, XIDeviceInfo * deviceInfo) {
+	DeviceSettings * profile = &(s->profiles.deviceSettings[d]);
+	profile->swapAxes = 0;
+	profile->hasMatrix = FALSE;
+
+	getAxisRanges(s->display->atoms, deviceInfo, &(profile->outputMinX), &(profile->outputMaxX), &(profile->outputMinY), &(profile->outputMaxY));
 
+	profile->autoCalibration = FALSE;
+}
 
-	profiles.deviceSettings[d].autoCalibration = FALSE;
+/* The libinput calibration matrix is relative to the axis ranges, so they are kept with the device */
+static void storeAxisRanges(HelperScreen * s, XIDeviceInfo * deviceInfo) {
+	if(deviceInfo->deviceid < 0 || deviceInfo->deviceid >= MAX_DEVICE_ID) return;
+	AppliedState *state = &(s->appliedStates[deviceInfo->deviceid]);
+	state->axisMinX = state->axisMaxX = state->axisMinY = state->axisMaxY = 0;
+	getAxisRanges(s->display->atoms, deviceInfo, &(state->axisMinX), &(state->axisMaxX), &(state->axisMinY), &(state->axisMaxY));
 }
 
-int isAbsoluteInputDevice(XIDeviceInfo * deviceInfo) {
+int isAbsoluteInputDevice(Atom * atoms, XIDeviceInfo * deviceInfo) {
 	int xFound = FALSE, yFound = FALSE;
 	int c;
 	for(c = 0; c < deviceInfo->num_classes; c++) {
 		if(deviceInfo->classes[c]->type == XIValuatorClass) {
 			XIValuatorClassInfo* valuatorInfo = (XIValuatorClassInfo *) deviceInfo->classes[c];
 			if(valuatorInfo->mode == XIModeAbsolute) {
-				if(valuatorInfo->label == absXAtom || valuatorInfo->label == absXAtomMT) {
+				if(valuatorInfo->label == atoms[ATOM_ABS_X] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_X]) {
 					xFound = TRUE;
 					if(yFound) return TRUE;
-				} else if(valuatorInfo->label == absYAtom || valuatorInfo->label == absYAtomMT) {
+				} else if(valuatorInfo->label == atoms[ATOM_ABS_Y] || valuatorInfo->label == atoms[ATOM_ABS_MT_POSITION_Y]) {
 					yFound = TRUE;
 					if(xFound) return TRUE;
 				}
@@ -391,17 +814,92 @@ int isAbsoluteInputDevice(XIDeviceInfo * deviceInfo) {
 	return FALSE;
 }
 
-void handleDeviceChange() {
+/* Adds the device to the matching profile (or a new dummy profile if it is a touchscreen).
+   Returns the index of the profile or -1 if the device is not handled. */
+int attachDevice(HelperScreen * s, XIDeviceInfo * deviceInfo) {
+	DeviceSettingsList * profiles = &(s->profiles);
+	int d = findProfile(profiles, deviceInfo->name);
+	if(d != -1) {
+		if(debugMode) {
+			printf("Device %s for profile %s found with ID %i\n", deviceInfo->name, profiles->deviceSettings[d].inputDeviceName, deviceInfo->deviceid);
+		}
+		if(profiles->deviceSettings[d].inputDeviceCount < MAX_DEVICES_PER_PROFILE) {
+			metrics.devicesMatched++;
+			profiles->deviceSettings[d].inputDeviceCount++;
+			profiles->deviceSettings[d].inputDeviceIDs[profiles->deviceSettings[d].inputDeviceCount-1] = deviceInfo->deviceid;
+			storeAxisRanges(s, deviceInfo);
+
+			if(profiles->deviceSettings[d].autoCalibration) {
+				/* Set default calibration from axes */
+				setAutoCalibrationData(s, d, deviceInfo);
+			}
+		}
+		return d;
+	}
+
+	/* No profile available. If touchscreen, create dummy profile */
+	if(isAbsoluteInputDevice(s->display->atoms, deviceInfo)) {
+		if(debugMode) {
+			printf("Found absolute X and Y axis on device %i, assume it's a touchscreen.\n", deviceInfo->deviceid);
+			printf("No profile found for it, create dummy profile.\n");
+		}
+		/* Create dummy profile */
+		metrics.devicesMatched++;
+		char *deviceName = malloc((strlen(deviceInfo->name) + 1) * sizeof (char));
+		strcpy(deviceName, deviceInfo->name);
+		addDeviceSettings(profiles, deviceName, NULL, TRUE, TRUE, 0, 0, 0, 0, 0, NULL);
+		profiles->deviceSettings[profiles->nDeviceSettings-1].inputDeviceCount = 1;
+		profiles->deviceSettings[profiles->nDeviceSettings-1].inputDeviceIDs[0] = deviceInfo->deviceid;
+		storeAxisRanges(s, deviceInfo);
+
+		/* Set default calibration from axes */
+		setAutoCalibrationData(s, profiles->nDeviceSettings - 1, deviceInfo);
+		return profiles->nDeviceSettings - 1;
+	}
+	return -1;
+}
+
+/* Returns the index of the profile the device with the given ID belongs to, or -1 */
+int findDeviceProfile(HelperScreen * s, int deviceID) {
+	int d, id;
+	for(d = 0; d < s->profiles.nDeviceSettings; d++) {
+		for(id = 0; id < s->profiles.deviceSettings[d].inputDeviceCount; id++) {
+			if(s->profiles.deviceSettings[d].inputDeviceIDs[id] == deviceID) return d;
+		}
+	}
+	return -1;
+}
+
+void detachDevice(HelperScreen * s, int deviceID) {
+	int d = findDeviceProfile(s, deviceID);
+	if(d == -1) return;
+
+	DeviceSettings * profile = &(s->profiles.deviceSettings[d]);
+	int id;
+	for(id = 0; id < profile->inputDeviceCount; id++) {
+		if(profile->inputDeviceIDs[id] == deviceID) {
+			profile->inputDeviceCount--;
+			profile->inputDeviceIDs[id] = profile->inputDeviceIDs[profile->inputDeviceCount];
+			break;
+		}
+	}
+	if(debugMode) {
+		printf("Device with ID %i removed from profile %s\n", deviceID, profile->inputDeviceName);
+	}
+}
+
+/* Rescans all input devices and calibrates all of them */
+void handleDeviceChange(HelperScreen * s) {
 	int n;
-	XIDeviceInfo *info = XIQueryDevice(display, XIAllDevices, &n);
+	XIDeviceInfo *info = s->backend->queryDevices(s->backend, XIAllDevices, &n);
 	if (!info) {
 		printf("No XInput devices available\n");
 		exit(1);
 	}
 
 	int d;
-	for(d = 0; d < profiles.nDeviceSettings; d++) {
-		profiles.deviceSettings[d].inputDeviceCount = 0;
+	for(d = 0; d < s->profiles.nDeviceSettings; d++) {
+		s->profiles.deviceSettings[d].inputDeviceCount = 0;
 	}
 
 	/* Go through input devices and add to matching profile  */
@@ -409,225 +907,986 @@ void handleDeviceChange() {
 	for (i = 0; i < n; i++) {
 		if (info[i].use == XIMasterPointer || info[i].use == XIMasterKeyboard) {
 		} else {
-			int foundProfile = FALSE;
-			for(d = 0; d < profiles.nDeviceSettings; d++) {
-				if (profiles.deviceSettings[d].inputDeviceName != NULL && !strcmp(info[i].name, profiles.deviceSettings[d].inputDeviceName)) {
-					if(debugMode) {
-						printf("Device %s for profile %s found with ID %i\n", info[i].name, profiles.deviceSettings[d].inputDeviceName, info[i].deviceid);
-					}
-					if(profiles.deviceSettings[d].inputDeviceCount < MAX_DEVICES_PER_PROFILE) {
-						profiles.deviceSettings[d].inputDeviceCount++;
-						profiles.deviceSettings[d].inputDeviceIDs[profiles.deviceSettings[d].inputDeviceCount-1] = info[i].deviceid;
-
-						if(profiles.deviceSettings[d].autoCalibration) {
-							/* Set default calibration from axes */
-							setAutoCalibrationData(d, &(info[i]));
-						}
-					}
-					foundProfile = TRUE;
-					break;
-				}
+			attachDevice(s, &(info[i]));
+		}
+
+	}
+
+	s->backend->freeDevices(s->backend, info);
+
+
+	handleDisplayChange(s);
+}
+
+/* Queries, matches and calibrates a single new or re-enabled device */
+void handleDeviceAdded(HelperScreen * s, int deviceID) {
+	int d = findDeviceProfile(s, deviceID);
+	if(d == -1) {
+		int n;
+		XIDeviceInfo *info = s->backend->queryDevices(s->backend, deviceID, &n);
+		if (!info) {
+			return;
+		}
+		if(n == 1 && info[0].use != XIMasterPointer && info[0].use != XIMasterKeyboard) {
+			d = attachDevice(s, &(info[0]));
+		}
+		s->backend->freeDevices(s->backend, info);
+	}
+	if(d == -1) return;
+
+	/* Outputs haven't changed since the last display change, so the snapshot is still valid */
+	calibrateProfile(s, d, deviceID);
+}
+
+/* Somebody else (e.g. gtouchsett) changed a property of the device, so we
+   can't rely on what we have written before */
+void handlePropertyChange(HelperScreen * s, XIPropertyEvent *evt) {
+	if(evt->deviceid < 0 || evt->deviceid >= MAX_DEVICE_ID) return;
+	AppliedState *state = &(s->appliedStates[evt->deviceid]);
+	if(state->valid && evt->serial >= state->ownSerialFirst && evt->serial <= state->ownSerialLast) {
+		return;
+	}
+	if(debugMode && state->valid) {
+		printf("Property of device %i changed externally\n", evt->deviceid);
+	}
+	invalidateAppliedState(s, evt->deviceid);
+}
+
+/* Only handle the devices that have actually changed. Returns TRUE if devices have been added. */
+int handleHierarchyChange(HelperScreen * s, XIHierarchyEvent *evt) {
+	int added = FALSE;
+	int i;
+	for(i = 0; i < evt->num_info; i++) {
+		XIHierarchyInfo *info = &(evt->info[i]);
+		if(info->use == XIMasterPointer || info->use == XIMasterKeyboard) {
+			continue;
+		}
+		if(info->flags & (XISlaveAdded | XISlaveRemoved)) {
+			forgetDevice(s, info->deviceid);
+		} else if(info->flags & (XIDeviceEnabled | XIDeviceDisabled)) {
+			invalidateAppliedState(s, info->deviceid);
+		}
+		if(info->flags & XISlaveRemoved) {
+			detachDevice(s, info->deviceid);
+		} else if(info->flags & (XISlaveAdded | XIDeviceEnabled)) {
+			if(debugMode) {
+				printf("XInput device %i added or enabled.\n", info->deviceid);
 			}
-			if(foundProfile == FALSE) {
-				/* No profile available. If touchscreen, create dummy profile */
-				if(isAbsoluteInputDevice(&(info[i]))) {
-					if(debugMode) {
-						printf("Found absolute X and Y axis on device %i, assume it's a touchscreen.\n", info[i].deviceid);
-						printf("No profile found for it, create dummy profile.\n");
-					}
-					/* Create dummy profile */
-					char *deviceName = malloc((strlen(info[i].name) + 1) * sizeof (char));
-					strcpy(deviceName, info[i].name);
-					addDeviceSettings(&profiles, deviceName, NULL, TRUE, TRUE, 0, 0, 0, 0, 0);
-					profiles.deviceSettings[profiles.nDeviceSettings-1].inputDeviceCount = 1;
-					profiles.deviceSettings[profiles.nDeviceSettings-1].inputDeviceIDs[0] = info[i].deviceid;
-
-					/* Set default calibration from axes */
-					setAutoCalibrationData(profiles.nDeviceSettings - 1, &(info[i]));
-				}
+			handleDeviceAdded(s, info->deviceid);
+			added = TRUE;
+		}
+	}
+	return added;
+}
+
+/* Gives the screen a copy of the loaded settings and the previews of its display,
+   then rescans its devices */
+void loadScreenProfiles(HelperScreen * s) {
+	/* Property events may still be queued, so don't trust the applied states */
+	invalidateAllAppliedStates(s);
+	freeSettings(&(s->profiles));
+
+	int i;
+	for(i = 0; i < loadedProfiles.nDeviceSettings; i++) {
+		if(loadedProfiles.deviceSettings[i].inputDeviceName != NULL) {
+			changeProfile(&(s->profiles), &(loadedProfiles.deviceSettings[i]));
+		}
+	}
+	DeviceSettingsList * previews = &(s->display->previews);
+	for(i = 0; i < previews->nDeviceSettings; i++) {
+		if(previews->deviceSettings[i].inputDeviceName != NULL) {
+			changeProfile(&(s->profiles), &(previews->deviceSettings[i]));
+		}
+	}
+	handleDeviceChange(s);
+}
+
+void reloadSettings() {
+	long long start = getMicroseconds();
+	metrics.reloads++;
+	beginApplyPass();
+
+	/* Parsed once for all screens of all displays */
+	freeSettings(&loadedProfiles);
+	getCacheSourceStats(loadedStamps);
+	loadSettings(&loadedProfiles, NULL, NULL);
+	int i, s;
+	for(i = 0; i < nDisplays; i++) {
+		for(s = 0; s < displays[i]->nScreens; s++) {
+			loadScreenProfiles(&(displays[i]->screens[s]));
+		}
+	}
+
+	recordValue(&metrics.reloadTime, endApplyPass() - start);
+}
 
+/* Updates the profile of the named device on the screen (settings is NULL if the profile has been
+   deleted) and recalibrates its devices. Returns TRUE if the screen uses or now has the profile,
+   FALSE if it doesn't know it and -1 if all settings have to be reloaded. */
+static int updateScreenProfile(HelperScreen * s, char * deviceName, DeviceSettings * settings) {
+	int d = findProfile(&(s->profiles), deviceName);
+	if(d == -1) {
+		if(settings == NULL) return FALSE;
+
+		/* No device uses the profile yet; devices which weren't handled before may match now */
+		changeProfile(&(s->profiles), settings);
+		d = s->profiles.nDeviceSettings - 1;
+
+		int n, i;
+		XIDeviceInfo *info = s->backend->queryDevices(s->backend, XIAllDevices, &n);
+		for(i = 0; info != NULL && i < n; i++) {
+			if(info[i].use != XIMasterPointer && info[i].use != XIMasterKeyboard && !strcmp(info[i].name, deviceName)
+					&& findDeviceProfile(s, info[i].deviceid) == -1) {
+				attachDevice(s, &(info[i]));
 			}
 		}
+		if(info != NULL) s->backend->freeDevices(s->backend, info);
+		calibrateProfile(s, d, -1);
+		return TRUE;
+	}
 
+	DeviceSettings *profile = &(s->profiles.deviceSettings[d]);
+	if(settings != NULL) {
+		changeProfile(&(s->profiles), settings);
+	} else {
+		/* Deleted; like an unknown touchscreen, the device gets the automatic settings */
+		if(profile->attachedOutput != NULL) {
+			free(profile->attachedOutput);
+		}
+		profile->attachedOutput = NULL;
+		profile->autoOutput = TRUE;
+		profile->autoCalibration = TRUE;
+		profile->hasMatrix = FALSE;
+	}
+
+	if(profile->autoCalibration && profile->inputDeviceCount > 0) {
+		int n;
+		XIDeviceInfo *info = s->backend->queryDevices(s->backend, profile->inputDeviceIDs[0], &n);
+		if(info != NULL) {
+			if(settings == NULL && !isAbsoluteInputDevice(s->display->atoms, &(info[0]))) {
+				/* Not a touchscreen, so without a profile the device isn't ours anymore */
+				s->backend->freeDevices(s->backend, info);
+				return -1;
+			}
+			setAutoCalibrationData(s, d, &(info[0]));
+			s->backend->freeDevices(s->backend, info);
+		}
 	}
 
-	XIFreeDeviceInfo(info);
+	/* Devices whose calibration doesn't change are skipped by setCalibration() */
+	calibrateProfile(s, d, -1);
+	return TRUE;
+}
 
+/* Re-reads the profile of the named device only (or takes its preview) and recalibrates its
+   devices on all screens of the display. Returns FALSE if the profile is neither in the
+   settings nor in use. */
+int reloadProfile(HelperDisplay * hd, char * deviceName) {
+	DeviceSettingsList fresh;
+	metrics.profileReloads++;
+	loadSettings(&fresh, deviceName, NULL);
+	int p = findProfile(&(hd->previews), deviceName);
+	if(p != -1) {
+		changeProfile(&fresh, &(hd->previews.deviceSettings[p]));
+	}
+	int f = findProfile(&fresh, deviceName);
+	DeviceSettings * settings = (f != -1 ? &(fresh.deviceSettings[f]) : NULL);
+
+	int found = FALSE;
+	int s;
+	for(s = 0; s < hd->nScreens; s++) {
+		int result = updateScreenProfile(&(hd->screens[s]), deviceName, settings);
+		if(result == -1) {
+			reloadSettings();
+			found = TRUE;
+			break;
+		}
+		found = found || result;
+	}
+	freeSettings(&fresh);
+	return found;
+}
 
-	handleDisplayChange((XRRScreenChangeNotifyEvent*) NULL);
+static int sameProfile(DeviceSettings * a, DeviceSettings * b) {
+	if((a->attachedOutput == NULL) != (b->attachedOutput == NULL)) return FALSE;
+	if(a->attachedOutput != NULL && strcmp(a->attachedOutput, b->attachedOutput)) return FALSE;
+	if(a->hasMatrix != b->hasMatrix) return FALSE;
+	if(a->hasMatrix && memcmp(a->matrix, b->matrix, sizeof a->matrix)) return FALSE;
+	return a->autoOutput == b->autoOutput && a->autoCalibration == b->autoCalibration
+			&& a->outputMinX == b->outputMinX && a->outputMaxX == b->outputMaxX
+			&& a->outputMinY == b->outputMinY && a->outputMaxY == b->outputMaxY && a->swapAxes == b->swapAxes;
 }
 
-void xLoop() {
-	XEvent ev;
+/* Applies a changed (or, if settings is NULL, deleted) profile of the settings files to all
+   displays that don't preview it. Returns FALSE if everything has to be reloaded. */
+static int updateLoadedProfile(char * deviceName, DeviceSettings * settings) {
+	int i, s;
+	metrics.profileReloads++;
+	for(i = 0; i < nDisplays; i++) {
+		if(findProfile(&(displays[i]->previews), deviceName) != -1) continue;
+		for(s = 0; s < displays[i]->nScreens; s++) {
+			if(updateScreenProfile(&(displays[i]->screens[s]), deviceName, settings) == -1) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
 
-	int eventQueueDesc = XConnectionNumber(display);
+/* Called when the settings files may have changed. Only the profiles that differ from the
+   loaded ones are applied; usually gtouchsett has had its change applied already, so that
+   doesn't write anything. */
+void reloadChangedSettings() {
+	CacheSourceStamp stamps[CACHE_SOURCES];
+	getCacheSourceStats(stamps);
+	if(sameCacheSourceStats(stamps, loadedStamps)) {
+		if(debugMode) printf("Settings files unchanged\n");
+		return;
+	}
 
-	fd_set fds;
+	long long start = getMicroseconds();
+	beginApplyPass();
+	DeviceSettingsList fresh;
+	loadSettings(&fresh, NULL, NULL);
+
+	int complete = TRUE;
+	int p;
+	for(p = 0; complete && p < fresh.nDeviceSettings; p++) {
+		DeviceSettings * settings = &(fresh.deviceSettings[p]);
+		if(settings->inputDeviceName == NULL) continue;
+		int l = findProfile(&loadedProfiles, settings->inputDeviceName);
+		if(l == -1 || !sameProfile(settings, &(loadedProfiles.deviceSettings[l]))) {
+			if(debugMode) printf("Profile %s changed in the settings files\n", settings->inputDeviceName);
+			complete = updateLoadedProfile(settings->inputDeviceName, settings);
+		}
+	}
+	for(p = 0; complete && p < loadedProfiles.nDeviceSettings; p++) {
+		char * name = loadedProfiles.deviceSettings[p].inputDeviceName;
+		if(name != NULL && findProfile(&fresh, name) == -1) {
+			if(debugMode) printf("Profile %s deleted from the settings files\n", name);
+			complete = updateLoadedProfile(name, NULL);
+		}
+	}
 
-	// "break" the event loop to check for notification from the signals thread every 5 seconds
-	struct timeval interval;
-        interval.tv_usec = 0;
-        interval.tv_sec = 5;
+	freeSettings(&loadedProfiles);
+	loadedProfiles = fresh;
+	memcpy(loadedStamps, stamps, sizeof loadedStamps);
+	recordValue(&metrics.reloadTime, endApplyPass() - start);
 
-	/* main X event loop with 5 seconds "break" */
-	while (1) {
+	if(!complete) {
+		/* A device without profile isn't a touchscreen anymore */
+		reloadSettings();
+	}
+}
 
-		/* Create file descriptor set for X event access */
-		FD_ZERO(&fds);
-		FD_SET(eventQueueDesc, &fds);
+/* Keeps the settings of the request as preview of the display and applies them */
+void previewProfile(HelperDisplay * hd, ControlRequest * request) {
+	request->output[CONTROL_NAME_LENGTH - 1] = '\0';
+
+	DeviceSettings settings;
+	settings.inputDeviceName = request->name;
+	settings.attachedOutput = (request->output[0] != '\0' ? request->output : NULL);
+	settings.autoOutput = (request->autoOutput != 0);
+	settings.autoCalibration = (request->autoCalibration != 0);
+	settings.outputMinX = request->outputMinX;
+	settings.outputMaxX = request->outputMaxX;
+	settings.outputMinY = request->outputMinY;
+	settings.outputMaxY = request->outputMaxY;
+	settings.swapAxes = (request->swapAxes != 0);
+	settings.hasMatrix = (request->hasMatrix != 0);
+	memcpy(settings.matrix, request->matrix, sizeof settings.matrix);
+	int i;
+	for(i = 0; i < 6; i++) {
+		if(!isfinite(settings.matrix[i])) settings.hasMatrix = FALSE;
+	}
+	changeProfile(&(hd->previews), &settings);
 
-		select(eventQueueDesc+1, &fds, 0, 0, &interval);
+	reloadProfile(hd, request->name);
+}
 
-		if(updateSignalReceived)
-		{
-			/* We get a notification from the signals thread */
-			updateSignalReceived = FALSE;
-			if(debugMode) printf("Reload config due to signal\n");
-			freeSettings(&profiles);
-			loadSettings(&profiles, NULL, NULL);
-			handleDeviceChange();
-			XFlush(display);
+/* Every device is reported once: by the screen serving its profile, or by the
+   default screen if no screen does */
+static int reportsProfile(HelperScreen * s, DeviceSettings * profile) {
+	if(servesProfile(s, profile)) return TRUE;
+
+	HelperDisplay * hd = s->display;
+	if(s->screenNum != hd->defaultScreen) return FALSE;
+	int o;
+	for(o = 0; o < hd->nScreens; o++) {
+		int d = findProfile(&(hd->screens[o].profiles), profile->inputDeviceName);
+		if(o != s->screenNum && d != -1 && servesProfile(&(hd->screens[o]), &(hd->screens[o].profiles.deviceSettings[d]))) {
+			return FALSE;
 		}
+	}
+	return TRUE;
+}
 
-		/* Handle X events, if any */
-		while(XPending(display))
-		{
-			XNextEvent(display, &ev);
-	
-			if(ev.type == randrEvBase + RRScreenChangeNotify) {
-				/* RandR event */
-				handleDisplayChange((XRRScreenChangeNotifyEvent *) &ev);	
-			} else if(XGetEventData(display, &ev.xcookie)) {
-				/* XInput event */
-				if(ev.xcookie.evtype == XI_HierarchyChanged) {
-					if(debugMode) {
-						printf("XInput device change, reload devices.\n");
-					}
-					handleDeviceChange();
-					XFreeEventData(display, &ev.xcookie);
+/* Returns the number of devices of the display and their states in a newly allocated array */
+int collectDeviceStates(HelperDisplay * hd, ControlDeviceState ** states) {
+	int count = 0;
+	int s, d, id;
+	for(s = 0; s < hd->nScreens; s++) {
+		DeviceSettingsList * profiles = &(hd->screens[s].profiles);
+		for(d = 0; d < profiles->nDeviceSettings; d++) {
+			if(reportsProfile(&(hd->screens[s]), &(profiles->deviceSettings[d]))) {
+				count += profiles->deviceSettings[d].inputDeviceCount;
+			}
+		}
+	}
+
+	*states = calloc(count > 0 ? count : 1, sizeof(ControlDeviceState));
+	if(*states == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	int i = 0;
+	for(s = 0; s < hd->nScreens; s++) {
+		HelperScreen * screen = &(hd->screens[s]);
+		for(d = 0; d < screen->profiles.nDeviceSettings; d++) {
+			DeviceSettings *profile = &(screen->profiles.deviceSettings[d]);
+			if(!reportsProfile(screen, profile)) continue;
+
+			OutputState *output = NULL;
+			if(profile->attachedOutput != NULL || profile->autoOutput) {
+				output = getProfileOutput(screen, profile);
+			}
+			for(id = 0; id < profile->inputDeviceCount; id++, i++) {
+				int deviceID = profile->inputDeviceIDs[id];
+				(*states)[i].deviceId = deviceID;
+				strncpy((*states)[i].profile, profile->inputDeviceName, CONTROL_NAME_LENGTH - 1);
+				if(output != NULL) {
+					strncpy((*states)[i].output, output->name, CONTROL_NAME_LENGTH - 1);
+				} else if(profile->attachedOutput != NULL) {
+					strncpy((*states)[i].output, profile->attachedOutput, CONTROL_NAME_LENGTH - 1);
 				}
+				(*states)[i].autoOutput = profile->autoOutput;
+				(*states)[i].autoCalibration = profile->autoCalibration;
+				(*states)[i].outputMinX = profile->outputMinX;
+				(*states)[i].outputMaxX = profile->outputMaxX;
+				(*states)[i].outputMinY = profile->outputMinY;
+				(*states)[i].outputMaxY = profile->outputMaxY;
+				(*states)[i].swapAxes = profile->swapAxes;
+				(*states)[i].hasMatrix = profile->hasMatrix;
+				memcpy((*states)[i].matrix, profile->matrix, sizeof profile->matrix);
+				(*states)[i].applied = (deviceID >= 0 && deviceID < MAX_DEVICE_ID && screen->appliedStates[deviceID].valid);
+				(*states)[i].preview = (findProfile(&(hd->previews), profile->inputDeviceName) != -1);
 			}
 		}
 	}
+	return count;
+}
+
+void setupControlSocket(HelperDisplay * hd) {
+	hd->controlDesc = listenControlSocket(hd->name);
+	if(hd->controlDesc < 0) {
+		printf("Couldn't create control socket, is another helper running for display %s?\n", hd->name);
+	}
 }
 
+static void closeControlClient(ControlClient * client) {
+	close(client->desc);
+	client->desc = -1;
+}
+
+/* Accepts a new connection to the control socket of the display. Its request is read
+   when it arrives, see handleControlClient(). */
+void handleControlConnection(HelperDisplay * hd) {
+	int desc = accept4(hd->controlDesc, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if(desc < 0) return;
+
+	/* Only the user running the helper may control it */
+	struct ucred cred;
+	socklen_t credLength = sizeof cred;
+	if(getsockopt(desc, SOL_SOCKET, SO_PEERCRED, &cred, &credLength) < 0 || cred.uid != getuid()) {
+		close(desc);
+		return;
+	}
 
-void * signalThreadFunction(void *arg) {
-	int sig;
-	while(1) {
-		sigwait ( &signalSet, &sig );
-		/* Trigger update of profile settings */
-		updateSignalReceived = TRUE;
+	/* If all slots are taken, the client that has been waiting longest makes room */
+	ControlClient *client = &(hd->controlClients[0]);
+	int c;
+	for(c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+		if(hd->controlClients[c].desc < 0) {
+			client = &(hd->controlClients[c]);
+			break;
+		}
+		if(hd->controlClients[c].deadline < client->deadline) {
+			client = &(hd->controlClients[c]);
+		}
 	}
+	if(client->desc >= 0) {
+		if(debugMode) printf("Too many control clients, dropping the oldest\n");
+		closeControlClient(client);
+	}
+	client->desc = desc;
+	client->received = 0;
+	client->deadline = getMilliseconds() + CONTROL_CLIENT_TIMEOUT;
+
+	/* The request is usually there already */
+	handleControlClient(hd, client);
 }
 
+/* Drops the clients that haven't sent their request in time. Returns the earliest deadline
+   of the remaining ones, -1 if there are none. */
+long long expireControlClients(HelperDisplay * hd, long long now) {
+	long long next = -1;
+	int c;
+	for(c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+		ControlClient *client = &(hd->controlClients[c]);
+		if(client->desc < 0) continue;
+		if(now >= client->deadline) {
+			if(debugMode) printf("Control client didn't send its request in time\n");
+			closeControlClient(client);
+		} else if(next == -1 || client->deadline < next) {
+			next = client->deadline;
+		}
+	}
+	return next;
+}
 
-int main(int argc, char **argv) {
+/* Reads what the client has sent without waiting and handles its request once it is complete */
+void handleControlClient(HelperDisplay * hd, ControlClient * client) {
+	ssize_t n = recv(client->desc, ((char *) &(client->request)) + client->received,
+			sizeof client->request - client->received, MSG_DONTWAIT);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if(n <= 0) {
+		/* Closed before the request was complete */
+		closeControlClient(client);
+		return;
+	}
+	client->received += n;
+	if(client->received < sizeof client->request) {
+		return;
+	}
 
-	BOOL doDaemonize = TRUE;
+	ControlRequest request = client->request;
+	ControlReply reply;
+	ControlDeviceState *states = NULL;
+	void *data = NULL;
+	memset(&reply, 0, sizeof reply);
+	reply.magic = CONTROL_MAGIC;
+	reply.version = CONTROL_VERSION;
+	reply.status = CONTROL_OK;
+
+	metrics.controlRequests++;
+	/* Queries don't change anything, so they are no apply passes */
+	int applying = (request.request != CONTROL_QUERY_STATE && request.request != CONTROL_QUERY_METRICS);
+	if(applying) beginApplyPass();
+	long long start = getMicroseconds();
+	if(request.magic != CONTROL_MAGIC || request.version != CONTROL_VERSION) {
+		reply.status = CONTROL_ERROR_REQUEST;
+	} else {
+		request.name[CONTROL_NAME_LENGTH - 1] = '\0';
+		int d, s;
+		switch(request.request) {
+		case CONTROL_RELOAD_ALL:
+			if(debugMode) printf("Reload config due to control request\n");
+			freeSettings(&(hd->previews));
+			reloadSettings();
+			break;
+		case CONTROL_RELOAD_PROFILE:
+			if(debugMode) printf("Reload profile %s due to control request\n", request.name);
+			deleteProfile(&(hd->previews), request.name);
+			if(!reloadProfile(hd, request.name)) reply.status = CONTROL_ERROR_NOT_FOUND;
+			break;
+		case CONTROL_PREVIEW_PROFILE:
+			if(debugMode) printf("Preview settings for profile %s\n", request.name);
+			previewProfile(hd, &request);
+			break;
+		case CONTROL_APPLY_DEVICE:
+			reply.status = CONTROL_ERROR_NOT_FOUND;
+			/* Only the screen serving the profile of the device writes its properties */
+			for(s = 0; s < hd->nScreens; s++) {
+				d = findDeviceProfile(&(hd->screens[s]), request.deviceId);
+				if(d != -1) {
+					reply.status = CONTROL_OK;
+					invalidateAppliedState(&(hd->screens[s]), request.deviceId);
+					calibrateProfile(&(hd->screens[s]), d, request.deviceId);
+				}
+			}
+			break;
+		case CONTROL_QUERY_STATE:
+			reply.count = collectDeviceStates(hd, &states);
+			reply.size = reply.count * sizeof(ControlDeviceState);
+			data = states;
+			break;
+		case CONTROL_QUERY_METRICS:
+			metrics.uptime = getMicroseconds() - startTime;
+			reply.count = 1;
+			reply.size = sizeof metrics;
+			data = &metrics;
+			break;
+		default:
+			reply.status = CONTROL_ERROR_REQUEST;
+		}
+	}
+	/* Acknowledge only after the server has processed what we have written; the screens share the connection */
+	HelperScreen * screen = &(hd->screens[hd->defaultScreen]);
+	screen->backend->sync(screen->backend);
+	reply.latency = getMicroseconds() - start;
+	if(applying) endApplyPass();
+
+	/* The socket buffer takes the reply, so this doesn't wait for the client either */
+	if(send(client->desc, &reply, sizeof reply, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof reply && reply.size > 0) {
+		ssize_t r = send(client->desc, data, reply.size, MSG_NOSIGNAL | MSG_DONTWAIT);
+		r = r;
+	}
+	free(states);
+	closeControlClient(client);
+}
+
+/* Sends a single request to the helper running for the display and prints the reply */
+int runControlClient(char * displayName, int request, char * argument) {
+	ControlReply reply;
+	ControlDeviceState *states = NULL;
+	HelperMetrics helperMetrics;
+	int ok;
+	displayName = XDisplayName(displayName);
+
+	switch(request) {
+	case CONTROL_RELOAD_PROFILE:
+		ok = controlReloadProfile(displayName, argument, &reply);
+		break;
+	case CONTROL_APPLY_DEVICE:
+		ok = controlApplyDevice(displayName, strtol(argument, NULL, 0), &reply);
+		break;
+	case CONTROL_QUERY_STATE:
+		ok = controlQueryState(displayName, &reply, &states);
+		break;
+	case CONTROL_QUERY_METRICS:
+		ok = controlQueryMetrics(displayName, &reply, &helperMetrics);
+		if(ok) printMetrics(stdout, &helperMetrics);
+		break;
+	default:
+		ok = controlReloadAll(displayName, &reply);
+	}
+
+	if(reply.status == CONTROL_ERROR_CONNECT) {
+		fprintf(stderr, "No touchscreen-helper is running for display %s\n", displayName);
+		return 1;
+	} else if(reply.status == CONTROL_ERROR_NOT_FOUND) {
+		fprintf(stderr, "No such profile or device: %s\n", argument);
+		return 1;
+	} else if(!ok) {
+		fprintf(stderr, "Request failed with status %i\n", reply.status);
+		return 1;
+	}
 
 	int i;
-	for (i = 1; i < argc; i++) {
-		if (strcmp(argv[i], "--debug") == 0) {
-			doDaemonize = FALSE;
-			debugMode = TRUE;
+	for(i = 0; states != NULL && i < reply.count; i++) {
+		printf("%i\t%s\t%s\t", states[i].deviceId, states[i].profile,
+				states[i].output[0] != '\0' ? states[i].output : (states[i].autoOutput ? "(auto)" : "(screen)"));
+		if(states[i].autoCalibration) {
+			printf("auto");
+		} else {
+			printf("%i %i %i %i", states[i].outputMinX, states[i].outputMaxX, states[i].outputMinY, states[i].outputMaxY);
+		}
+		if(states[i].hasMatrix) {
+			printf("\tmatrix %g %g %g %g %g %g", states[i].matrix[0], states[i].matrix[1], states[i].matrix[2],
+					states[i].matrix[3], states[i].matrix[4], states[i].matrix[5]);
 		}
+		printf("%s%s%s\n", states[i].swapAxes ? "\tswapped" : "", states[i].preview ? "\tpreview" : "", states[i].applied ? "" : "\tnot applied");
+	}
+	free(states);
+
+	printf("OK (%i us)\n", reply.latency);
+	return 0;
+}
 
+void handleSignal() {
+	struct signalfd_siginfo info;
+	/* Several pending signals of the same kind are merged, so one read is enough */
+	if(read(signalDesc, &info, sizeof info) != sizeof info) {
+		return;
+	}
+	if(info.ssi_signo == SIGUSR1) {
+		if(debugMode) printf("Reload config due to signal\n");
+		reloadSettings();
 	}
+}
 
-	if (doDaemonize) {
-		daemonize();
+/* (Re)watches the file for writes; a new file, or one replaced by renaming, needs a new watch */
+static void watchConfigFile(ConfigWatch * watch) {
+	watch->fileWd = inotify_add_watch(inotifyDesc, watch->path, IN_CLOSE_WRITE);
+}
+
+/* Watches the directories of the settings files, so replacing a file by renaming is noticed, too */
+void setupConfigWatch() {
+	inotifyDesc = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotifyDesc < 0) {
+		printf("Couldn't watch configuration files, changes need SIGUSR1.\n");
+		return;
 	}
 
-	/* Connect to X server */
-	if ((display = XOpenDisplay((char *) NULL)) == NULL) {
-		fprintf(stderr, "Couldn't connect to X server\n");
-		exit(1);
+	char * files[CONFIG_WATCHES / 2] = { getPrivateFileName(), getGlobalFileName() };
+	int f;
+	for(f = 0; f < CONFIG_WATCHES / 2; f++) {
+		char * slash = strrchr(files[f], '/');
+		char * dir = (slash == files[f] ? strdup("/") : strndup(files[f], slash - files[f]));
+		int wd = inotify_add_watch(inotifyDesc, dir, IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+		if(wd < 0 && debugMode) {
+			printf("Couldn't watch %s\n", dir);
+		}
+		free(dir);
+
+		/* The file itself and its journal */
+		configWatches[f * 2].wd = wd;
+		configWatches[f * 2].name = strdup(slash + 1);
+		configWatches[f * 2].path = strdup(files[f]);
+		configWatches[f * 2 + 1].wd = wd;
+		configWatches[f * 2 + 1].name = malloc(strlen(slash + 1) + strlen(JOURNAL_FILE_SUFFIX) + 1);
+		strcpy(configWatches[f * 2 + 1].name, slash + 1);
+		strcat(configWatches[f * 2 + 1].name, JOURNAL_FILE_SUFFIX);
+		configWatches[f * 2 + 1].path = malloc(strlen(files[f]) + strlen(JOURNAL_FILE_SUFFIX) + 1);
+		strcpy(configWatches[f * 2 + 1].path, files[f]);
+		strcat(configWatches[f * 2 + 1].path, JOURNAL_FILE_SUFFIX);
+		watchConfigFile(&(configWatches[f * 2]));
+		watchConfigFile(&(configWatches[f * 2 + 1]));
+	}
+}
+
+void handleConfigWatch() {
+	char buffer[EVENT_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	int changed = FALSE;
+	ssize_t length;
+
+	/* Read all queued events, so one save results in one reload */
+	while((length = read(inotifyDesc, buffer, sizeof buffer)) > 0) {
+		char * p = buffer;
+		while(p < buffer + length) {
+			struct inotify_event * evt = (struct inotify_event *) p;
+			int w;
+			for(w = 0; w < CONFIG_WATCHES; w++) {
+				ConfigWatch * watch = &(configWatches[w]);
+				if(evt->len > 0 && evt->wd == watch->wd && !strcmp(evt->name, watch->name)) {
+					changed = TRUE;
+					if(evt->mask & (IN_CREATE | IN_MOVED_TO)) watchConfigFile(watch);
+				} else if(watch->fileWd != -1 && evt->wd == watch->fileWd) {
+					if(evt->mask & IN_IGNORED) {
+						/* Deleted or replaced */
+						watch->fileWd = -1;
+					} else {
+						changed = TRUE;
+					}
+				}
+			}
+			p += EVENT_SIZE + evt->len;
+		}
 	}
 
-	absXAtom = XInternAtom(display, "Abs X", FALSE);
-	absYAtom = XInternAtom(display, "Abs Y", FALSE);
-	absXAtomMT = XInternAtom(display, "Abs MT Position X", False);
-	absYAtomMT = XInternAtom(display, "Abs MT Position Y", False);
-	floatAtom = XInternAtom(display, "FLOAT", FALSE);
+	if(changed) {
+		if(debugMode) printf("Reload changed profiles due to changed file\n");
+		reloadChangedSettings();
+	}
+}
 
-	/* Read X data */
-	screenNum = DefaultScreen(display);
+/* Passes an event of the display on to the screen it concerns, or to all of them for device events */
+void handleXEvent(HelperDisplay * hd, XEvent * ev) {
+	HelperScreen * s;
+	int i;
 
-	root = RootWindow(display, screenNum);
+	if(ev->type == hd->randrEvBase + RRScreenChangeNotify) {
+		/* RandR event */
+		metrics.randrEvents++;
+		XRRUpdateConfiguration(ev);
+		XRRScreenChangeNotifyEvent * evt = (XRRScreenChangeNotifyEvent *) ev;
+		s = findScreen(hd, evt->root);
+		if(s != NULL) {
+			s->screenWidth = evt->width;
+			s->screenHeight = evt->height;
+			scheduleDisplayChange(s);
+		}
+	} else if(ev->type == hd->randrEvBase + RRNotify) {
+		metrics.randrEvents++;
+		s = findScreen(hd, ((XRRNotifyEvent *) ev)->window);
+		if(s != NULL) {
+			handleRandrNotify(s, (XRRNotifyEvent *) ev);
+		}
+	} else if(XGetEventData(hd->xdisplay, &ev->xcookie)) {
+		/* XInput event */
+		if(ev->xcookie.evtype == XI_HierarchyChanged) {
+			metrics.hierarchyEvents++;
+			int added = FALSE;
+			beginApplyPass();
+			for(i = 0; i < hd->nScreens; i++) {
+				added |= handleHierarchyChange(&(hd->screens[i]), (XIHierarchyEvent *) ev->xcookie.data);
+			}
+			long long now = endApplyPass();
+			if(added) {
+				recordValue(&metrics.hotplugLatency, now - lastWakeup);
+			}
+		} else if(ev->xcookie.evtype == XI_PropertyEvent) {
+			metrics.propertyEvents++;
+			for(i = 0; i < hd->nScreens; i++) {
+				handlePropertyChange(&(hd->screens[i]), (XIPropertyEvent *) ev->xcookie.data);
+			}
+		}
+		XFreeEventData(hd->xdisplay, &ev->xcookie);
+	}
+}
 
-	lastScreenWidth = DisplayWidth(display, screenNum);
-	lastScreenHeight = DisplayHeight(display, screenNum);
+/* X connection, control socket and control clients */
+#define FDS_PER_DISPLAY (2 + MAX_CONTROL_CLIENTS)
 
-	int opcode, error;
-	if (!XQueryExtension(display, "RANDR", &opcode, &randrEvBase,
-			&error)) {
-		printf("X RANDR extension not available.\n");
-		XCloseDisplay(display);
+void xLoop() {
+	XEvent ev;
+
+	/* Wait on the X connections, control sockets and control clients of all displays, the signal
+	   descriptor and the configuration watch only, so we don't wake up while idle. Displays are
+	   only removed. */
+	struct pollfd *fds = malloc((FDS_PER_DISPLAY * nDisplays + 2) * sizeof(struct pollfd));
+	if(fds == NULL) {
+		fprintf(stderr, "Out of memory.\n");
 		exit(1);
 	}
 
-	/* Which version of XRandR? We support 1.3 */
-	int major = 1, minor = 3;
-	if (!XRRQueryVersion(display, &major, &minor)) {
-		printf("XRandR version not available.\n");
-		XCloseDisplay(display);
-		exit(1);
-	} else if(!(major>1 || (major == 1 && minor >= 3))) {
-		printf("XRandR 1.3 not available. Server supports %d.%d\n", major, minor);
-		XCloseDisplay(display);
-		exit(1);
+	while (nDisplays > 0) {
+		int i, s;
+
+		for(i = 0; i < nDisplays; i++) {
+			for(s = 0; s < displays[i]->nScreens; s++) {
+				HelperScreen *screen = &(displays[i]->screens[s]);
+				if((screen->displayChangePending || screen->outputChangePending) && getMilliseconds() >= screen->displayChangeDeadline) {
+					handlePendingDisplayChange(screen);
+				}
+			}
+
+			/* Handle X events, if any. XPending() also flushes our requests. */
+			while(XPending(displays[i]->xdisplay))
+			{
+				XNextEvent(displays[i]->xdisplay, &ev);
+				handleXEvent(displays[i], &ev);
+			}
+		}
+
+		/* Only wake up by timeout if a display change is waiting to be applied or a control client is late */
+		int timeout = -1;
+		long long now = getMilliseconds();
+		for(i = 0; i < nDisplays; i++) {
+			for(s = 0; s < displays[i]->nScreens; s++) {
+				HelperScreen *screen = &(displays[i]->screens[s]);
+				if(screen->displayChangePending || screen->outputChangePending) {
+					long long remaining = screen->displayChangeDeadline - now;
+					if(remaining < 0) remaining = 0;
+					if(timeout == -1 || remaining < timeout) timeout = (int) remaining;
+				}
+			}
+			long long deadline = expireControlClients(displays[i], now);
+			if(deadline != -1 && (timeout == -1 || deadline - now < timeout)) {
+				timeout = (int) (deadline - now);
+			}
+		}
+
+		int nfds = 0;
+		for(i = 0; i < nDisplays; i++) {
+			fds[nfds].fd = XConnectionNumber(displays[i]->xdisplay);
+			fds[nfds++].events = POLLIN;
+			fds[nfds].fd = displays[i]->controlDesc;	/* Ignored by poll() if negative */
+			fds[nfds++].events = POLLIN;
+			int c;
+			for(c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+				fds[nfds].fd = displays[i]->controlClients[c].desc;
+				fds[nfds++].events = POLLIN;
+			}
+		}
+		fds[nfds].fd = signalDesc;
+		fds[nfds].events = POLLIN;
+		fds[nfds + 1].fd = inotifyDesc;
+		fds[nfds + 1].events = POLLIN;
+
+		if(poll(fds, nfds + 2, timeout) < 0) {
+			if(errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		lastWakeup = getMicroseconds();
+
+		/* Backwards, as removing a display moves the ones behind it */
+		for(i = nDisplays - 1; i >= 0; i--) {
+			struct pollfd *displayFds = &(fds[FDS_PER_DISPLAY * i]);
+			if(displayFds[0].revents & (POLLERR | POLLHUP)) {
+				/* Connection to X server lost; keep serving the other displays */
+				if(debugMode) printf("Connection to display %s lost\n", displays[i]->name);
+				removeDisplay(displays[i], FALSE);
+				continue;
+			}
+			/* Clients first, a new connection may take the slot of one */
+			int c;
+			for(c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+				ControlClient *client = &(displays[i]->controlClients[c]);
+				if(client->desc >= 0 && client->desc == displayFds[2 + c].fd && (displayFds[2 + c].revents & (POLLIN | POLLERR | POLLHUP))) {
+					handleControlClient(displays[i], client);
+				}
+			}
+			if(displayFds[1].revents & POLLIN) {
+				handleControlConnection(displays[i]);
+			}
+		}
+		if(fds[nfds].revents & POLLIN) {
+			handleSignal();
+		}
+		if(fds[nfds + 1].revents & POLLIN) {
+			handleConfigWatch();
+		}
 	}
+	free(fds);
+}
 
-	/* XInput Extension available? */
-	if (!XQueryExtension(display, "XInputExtension", &opcode, &xinputEvBase,
-			&error)) {
-		printf("X Input extension not available.\n");
-		XCloseDisplay(display);
-		exit(1);
+
+/* Property writes don't wait for a reply, so a device removed in the meantime shows up
+   as an asynchronous error here, which must not end the helper */
+static int handleXError(Display * xdisplay, XErrorEvent * error) {
+	metrics.applyFailures++;
+	if(debugMode) {
+		char text[256];
+		XGetErrorText(xdisplay, error->error_code, text, sizeof text);
+		printf("X error on display %s: %s (request %i.%i)\n", DisplayString(xdisplay), text, error->request_code, error->minor_code);
 	}
+	return 0;
+}
 
-	/* Which version of XI2? We support 2.0 */
-	major = 2; minor = 0;
-	if (XIQueryVersion(display, &major, &minor) == BadRequest) {
-		printf("XI2 not available. Server supports %d.%d\n", major, minor);
-		XCloseDisplay(display);
+int main(int argc, char **argv) {
+
+	BOOL doDaemonize = TRUE;
+	int controlRequest = 0;
+	char * controlArgument = NULL;
+	int benchmarkIterations = 0;
+	int roundTripLatency = 0, requestLatency = 0;
+	/* Displays given with --display; without any, the one of the environment is served */
+	char ** displayNames = malloc(argc * sizeof(char *));
+	int nDisplayNames = 0;
+	if(displayNames == NULL) {
+		fprintf(stderr, "Out of memory.\n");
 		exit(1);
 	}
-	
-	XRRSelectInput(display, root, RRScreenChangeNotifyMask | RROutputChangeNotifyMask | RROutputPropertyNotifyMask | RRCrtcChangeNotifyMask);
 
-	/* Register for XInput device change events */
-	XIEventMask eventmask;
-	unsigned char mask[2] = { 0, 0 }; /* the actual mask */
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--debug") == 0) {
+			doDaemonize = FALSE;
+			debugMode = TRUE;
+		} else if (strcmp(argv[i], "--display") == 0 && i + 1 < argc) {
+			displayNames[nDisplayNames++] = argv[++i];
+		} else if (strcmp(argv[i], "--settle-time") == 0 && i + 1 < argc) {
+			i++;
+			settleTime = strtol(argv[i], NULL, 0);
+			if(settleTime < 0) settleTime = 0;
+		} else if (strcmp(argv[i], "--reload") == 0) {
+			controlRequest = CONTROL_RELOAD_ALL;
+		} else if (strcmp(argv[i], "--reload-profile") == 0 && i + 1 < argc) {
+			controlRequest = CONTROL_RELOAD_PROFILE;
+			controlArgument = argv[++i];
+		} else if (strcmp(argv[i], "--apply") == 0 && i + 1 < argc) {
+			controlRequest = CONTROL_APPLY_DEVICE;
+			controlArgument = argv[++i];
+		} else if (strcmp(argv[i], "--query") == 0) {
+			controlRequest = CONTROL_QUERY_STATE;
+		} else if (strcmp(argv[i], "--metrics") == 0) {
+			controlRequest = CONTROL_QUERY_METRICS;
+		} else if (strcmp(argv[i], "--benchmark") == 0) {
+			benchmarkIterations = DEFAULT_BENCHMARK_ITERATIONS;
+			if(i + 1 < argc && isdigit((unsigned char) argv[i + 1][0])) {
+				benchmarkIterations = strtol(argv[++i], NULL, 0);
+			}
+		} else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+			roundTripLatency = strtol(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--request-latency") == 0 && i + 1 < argc) {
+			requestLatency = strtol(argv[++i], NULL, 0);
+		}
 
-	eventmask.deviceid = XIAllDevices;
-	eventmask.mask_len = sizeof(mask); /* always in bytes */
-	eventmask.mask = mask;
-	/* now set the mask */
-	XISetMask(mask, XI_HierarchyChanged);
+	}
+
+	/* Measure the apply pipeline without an X server */
+	if (benchmarkIterations > 0) {
+		free(displayNames);
+		return runBenchmark(benchmarkIterations, roundTripLatency, requestLatency);
+	}
 
-	/* select on the window */
-	XISelectEvents(display, root, &eventmask, 1);
+	/* Talk to the running helper instead of becoming one */
+	if (controlRequest != 0) {
+		int result = runControlClient(nDisplayNames > 0 ? displayNames[0] : NULL, controlRequest, controlArgument);
+		free(displayNames);
+		return result;
+	}
+
+	if (doDaemonize) {
+		daemonize();
+	}
 
-	loadSettings(&profiles, NULL, NULL);
+	if (nDisplayNames == 0) {
+		displayNames[nDisplayNames++] = NULL;
+	}
 
-	handleDeviceChange();
+	XSetErrorHandler(handleXError);
+
+	/* Connect to the X servers; every display is served with all of its screens */
+	for (i = 0; i < nDisplayNames; i++) {
+		HelperDisplay * hd = openDisplay(displayNames[i]);
+		if (hd == NULL) continue;
+
+		/* The same display under another name (e.g. ":0" and ":0.1") would share the control socket */
+		char * socketName = getControlSocketName(hd->name);
+		int d;
+		for (d = 0; d < nDisplays - 1 && socketName != NULL; d++) {
+			char * otherName = getControlSocketName(displays[d]->name);
+			int same = (otherName != NULL && !strcmp(socketName, otherName));
+			free(otherName);
+			if (same) {
+				printf("Display %s is already served.\n", hd->name);
+				removeDisplay(hd, TRUE);
+				break;
+			}
+		}
+		free(socketName);
+	}
+	free(displayNames);
 
+	if (nDisplays == 0) {
+		fprintf(stderr, "No display to serve\n");
+		exit(1);
+	}
+
+	/* Receive SIGUSR1 synchronously through a descriptor instead of a handler */
+	sigset_t signalSet;
 	sigemptyset(&signalSet);
 	sigaddset(&signalSet, SIGUSR1);
-	pthread_sigmask (SIG_BLOCK, &signalSet, NULL);
-	if(pthread_create(&signalThread, NULL, signalThreadFunction, NULL)) {
-		printf("Couldn't create signal thread.\n");
+	sigprocmask(SIG_BLOCK, &signalSet, NULL);
+	signalDesc = signalfd(-1, &signalSet, SFD_CLOEXEC);
+	if(signalDesc < 0) {
+		printf("Couldn't create signal descriptor.\n");
+		exit(1);
 	}
-	
+
+	startTime = lastWakeup = getMicroseconds();
+
+	setupConfigWatch();
+
+	/* The settings are parsed once, every screen gets a copy */
+	getCacheSourceStats(loadedStamps);
+	loadSettings(&loadedProfiles, NULL, NULL);
+
+	int s;
+	for (i = 0; i < nDisplays; i++) {
+		setupControlSocket(displays[i]);
+		for (s = 0; s < displays[i]->nScreens; s++) {
+			loadScreenProfiles(&(displays[i]->screens[s]));
+		}
+	}
+
 
 	xLoop();
 
-	freeSettings(&profiles);
+	while (nDisplays > 0) {
+		removeDisplay(displays[0], TRUE);
+	}
+	free(displays);
+	freeSettings(&loadedProfiles);
 
-	XCloseDisplay(display);
+	close(signalDesc);
+	if(inotifyDesc >= 0) close(inotifyDesc);
 	return 0;	
 
 }
-
@@ -24,14 +24,169 @@
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/XInput2.h>
 #include <X11/extensions/XInput.h>
+#include "profiles.h"
+#include "outputs.h"
+#include "control.h"
+#include "atoms.h"
+#include "backend.h"
+#include "affine.h"
 
 #define FALSE 0
 #define TRUE 1
 
+/* Default settle time for bursts of RandR events in milliseconds */
+#define DEFAULT_SETTLE_TIME 50
+
+/* The private and global settings files and their journals are watched */
+#define CONFIG_WATCHES 4
+
+/* The directory only reports files being created, renamed or deleted, writes are reported
+   by a watch on the file itself; a watch on the directory would report writes to any file in it */
+typedef struct _ConfigWatch {
+	int wd;		/* Watch of the directory containing the file */
+	int fileWd;	/* Watch of the file, -1 while it doesn't exist */
+	char * name;
+	char * path;
+} ConfigWatch;
+
+/* Milliseconds a control client may take to send its request */
+#define CONTROL_CLIENT_TIMEOUT 200
+/* Control clients per display whose requests are being received */
+#define MAX_CONTROL_CLIENTS 8
+
+/* Connection to the control socket whose request hasn't arrived completely. It is
+   read whenever poll() reports data, so a slow client doesn't hold up the others. */
+typedef struct _ControlClient {
+	int desc;		/* -1 if the slot is free */
+	size_t received;	/* Bytes of the request received so far */
+	long long deadline;	/* In milliseconds; the client is dropped if the request isn't complete by then */
+	ControlRequest request;
+} ControlClient;
+
+/* Device IDs up to this value have their applied calibration cached */
+#define MAX_DEVICE_ID 256
+
+/* Calibration last written to a device, and the properties it has */
+typedef struct _AppliedState {
+	int valid;
+	int probed;		/* capabilities are known */
+	int capabilities;	/* DEVICE_CAP_* flags, probed once when the device appears */
+	int axisMinX;		/* Ranges of the absolute axes, set when the device is attached */
+	int axisMaxX;
+	int axisMinY;
+	int axisMaxY;
+	CalibrationProperties applied;
+	unsigned long ownSerialFirst;
+	unsigned long ownSerialLast;
+} AppliedState;
+
+/* Output rectangles (relative to the screen) whose transformation matrices are kept */
+#define TRANSFORM_CACHE_SIZE 4
+
+/* Matrices of all orientations for one output rectangle */
+typedef struct _TransformCache {
+	int valid;
+	float x;
+	float y;
+	float width;
+	float height;
+	AffineMatrix matrices[AFFINE_ORIENTATIONS];
+} TransformCache;
+
+struct _HelperDisplay;
+
+/* State of one X screen the helper manages. Every screen has its own copy of the
+   profiles, as the devices are attached and resolved against its outputs. */
+typedef struct _HelperScreen {
+	struct _HelperDisplay * display;
+	int screenNum;
+	Window root;
+	int screenWidth;
+	int screenHeight;
+
+	int displayChangePending;
+	/* Set if only outputs have changed that are already updated in the snapshot */
+	int outputChangePending;
+	long long displayChangeDeadline;
+	unsigned long lastLayoutFingerprint;
+	/* First event of the pending display change, for the metrics */
+	long long displayEventTime;
+
+	DeviceSettingsList profiles;
+	OutputSnapshot outputSnapshot;
+	/* Last calibration written to each device, indexed by device ID */
+	AppliedState appliedStates[MAX_DEVICE_ID];
+	TransformCache transformCache[TRANSFORM_CACHE_SIZE];
+	int nextTransformCache;
+
+	/* Queries the screen and writes device properties */
+	Backend * backend;
+} HelperScreen;
+
+/* State of one display connection. Input devices belong to the display, so
+   device events are passed to all of its screens. */
+typedef struct _HelperDisplay {
+	char * name;
+	Display * xdisplay;	/* NULL for the benchmark */
+	int randrEvBase;
+	int xinputEvBase;
+	Atom atoms[ATOM_COUNT];
+	/* Listening socket for requests of gtouchsett and scripts */
+	int controlDesc;
+	ControlClient controlClients[MAX_CONTROL_CLIENTS];
+	/* Unsaved settings sent by gtouchsett; they override the loaded profiles until dropped */
+	DeviceSettingsList previews;
+	HelperScreen * screens;
+	int nScreens;
+	/* Profiles not attached to an output are only applied on this screen */
+	int defaultScreen;
+} HelperDisplay;
+
+long long getMilliseconds();
+long long getMicroseconds();
+void beginApplyPass();
+long long endApplyPass();
 void swap(int*, int*);
-void handleDeviceChange();
-void handleDisplayChange(XRRScreenChangeNotifyEvent *);
+HelperDisplay * addDisplay(Display *, int);
+void removeDisplay(HelperDisplay *, int);
+HelperDisplay * openDisplay(char *);
+HelperScreen * findScreen(HelperDisplay *, Window);
+void invalidateAppliedState(HelperScreen *, int);
+void invalidateAllAppliedStates(HelperScreen *);
+void forgetDevice(HelperScreen *, int);
+void forgetAllDevices(HelperScreen *);
+OutputState * getProfileOutput(HelperScreen *, DeviceSettings *);
+int servesProfile(HelperScreen *, DeviceSettings *);
+void calibrateProfile(HelperScreen *, int, int);
+void calibrateAllProfiles(HelperScreen *);
+int refreshOutputSnapshot(HelperScreen *);
+void handleDisplayChange(HelperScreen *);
+void handleRandrNotify(HelperScreen *, XRRNotifyEvent *);
+void scheduleDisplayChange(HelperScreen *);
+void handlePendingDisplayChange(HelperScreen *);
+int attachDevice(HelperScreen *, XIDeviceInfo *);
+int findDeviceProfile(HelperScreen *, int);
+void detachDevice(HelperScreen *, int);
+void handleDeviceChange(HelperScreen *);
+void handleDeviceAdded(HelperScreen *, int);
+void handlePropertyChange(HelperScreen *, XIPropertyEvent *);
+int handleHierarchyChange(HelperScreen *, XIHierarchyEvent *);
+void loadScreenProfiles(HelperScreen *);
+void reloadSettings();
+void reloadChangedSettings();
+int reloadProfile(HelperDisplay *, char *);
+void previewProfile(HelperDisplay *, ControlRequest *);
+int collectDeviceStates(HelperDisplay *, ControlDeviceState **);
+void setupControlSocket(HelperDisplay *);
+void handleControlConnection(HelperDisplay *);
+void handleControlClient(HelperDisplay *, ControlClient *);
+long long expireControlClients(HelperDisplay *, long long);
+int runControlClient(char *, int, char *);
+void handleSignal();
+void setupConfigWatch();
+void handleConfigWatch();
+void handleXEvent(HelperDisplay *, XEvent *);
 void xLoop();
-void setAutoCalibrationData(int d, XIDeviceInfo * deviceInfo);
+void setAutoCalibrationData(HelperScreen *, int, XIDeviceInfo *);
 
 #endif /* TOUCHSCREEN_HELPER_H_ */
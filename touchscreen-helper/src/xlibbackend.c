@@ -0,0 +1,162 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xinput.h>
+#include "backend.h"
+#include "atoms.h"
+
+typedef struct _XlibBackendData {
+	Display * display;
+	Window root;
+	Atom * atoms;		/* Atoms of the display */
+} XlibBackendData;
+
+#define DISPLAY(backend) (((XlibBackendData *) (backend)->data)->display)
+#define ATOM(backend, a) (((XlibBackendData *) (backend)->data)->atoms[a])
+
+static void xlibTakeOutputSnapshot(Backend * backend, OutputSnapshot * snapshot) {
+	XlibBackendData *data = backend->data;
+	takeOutputSnapshot(data->display, data->root, snapshot);
+	/* The resources, then all CRTCs and outputs together */
+	backend->roundTrips += 2;
+}
+
+static XIDeviceInfo * xlibQueryDevices(Backend * backend, int deviceID, int * n) {
+	backend->roundTrips++;
+	return XIQueryDevice(DISPLAY(backend), deviceID, n);
+}
+
+static void xlibFreeDevices(Backend * backend, XIDeviceInfo * info) {
+	XIFreeDeviceInfo(info);
+}
+
+/* The property lists of all devices are requested before the first reply is read */
+static void xlibProbeCapabilities(Backend * backend, const int * deviceIDs, int n, int * results) {
+	if(n == 0) return;
+	xcb_connection_t *conn = XGetXCBConnection(DISPLAY(backend));
+	xcb_input_xi_list_properties_cookie_t *cookies = malloc(sizeof(xcb_input_xi_list_properties_cookie_t) * n);
+	if(cookies == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	int i;
+	for(i = 0; i < n; i++) {
+		cookies[i] = xcb_input_xi_list_properties(conn, deviceIDs[i]);
+	}
+	backend->roundTrips++;
+	for(i = 0; i < n; i++) {
+		/* An error only means the device has gone, it must not reach the error handler */
+		xcb_generic_error_t *error = NULL;
+		xcb_input_xi_list_properties_reply_t *reply = xcb_input_xi_list_properties_reply(conn, cookies[i], &error);
+		results[i] = 0;
+		if(reply != NULL) {
+			xcb_atom_t *properties = xcb_input_xi_list_properties_properties(reply);
+			int count = xcb_input_xi_list_properties_properties_length(reply);
+			int p;
+			for(p = 0; p < count; p++) {
+				if(properties[p] == ATOM(backend, ATOM_TRANSFORMATION_MATRIX)) results[i] |= DEVICE_CAP_MATRIX;
+				else if(properties[p] == ATOM(backend, ATOM_EVDEV_AXIS_CALIBRATION)) results[i] |= DEVICE_CAP_EVDEV_CALIBRATION;
+				else if(properties[p] == ATOM(backend, ATOM_EVDEV_AXIS_INVERSION)) results[i] |= DEVICE_CAP_EVDEV_INVERSION;
+				else if(properties[p] == ATOM(backend, ATOM_EVDEV_AXES_SWAP)) results[i] |= DEVICE_CAP_EVDEV_SWAP;
+				else if(properties[p] == ATOM(backend, ATOM_LIBINPUT_CALIBRATION_MATRIX)) results[i] |= DEVICE_CAP_LIBINPUT_MATRIX;
+			}
+		}
+		free(reply);
+		free(error);
+	}
+	free(cookies);
+}
+
+/* XI2 addresses the device by its ID, so unlike with XOpenDevice() nothing waits for a reply.
+   If the device has been removed meanwhile, the error arrives at the error handler later. */
+static int xlibWriteCalibration(Backend * backend, int deviceID, int properties, const CalibrationProperties * values) {
+	Display *display = DISPLAY(backend);
+
+	if(properties & DEVICE_CAP_MATRIX) {
+		XIChangeProperty(display, deviceID, ATOM(backend, ATOM_TRANSFORMATION_MATRIX), ATOM(backend, ATOM_FLOAT), 32, PropModeReplace, (unsigned char*) values->matrix, 9);
+	}
+
+	if(properties & DEVICE_CAP_EVDEV_CALIBRATION) {
+		/* Format 32 data is passed as 32 bit values to XIChangeProperty(), not as longs */
+		int32_t calib32[] = { values->calib[0], values->calib[1], values->calib[2], values->calib[3] };
+		XIChangeProperty(display, deviceID, ATOM(backend, ATOM_EVDEV_AXIS_CALIBRATION), XA_INTEGER, 32, PropModeReplace, (unsigned char*) calib32, 4);
+	}
+
+	if(properties & DEVICE_CAP_EVDEV_INVERSION) {
+		XIChangeProperty(display, deviceID, ATOM(backend, ATOM_EVDEV_AXIS_INVERSION), XA_INTEGER, 8, PropModeReplace, (unsigned char*) values->flip, 2);
+	}
+
+	if(properties & DEVICE_CAP_EVDEV_SWAP) {
+		XIChangeProperty(display, deviceID, ATOM(backend, ATOM_EVDEV_AXES_SWAP), XA_INTEGER, 8, PropModeReplace, (unsigned char*) &(values->axesSwap), 1);
+	}
+
+	if(properties & DEVICE_CAP_LIBINPUT_MATRIX) {
+		XIChangeProperty(display, deviceID, ATOM(backend, ATOM_LIBINPUT_CALIBRATION_MATRIX), ATOM(backend, ATOM_FLOAT), 32, PropModeReplace, (unsigned char*) values->libinputMatrix, 9);
+	}
+
+	return 1;
+}
+
+static unsigned long xlibNextRequest(Backend * backend) {
+	return NextRequest(DISPLAY(backend));
+}
+
+static void xlibFence(Backend * backend) {
+	XNoOp(DISPLAY(backend));
+}
+
+static void xlibSync(Backend * backend) {
+	backend->roundTrips++;
+	XSync(DISPLAY(backend), False);
+}
+
+static void xlibDestroy(Backend * backend) {
+	free(backend->data);
+	free(backend);
+}
+
+Backend * createXlibBackend(Display * display, Window root, Atom * atoms) {
+	Backend *backend = malloc(sizeof(Backend));
+	XlibBackendData *data = malloc(sizeof(XlibBackendData));
+	if(backend == NULL || data == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	data->display = display;
+	data->root = root;
+	data->atoms = atoms;
+
+	backend->name = "xlib";
+	backend->data = data;
+	backend->roundTrips = 0;
+	backend->takeOutputSnapshot = xlibTakeOutputSnapshot;
+	backend->queryDevices = xlibQueryDevices;
+	backend->freeDevices = xlibFreeDevices;
+	backend->probeCapabilities = xlibProbeCapabilities;
+	backend->writeCalibration = xlibWriteCalibration;
+	backend->nextRequest = xlibNextRequest;
+	backend->fence = xlibFence;
+	backend->sync = xlibSync;
+	backend->destroy = xlibDestroy;
+	return backend;
+}
@@ -0,0 +1,342 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Checks the matrices of affine.h against the code they replaced: the hand-coded matrix
+   of setCalibration() and the way evdev applies its calibration properties, and the least
+   squares fit of the calibrator against known matrices. */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "../src/affine.h"
+
+#define EPSILON 1e-5
+
+static int failures = 0;
+static int checks = 0;
+
+static void fail(const char * what, int rotation, const char * detail) {
+	failures++;
+	printf("FAIL: %s, rotation 0x%02x: %s\n", what, rotation, detail);
+}
+
+static int nearlyEqual(double a, double b, double epsilon) {
+	return fabs(a - b) <= epsilon;
+}
+
+static int sameMatrix(const float * a, const float * b, double epsilon) {
+	int i;
+	for(i = 0; i < 9; i++) {
+		if(!nearlyEqual(a[i], b[i], epsilon)) return 0;
+	}
+	return 1;
+}
+
+static void printMatrix(const char * name, const float * m) {
+	printf("  %s: %g %g %g / %g %g %g / %g %g %g\n", name, m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8]);
+}
+
+/* The matrix setCalibration() built element by element before affine.h existed */
+static void baselineMatrix(float * matrix, int rotation, int outputX, int outputY, int outputWidth, int outputHeight, int screenWidth, int screenHeight) {
+	float identity[] = { 1., 0., 0.,
+	                     0., 1., 0.,
+	                     0., 0., 1. };
+	memcpy(matrix, identity, sizeof identity);
+
+	/* Output rotation */
+	if(rotation & AFFINE_ROTATE_180) {
+		matrix[0] = -1.;
+		matrix[4] = -1;
+		matrix[2] = 1.;
+		matrix[5] = 1.;
+	} else if(rotation & AFFINE_ROTATE_90) {
+		matrix[0] = 0.;
+		matrix[1] = -1.;
+		matrix[3] = 1.;
+		matrix[4] = 0.;
+
+		matrix[2] = 1.;
+	} else if(rotation & AFFINE_ROTATE_270) {
+		matrix[0] = 0.;
+		matrix[1] = 1.;
+		matrix[3] = -1.;
+		matrix[4] = 0.;
+
+		matrix[5] = 1.;
+	}
+
+	/* Output Reflection */
+	if(rotation & AFFINE_REFLECT_X) {
+		matrix[0]*= -1.;
+		matrix[1]*= -1.;
+		matrix[2]*= -1.;
+		matrix[2]+= 1.;
+	}
+	if(rotation & AFFINE_REFLECT_Y) {
+		matrix[3]*= -1.;
+		matrix[4]*= -1.;
+		matrix[5]*= -1.;
+		matrix[5]+= 1.;
+	}
+
+	/* Output Size */
+	float widthRel = outputWidth / (float) screenWidth;
+	float heightRel = outputHeight / (float) screenHeight;
+	matrix[0] *= widthRel;
+	matrix[1] *= widthRel;
+	matrix[2] *= widthRel;
+	matrix[3] *= heightRel;
+	matrix[4] *= heightRel;
+	matrix[5] *= heightRel;
+
+	/* Output Position */
+	matrix[2] += outputX / (float) screenWidth;
+	matrix[5] += outputY / (float) screenHeight;
+}
+
+/* Inversion and swapping of the legacy method of setCalibration() for an output orientation */
+static void legacyFlags(int rotation, int swapAxes, int * flipHoriz, int * flipVerti, int * axesSwap) {
+	*flipHoriz = 0;
+	*flipVerti = 0;
+	*axesSwap = swapAxes;
+	if(rotation & AFFINE_ROTATE_180) {
+		*flipHoriz = !*flipHoriz;
+		*flipVerti = !*flipVerti;
+	} else if(rotation & AFFINE_ROTATE_90) {
+		*flipVerti = !*flipVerti;
+		*axesSwap = !*axesSwap;
+	} else if(rotation & AFFINE_ROTATE_270) {
+		*flipHoriz = !*flipHoriz;
+		*axesSwap = !*axesSwap;
+	}
+	if(rotation & AFFINE_REFLECT_X) *flipHoriz = !*flipHoriz;
+	if(rotation & AFFINE_REFLECT_Y) *flipVerti = !*flipVerti;
+}
+
+/* What evdev does with a raw position: swap, scale the calibration range onto the axis range,
+   invert. The result is relative to the axis ranges, as the X server passes it on. */
+static void evdevTransform(double x, double y, int minX, int maxX, int minY, int maxY,
+		int calibMinX, int calibMaxX, int calibMinY, int calibMaxY, int axesSwap, int invertX, int invertY,
+		double * outX, double * outY) {
+	if(axesSwap) {
+		double t = x;
+		x = y;
+		y = t;
+	}
+	/* After swapping, the calibration of X applies to the value from the Y axis */
+	x = (x - calibMinX) * (maxX - minX) / (double) (calibMaxX - calibMinX) + minX;
+	y = (y - calibMinY) * (maxY - minY) / (double) (calibMaxY - calibMinY) + minY;
+	if(invertX) x = maxX - x + minX;
+	if(invertY) y = maxY - y + minY;
+	*outX = (x - minX) / (double) (maxX - minX);
+	*outY = (y - minY) / (double) (maxY - minY);
+}
+
+static const int geometries[][6] = {
+	/* outputX, outputY, outputWidth, outputHeight, screenWidth, screenHeight */
+	{ 0, 0, 1024, 768, 1024, 768 },
+	{ 0, 0, 1280, 800, 3200, 1080 },
+	{ 1280, 0, 1920, 1080, 3200, 1080 },
+	{ 1280, 0, 1080, 1920, 2360, 1920 },
+	{ 333, 77, 801, 599, 1366, 1024 },
+};
+#define N_GEOMETRIES (sizeof geometries / sizeof geometries[0])
+
+static const int calibrations[][4] = {
+	/* calibMinX, calibMaxX, calibMinY, calibMaxY */
+	{ 0, 4095, 0, 4095 },
+	{ 100, 3995, 120, 3975 },
+	{ 3900, 210, 3850, 180 },
+	{ -500, 4600, 17, 2020 },
+};
+#define N_CALIBRATIONS (sizeof calibrations / sizeof calibrations[0])
+
+static void testOrientationAndPlacement() {
+	int g, o;
+	for(g = 0; g < N_GEOMETRIES; g++) {
+		const int *geo = geometries[g];
+		float x = geo[0] / (float) geo[4], y = geo[1] / (float) geo[5];
+		float width = geo[2] / (float) geo[4], height = geo[3] / (float) geo[5];
+		for(o = 0; o < AFFINE_ORIENTATIONS; o++) {
+			int rotation = affineOrientationFromIndex(o);
+			checks++;
+			if(affineOrientationIndex(rotation) != o) {
+				fail("orientation index", rotation, "doesn't round-trip");
+			}
+
+			float expected[9];
+			baselineMatrix(expected, rotation, geo[0], geo[1], geo[2], geo[3], geo[4], geo[5]);
+			AffineMatrix m = affineMultiply(affinePlacement(x, y, width, height), affineOrientation(rotation));
+			checks++;
+			if(!sameMatrix(m.m, expected, EPSILON)) {
+				fail("placement * orientation", rotation, "differs from the hand-coded matrix");
+				printMatrix("expected", expected);
+				printMatrix("got", m.m);
+			}
+		}
+	}
+}
+
+static void testAxisCalibration() {
+	/* Axis ranges that differ, so swapping the wrong range shows */
+	const int minX = 0, maxX = 4095, minY = 50, maxY = 2047;
+	const double points[][2] = { { 0., 0. }, { 1., 0. }, { 0., 1. }, { 1., 1. }, { .5, .5 }, { .25, .8 }, { .9, .1 } };
+	int c, o, swapAxes, p;
+	for(c = 0; c < N_CALIBRATIONS; c++) {
+		const int *calib = calibrations[c];
+		for(o = 0; o < AFFINE_ORIENTATIONS; o++) {
+			int rotation = affineOrientationFromIndex(o);
+			for(swapAxes = 0; swapAxes <= 1; swapAxes++) {
+				int flipHoriz, flipVerti, axesSwap;
+				legacyFlags(rotation, swapAxes, &flipHoriz, &flipVerti, &axesSwap);
+				AffineMatrix m = affineAxisCalibration(minX, maxX, minY, maxY, calib[0], calib[1], calib[2], calib[3],
+						axesSwap, flipHoriz, flipVerti);
+				for(p = 0; p < sizeof points / sizeof points[0]; p++) {
+					double rawX = minX + points[p][0] * (maxX - minX);
+					double rawY = minY + points[p][1] * (maxY - minY);
+					double expectedX, expectedY;
+					evdevTransform(rawX, rawY, minX, maxX, minY, maxY, calib[0], calib[1], calib[2], calib[3],
+							axesSwap, flipHoriz, flipVerti, &expectedX, &expectedY);
+					float gotX, gotY;
+					affineApply(&m, points[p][0], points[p][1], &gotX, &gotY);
+					checks++;
+					if(!nearlyEqual(gotX, expectedX, 1e-4) || !nearlyEqual(gotY, expectedY, 1e-4)) {
+						char detail[160];
+						snprintf(detail, sizeof detail, "swap %i, (%g, %g) maps to (%g, %g) instead of (%g, %g)",
+								swapAxes, points[p][0], points[p][1], gotX, gotY, expectedX, expectedY);
+						fail("axis calibration", rotation, detail);
+					}
+				}
+			}
+		}
+	}
+}
+
+static void testInverse() {
+	AffineMatrix identity = affineIdentity();
+	int g, c, o;
+	for(g = 0; g < N_GEOMETRIES; g++) {
+		const int *geo = geometries[g];
+		AffineMatrix placement = affinePlacement(geo[0] / (float) geo[4], geo[1] / (float) geo[5], geo[2] / (float) geo[4], geo[3] / (float) geo[5]);
+		for(c = 0; c < N_CALIBRATIONS; c++) {
+			const int *calib = calibrations[c];
+			for(o = 0; o < AFFINE_ORIENTATIONS; o++) {
+				int rotation = affineOrientationFromIndex(o);
+				AffineMatrix a = affineMultiply(placement, affineOrientation(rotation));
+				AffineMatrix b = affineAxisCalibration(0, 4095, 0, 4095, calib[0], calib[1], calib[2], calib[3],
+						o & 1, (o >> 1) & 1, (o >> 2) & 1);
+				AffineMatrix product = affineMultiply(a, b);
+
+				AffineMatrix inverse, inverseA, inverseB;
+				checks++;
+				if(!affineInvert(product, &inverse) || !affineInvert(a, &inverseA) || !affineInvert(b, &inverseB)) {
+					fail("inverse", rotation, "regular matrix reported as singular");
+					continue;
+				}
+				checks++;
+				if(!sameMatrix(affineMultiply(inverse, product).m, identity.m, EPSILON)
+						|| !sameMatrix(affineMultiply(product, inverse).m, identity.m, EPSILON)) {
+					fail("inverse", rotation, "doesn't round-trip");
+					printMatrix("product", product.m);
+					printMatrix("inverse", inverse.m);
+				}
+				checks++;
+				if(!sameMatrix(inverse.m, affineMultiply(inverseB, inverseA).m, 1e-3)) {
+					fail("inverse", rotation, "inverse of the product isn't the product of the inverses");
+				}
+			}
+		}
+	}
+
+	AffineMatrix singular = affineMatrix(1., 2., 3., 2., 4., 5.);
+	AffineMatrix unused;
+	checks++;
+	if(affineInvert(singular, &unused)) {
+		fail("inverse", 0, "singular matrix reported as regular");
+	}
+	checks++;
+	if(!sameMatrix(unused.m, identity.m, 0.)) {
+		fail("inverse", 0, "result of a singular matrix isn't the identity");
+	}
+}
+
+/* Taps on a grid of targets like the calibrator's, made from a known matrix, must give back that
+   matrix with no residuals, whatever the number of points */
+static void testSolve() {
+	AffineMatrix skew = affineMatrix(1.02, -0.0031, -0.012, 0.0027, 0.98, 0.0095);
+	float fromX[25], fromY[25], toX[25], toY[25], residuals[25];
+	int size, o, i;
+	for(size = 2; size <= 5; size++) {
+		int n = size * size;
+		for(o = 0; o < AFFINE_ORIENTATIONS; o++) {
+			int rotation = affineOrientationFromIndex(o);
+			AffineMatrix expected = affineMultiply(affineOrientation(rotation), skew);
+			AffineMatrix inverse, result;
+			checks++;
+			if(!affineInvert(expected, &inverse)) {
+				fail("solve", rotation, "regular matrix reported as singular");
+				continue;
+			}
+			for(i = 0; i < n; i++) {
+				toX[i] = (i % size + .5f) / size;
+				toY[i] = (i / size + .5f) / size;
+				affineApply(&inverse, toX[i], toY[i], &fromX[i], &fromY[i]);
+			}
+			checks++;
+			if(!affineSolve(fromX, fromY, toX, toY, n, &result, residuals)) {
+				fail("solve", rotation, "grid of taps reported as degenerate");
+				continue;
+			}
+			checks++;
+			if(!sameMatrix(result.m, expected.m, EPSILON)) {
+				fail("solve", rotation, "doesn't recover the matrix");
+				printMatrix("expected", expected.m);
+				printMatrix("result", result.m);
+			}
+			for(i = 0; i < n; i++) {
+				checks++;
+				if(residuals[i] > EPSILON) {
+					fail("solve", rotation, "residual of an exact tap");
+				}
+			}
+		}
+	}
+
+	/* Taps on a line don't determine the matrix, and neither do two */
+	for(i = 0; i < 4; i++) {
+		fromX[i] = toX[i] = i;
+		fromY[i] = toY[i] = 2 * i;
+	}
+	AffineMatrix unused;
+	checks++;
+	if(affineSolve(fromX, fromY, toX, toY, 4, &unused, NULL)) {
+		fail("solve", 0, "collinear taps reported as regular");
+	}
+	checks++;
+	if(affineSolve(fromX, fromY, toX, toY, 2, &unused, NULL)) {
+		fail("solve", 0, "two taps accepted");
+	}
+}
+
+int main(int argc, char ** argv) {
+	testOrientationAndPlacement();
+	testAxisCalibration();
+	testInverse();
+	testSolve();
+
+	printf("affinetest: %i checks, %i failures\n", checks, failures);
+	return failures > 0;
+}
@@ -0,0 +1,180 @@
+/*
+ Copyright (C) 2010, Philipp Merkel <linux@philmerk.de>
+
+ Permission to use, copy, modify, and/or distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+
+ THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Runs the profile parser over the corpus in tests/corpus. Each case is a settings file
+   <case> with an optional journal <case>.journal; the profiles they give, written back as
+   a settings file, must equal <case>.expected. Every prefix of both files is parsed as well,
+   as a settings file and as a journal, like a file that is cut off while it is written.
+   Build with -fsanitize=address to catch what doesn't crash by itself. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../src/profiles.h"
+
+/* Files up to this size are parsed at every length, larger ones at some */
+#define ALL_PREFIXES_SIZE 4096
+
+static int failures = 0;
+
+static char * readFile(const char * fileName, size_t * out_size) {
+	FILE * f = fopen(fileName, "rb");
+	if(f == NULL) return NULL;
+	char * buffer = NULL;
+	size_t size = 0, space = 0;
+	while(1) {
+		if(size == space) {
+			space = (space == 0 ? 4096 : space * 2);
+			buffer = realloc(buffer, space + 1);
+			if(buffer == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
+			}
+		}
+		size_t n = fread(buffer + size, 1, space - size, f);
+		if(n == 0) break;
+		size += n;
+	}
+	fclose(f);
+	buffer[size] = 0;
+	*out_size = size;
+	return buffer;
+}
+
+/* Loads the case like the helper does and writes the profiles back as a settings file */
+static char * loadAndWrite(char * fileName, const char * outputName, size_t * out_size) {
+	DeviceSettingsList list;
+	memset(&list, 0, sizeof list);
+	if(!addDeviceSettingsFromFile(fileName, &list, NULL)) {
+		freeSettings(&list);
+		return NULL;
+	}
+	unlink(outputName);
+	int saved = saveDeviceSettingsToFile((char *) outputName, &list);
+	freeSettings(&list);
+	return saved ? readFile(outputName, out_size) : NULL;
+}
+
+static void parsePrefixes(char * fileName, const char * text, size_t size) {
+	char * buffer = malloc(size + 1);
+	if(buffer == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	size_t step = (size <= ALL_PREFIXES_SIZE ? 1 : size / ALL_PREFIXES_SIZE + 1);
+	size_t length;
+	int isJournal;
+	for(length = 0; ; length += step) {
+		if(length > size) length = size;
+		for(isJournal = 0; isJournal <= 1; isJournal++) {
+			DeviceSettingsList list;
+			memset(&list, 0, sizeof list);
+			memcpy(buffer, text, length);
+			buffer[length] = 0;
+			addDeviceSettingsFromBuffer(fileName, buffer, length, &list, NULL, isJournal);
+			int i;
+			for(i = 0; i < list.nDeviceSettings; i++) {
+				DeviceSettings * p = &(list.deviceSettings[i]);
+				if(p->inputDeviceName != NULL && findProfile(&list, p->inputDeviceName) == -1) {
+					printf("FAIL: %s: profile '%s' of the first %zu bytes can't be found\n", fileName, p->inputDeviceName, length);
+					failures++;
+				}
+			}
+			freeSettings(&list);
+		}
+		if(length == size) break;
+	}
+	free(buffer);
+}
+
+static void runCase(const char * expectedName, const char * outputName) {
+	size_t nameLength = strlen(expectedName) - strlen(".expected");
+	char * fileName = strndup(expectedName, nameLength);
+	char * journalName = malloc(nameLength + strlen(".journal") + 1);
+	if(fileName == NULL || journalName == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	strcpy(journalName, fileName);
+	strcat(journalName, ".journal");
+
+	size_t expectedSize, resultSize, againSize;
+	char * expected = readFile(expectedName, &expectedSize);
+	char * result = loadAndWrite(fileName, outputName, &resultSize);
+	if(expected == NULL || result == NULL) {
+		printf("FAIL: %s: can't be loaded\n", fileName);
+		failures++;
+	} else if(resultSize != expectedSize || memcmp(result, expected, expectedSize)) {
+		printf("FAIL: %s: profiles differ from %s:\n%s", fileName, expectedName, result);
+		failures++;
+	} else {
+		/* What has been written must read back the same */
+		char * again = loadAndWrite((char *) outputName, outputName, &againSize);
+		if(again == NULL || againSize != resultSize || memcmp(again, result, resultSize)) {
+			printf("FAIL: %s: written profiles don't read back the same\n", fileName);
+			failures++;
+		}
+		free(again);
+	}
+	free(expected);
+	free(result);
+
+	/* The parser's complaints about the cut off lines aren't of interest */
+	fflush(stderr);
+	int oldStderr = dup(2);
+	int devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, 2);
+	close(devNull);
+
+	size_t size;
+	char * text;
+	if((text = readFile(fileName, &size)) != NULL) {
+		parsePrefixes(fileName, text, size);
+		free(text);
+	}
+	if((text = readFile(journalName, &size)) != NULL) {
+		parsePrefixes(journalName, text, size);
+		free(text);
+	}
+
+	fflush(stderr);
+	dup2(oldStderr, 2);
+	close(oldStderr);
+
+	free(fileName);
+	free(journalName);
+}
+
+int main(int argc, char ** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s CASE.expected...\n", argv[0]);
+		return 2;
+	}
+
+	char outputName[64];
+	snprintf(outputName, sizeof outputName, "/tmp/parsertest-%i", (int) getpid());
+
+	int i;
+	for(i = 1; i < argc; i++) {
+		runCase(argv[i], outputName);
+	}
+	unlink(outputName);
+
+	printf("parsertest: %i cases, %i failures\n", argc - 1, failures);
+	return failures > 0;
+}